@@ -0,0 +1,38 @@
+// Digit sums and array indexing, used to time multiply, divide and modulo by constants.
+// The low byte of the final checksum (192) is returned as the exit status.
+
+enum {
+    COUNT = 1000000,
+    ROUNDS = 10
+};
+
+int table[16];
+
+int digits(int n){
+    int sum;
+
+    sum = 0;
+    while (n > 0) {
+        sum = sum + n % 10;
+        n = n / 10;
+    }
+    return sum;
+}
+
+int main(){
+    int round;
+    int i;
+    int sum;
+
+    sum = 0;
+    round = 0;
+    while (round < ROUNDS) {
+        i = 0;
+        while (i < COUNT) {
+            sum = sum + digits(i) + table[i % 16] + i / 4 * 3;
+            i = i + 1;
+        }
+        round = round + 1;
+    }
+    return sum;
+}
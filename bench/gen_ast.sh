@@ -0,0 +1,20 @@
+#!/bin/sh
+# Generate a source file with N expression statements spread over
+# functions of 50 statements each, used to time building and
+# releasing the syntax tree.
+# Usage: gen_ast.sh N > out.c
+
+awk -v n="${1:-1000}" 'BEGIN {
+    f = 0;
+    for (i = 0; i < n; i++) {
+        if (i % 50 == 0) {
+            if (i) print "    return a;\n}\n";
+            printf "int f%d(int a, int b) {\n    int c;\n    c = 0;\n", f++;
+        }
+        printf "    a = (a + b * %d) - (c ^ %d) + (b & a);\n", i, i;
+    }
+    if (n) print "    return a;\n}\n";
+    print "int main() {";
+    print "    return 0;";
+    print "}";
+}'
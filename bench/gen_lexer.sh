@@ -0,0 +1,26 @@
+#!/bin/sh
+# Generate a large source file for lexer throughput, N blocks of
+# comments, indentation and long identifiers. The same names are
+# reused in every block so the symbol table stays small.
+# Usage: gen_lexer.sh N > out.c
+
+awk -v n="${1:-10000}" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        print "// Register layout for controller block, generated from the device description.";
+        print "// Offsets are relative to the base address of the memory mapped window.";
+        print "enum {";
+        print "    CONTROLLER_CONTROL_REGISTER_OFFSET     = 0x00,  // control";
+        print "    CONTROLLER_STATUS_REGISTER_OFFSET      = 0x04,  // status";
+        print "    CONTROLLER_INTERRUPT_MASK_OFFSET       = 0x08,";
+        print "    CONTROLLER_INTERRUPT_STATUS_OFFSET     = 0x0c,";
+        print "    controller_transmit_buffer_offset      = 16,";
+        print "    controller_receive_buffer_offset       = 20,";
+        print "";
+        print "    CONTROLLER_RESET_DELAY_IN_MICROSECONDS = 1000";
+        print "};";
+        print "";
+    }
+    print "int main() {";
+    print "    return CONTROLLER_STATUS_REGISTER_OFFSET;";
+    print "}";
+}'
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Generate a source file declaring N distinct identifiers, used to
+# check that lexing throughput does not depend on the symbol count.
+# Usage: gen_symbols.sh N > out.c
+
+awk -v n="${1:-1000}" 'BEGIN {
+    print "enum {";
+    for (i = 0; i < n; i++) {
+        printf "    sym_%d,\n", i;
+    }
+    print "};";
+    print "";
+    print "int main() {";
+    print "    int x;";
+    print "    x = 0;";
+    for (i = n - 1; i >= 0 && i >= n - 64; i--) {
+        printf "    x = x + sym_%d;\n", i;
+    }
+    print "    return x;";
+    print "}";
+}'
@@ -0,0 +1,69 @@
+// Pixel sums over a screen reached through a struct pointer, used to time loop invariant code motion.
+// The width, the pixel pointer and the row offset y * width do not change in the inner loops.
+// The low byte of the final checksum (64) is returned as the exit status.
+
+enum {
+    WIDTH = 80,
+    HEIGHT = 50,
+    ROUNDS = 15000
+};
+
+struct screen {
+    int width;
+    int height;
+    int* pixels;
+};
+
+int buffer[4000];
+struct screen screen;
+
+void fill(struct screen* s){
+    int x;
+    int y;
+
+    y = 0;
+    while (y < s->height) {
+        x = 0;
+        while (x < s->width) {
+            buffer[y * WIDTH + x] = x * y + 1;
+            x = x + 1;
+        }
+        y = y + 1;
+    }
+}
+
+int checksum(struct screen* s){
+    int x;
+    int y;
+    int sum;
+
+    sum = 0;
+    y = 0;
+    while (y < s->height) {
+        x = 0;
+        while (x < s->width) {
+            sum = sum + s->pixels[y * s->width + x];
+            x = x + 1;
+        }
+        y = y + 1;
+    }
+    return sum;
+}
+
+int main(){
+    int round;
+    int sum;
+
+    screen.width = WIDTH;
+    screen.height = HEIGHT;
+    screen.pixels = buffer;
+
+    sum = 0;
+    round = 0;
+    while (round < ROUNDS) {
+        fill(&screen);
+        sum = sum + checksum(&screen);
+        round = round + 1;
+    }
+    return sum;
+}
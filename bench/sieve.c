@@ -0,0 +1,48 @@
+// Sieve of Eratosthenes over a global array, used to time generated loops.
+// The number of primes below SIZE (564) is returned as the exit status (mod 256).
+
+enum {
+    SIZE = 4096,
+    ROUNDS = 10000
+};
+
+int flags[4096];
+
+int sieve(){
+    int i;
+    int k;
+    int count;
+
+    i = 0;
+    while (i < SIZE) {
+        flags[i] = 1;
+        i = i + 1;
+    }
+
+    count = 0;
+    i = 2;
+    while (i < SIZE) {
+        if (flags[i]) {
+            k = i + i;
+            while (k < SIZE) {
+                flags[k] = 0;
+                k = k + i;
+            }
+            count = count + 1;
+        }
+        i = i + 1;
+    }
+    return count;
+}
+
+int main(){
+    int round;
+    int count;
+
+    round = 0;
+    while (round < ROUNDS) {
+        count = sieve();
+        round = round + 1;
+    }
+    return count;
+}
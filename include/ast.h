@@ -32,17 +32,27 @@ enum ast_nodeType {
     AST_ASM
 };
 
-/* AST Node */
+/**
+ * AST Node
+ * Identifiers are referenced, not copied. The class, type and array flag are
+ * snapshotted at parse time because locals are restored to the shadowed
+ * global definitions when their function ends.
+ */
 struct ast_node {
-    enum ast_nodeType type;
+    unsigned char type;         /* enum ast_nodeType */
+    unsigned char sym_class;    /* Identifier class when parsed, 0 for non identifiers */
+    unsigned char sym_array;    /* Identifier is an array */
     int value;
     int data_type;
+    int sym_type;               /* Identifier type when parsed */
     struct ast_node *left;
     struct ast_node *right;
     struct ast_node *next;
-    struct identifier ident;
-    struct member *member;
-    char* asm_code;
+    union {
+        struct identifier *sym; /* AST_IDENT, AST_FUNCALL, AST_ENTER */
+        struct member *member;  /* AST_MEMBER_ACCESS */
+        char *asm_code;         /* AST_ASM */
+    };
 };
 
 #endif // !__AST_H
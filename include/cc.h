@@ -10,6 +10,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 void *zmalloc(int size);
 
@@ -64,6 +65,12 @@ struct config {
     int elf;
     int org;
     int ast;
+    int time_report;
+    int stats;
+    int ir;
+    int inline_limit;   /* Instructions an inlined body may add over the call it replaces */
+    int opt_level;      /* -O level, selects the passes that run */
+    int time_passes;
 };
 extern struct config config;
 
@@ -99,6 +106,7 @@ extern int *entry;
 
 extern char *data;
 extern char *org_data;
+int data_relocate(int offset);
 
 int dbgprintf(const char *fmt, ...);
 int write_elf_header(char* buffer, int entry, int text_size, int data_size);
@@ -1,9 +1,38 @@
 #ifndef __IO_H__
 #define __IO_H__
 
+struct source_file {
+    char *buffer; /* File contents, always followed by a '\0' */
+    int length;
+    int mapped;
+};
+
+/* Bump allocator, everything is released at once with arena_release() */
+struct arena_chunk {
+    struct arena_chunk *next;
+    int used;
+    int size;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk *chunks;
+    int allocations;
+    int bytes;
+};
+
+void *arena_alloc(struct arena *arena, int size);
+void arena_release(struct arena *arena);
+
 int cc_open(char *file, int flags);
 int cc_read(int fd, char *buffer, int size);
 int cc_close(int fd);
 void cc_write(int fd, char *buffer, int size);
+int cc_write_parts(int fd, char *header, int header_size, char *body, int body_size);
+long cc_clock_us();
+long cc_peak_rss_kb();
+
+int cc_load(char *file, struct source_file *src);
+void cc_unload(struct source_file *src);
 
 #endif
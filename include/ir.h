@@ -0,0 +1,128 @@
+#ifndef __IR_H
+#define __IR_H
+
+#include <ast.h>
+
+/**
+ * Linear three-address IR, one struct ir_func per function.
+ * Values live in virtual registers numbered from 1, 0 means no value.
+ * Locals and globals are only touched through explicit IR_LOAD and IR_STORE,
+ * until ir_promote_locals() turns scalar locals into vregs assigned with IR_MOV.
+ */
+enum ir_op {
+    IR_IMM,     /* dst = imm */
+    IR_LOCAL,   /* dst = %ebp + imm, aux is set if it is the address of a scalar variable */
+    IR_GLOBAL,  /* dst = address of data section offset imm */
+    IR_FUNC,    /* dst = address of function imm */
+    IR_LOAD,    /* dst = size bytes at [a + index * scale + imm] */
+    IR_STORE,   /* size bytes at [a + index * scale + imm] = b */
+    IR_LEA,     /* dst = a + index * scale + imm */
+    IR_BIN,     /* dst = a <aux> b, aux is the operator token */
+    IR_UN,      /* dst = <aux> a */
+    IR_ARG,     /* push a as the next call argument */
+    IR_CALL,    /* dst = call function imm with aux arguments */
+    IR_BUILTIN, /* dst = builtin imm, aux is the interrupt number for INTERRUPT */
+    IR_JMP,     /* jump to block imm */
+    IR_JCC,     /* jump to block imm if a <aux> b, aux is a comparison operator */
+    IR_SWITCH,  /* jump to block entry a - low of switch table imm, its default block when out of range */
+    IR_RET,     /* return a */
+    IR_MOV,     /* dst = a, dst may be assigned more than once */
+    IR_NOP      /* removed instruction */
+};
+
+/* x86 register numbers as encoded in ModRM */
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+/* Locations in ir_func.reg besides a register number */
+#define REG_NONE    -1  /* value is never used */
+#define REG_SPILLED -2  /* value lives in the frame at ir_func.slot */
+
+struct ir_insn {
+    unsigned char op;   /* enum ir_op */
+    unsigned char size; /* Access size in bytes for IR_LOAD and IR_STORE */
+    unsigned char scale;/* 1, 2, 4 or 8 when index is set */
+    int dst;
+    int a;
+    int b;
+    int index;          /* Scaled address operand of IR_LOAD, IR_STORE and IR_LEA, set by instruction selection */
+    int imm;
+    int aux;
+};
+
+/* A basic block is a run of instructions, blocks are laid out in index order */
+struct ir_block {
+    int start;
+    int count;
+};
+
+/* Jump table of a dense range of switch cases */
+struct ir_table {
+    int low;        /* Case value of entry 0 */
+    int count;
+    int otherwise;  /* Block for values outside [low, low + count) */
+    int *blocks;    /* Block of each entry */
+};
+
+/**
+ * A while loop, lowered as a test before the loop and one at the bottom of
+ * the body. The loop runs from block header up to block exit, the empty
+ * preheader block is only reached when the loop is entered.
+ */
+struct ir_loop {
+    int preheader;
+    int header;
+    int exit;
+};
+
+struct ir_func {
+    struct identifier *sym;
+    int frame_size;
+    int vregs;
+
+    struct ir_insn *insns;
+    int insn_count;
+    int insn_capacity;
+
+    struct ir_block *blocks;
+    int block_count;
+    int block_capacity;
+
+    struct ir_table *tables;
+    int table_count;
+    int table_capacity;
+
+    struct ir_loop *loops;  /* Inner loops before the loops containing them */
+    int loop_count;
+    int loop_capacity;
+
+    /* Filled in by ir_allocate_registers() */
+    signed char *reg;
+    int *slot;
+    int saved_regs;     /* Callee-saved registers to preserve, as 1 << reg */
+    int spills;
+};
+
+/* Totals over all functions, printed by --stats */
+struct ir_stats {
+    int promoted;
+    int spilled;
+    int inlined;
+    int tail_calls;
+    int tables;     /* Switches dispatched through a jump table */
+    int hoisted;    /* Loop invariant instructions moved to a preheader */
+};
+extern struct ir_stats ir_stats;
+
+struct ir_func *ir_lower_function(struct ast_node **node);
+void ir_print(struct ir_func *fn);
+void ir_free(struct ir_func *fn);
+
+void ir_inline_calls(struct ir_func *fn);
+void ir_inline_record(struct ir_func *fn);
+void ir_inline_free();
+
+void ir_promote_locals(struct ir_func *fn);
+void ir_hoist_invariants(struct ir_func *fn);
+void ir_allocate_registers(struct ir_func *fn, unsigned char *fixed);
+
+#endif // !__IR_H
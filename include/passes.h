@@ -0,0 +1,52 @@
+#ifndef __PASSES_H
+#define __PASSES_H
+
+#include <ast.h>
+#include <ir.h>
+
+/* Optimization passes in the order they run */
+enum pass_id {
+    PASS_FOLD,          /* AST: constant folding */
+    PASS_EVAL,          /* AST: calls with constant arguments replaced by their result */
+    PASS_SHAKE,         /* AST: removal of functions unreachable from main */
+    PASS_INLINE,        /* IR: inlining of small leaf functions */
+    PASS_PROMOTE,       /* IR: scalar locals kept in vregs */
+    PASS_LICM,          /* IR: loop invariant code motion */
+    PASS_JUMP_TABLES,   /* Lowering: dense switches through jump tables */
+    PASS_ADDRESSING,    /* Codegen: scaled index address operands */
+    PASS_STRENGTH,      /* Codegen: multiply and divide by constants without imul and idiv */
+    PASS_TAIL_CALLS,    /* Codegen: calls in tail position as jumps */
+    PASS_PEEPHOLE,      /* Codegen: peephole optimizer over the machine code */
+    PASS_COUNT
+};
+
+struct pass {
+    const char *name;   /* As given to -fno-<name> */
+    int level;          /* Lowest -O level running the pass */
+    const char *unit;   /* What delta counts */
+    int (*run_ast)(struct ast_node **root);
+    void (*run_ir)(struct ir_func *fn);
+    int disabled;       /* Set by -fno-<name> */
+    int changes;        /* Sum of what run_ast returned */
+    int runs;
+    long time;          /* Microseconds spent in the pass */
+    int delta;          /* Change in units, only counted with --time-passes */
+};
+extern struct pass passes[PASS_COUNT];
+
+int pass_enabled(int id);
+int pass_disable(const char *name);
+long pass_begin();
+void pass_end(int id, long start, int delta);
+int ir_count_insns(struct ir_func *fn);
+
+int constant_value(struct ast_node *node, int *result);
+int fold_constants(struct ast_node *root);
+int evaluate_calls(struct ast_node **root);
+int shake_functions(struct ast_node **root);
+
+void passes_run_ast(struct ast_node **root);
+void passes_run_ir(struct ir_func *fn);
+void passes_print_times();
+
+#endif // !__PASSES_H
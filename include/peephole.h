@@ -0,0 +1,15 @@
+#ifndef __PEEPHOLE_H
+#define __PEEPHOLE_H
+
+/* Totals over all functions, printed by --stats */
+struct peephole_stats {
+    int insns;      /* Instructions removed */
+    int bytes;      /* Bytes removed, including shortened jumps */
+    int jumps;      /* Jumps shortened to rel8 */
+};
+extern struct peephole_stats peephole_stats;
+
+int peephole(unsigned char *code, int start, int end, int *labels, int label_count);
+void peephole_print_stats();
+
+#endif // !__PEEPHOLE_H
@@ -18,6 +18,9 @@
 
 #include <ast.h>
 #include <cc.h>
+#include <ir.h>
+#include <peephole.h>
+#include <passes.h>
 #include <func.h>
 #include <io.h>
 
@@ -25,18 +28,36 @@
 #include <libc.h>
 #endif
 
-void generate_x86(struct ast_node *node, void *file);
 void print_ast(struct ast_node *root);
 void write_x86(struct ast_node *node, char* data_section, int data_section_size);
+int write_opcodes();
+int data_compact(char *data, int size);
+void shake_print_stats();
 void run_virtual_machine(int *pc, int* code, char *data, int argc, char *argv[]);
 int cleanup();
 
 #define DEBUG
 #undef DEBUG
 
-#define IS_LETTER(x) ((x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z') || x == '_')
-#define IS_DIGIT(x) (x >= '0' && x <= '9')
-#define IS_HEX_DIGIT(x) (IS_DIGIT(x) || (x >= 'a' && x <= 'f') || (x >= 'A' && x <= 'F'))
+#if defined(NATIVE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define LEX_SSE2
+#endif
+
+/* Character classes, filled in by init_char_class() */
+enum {
+    CC_LETTER = 1,
+    CC_DIGIT = 2,
+    CC_HEX = 4,
+    CC_SPACE = 8 /* Whitespace including '\n' */
+};
+static unsigned char char_class[256];
+
+#define IS_LETTER(x) (char_class[(unsigned char)(x)] & CC_LETTER)
+#define IS_DIGIT(x) (char_class[(unsigned char)(x)] & CC_DIGIT)
+#define IS_HEX_DIGIT(x) (char_class[(unsigned char)(x)] & (CC_DIGIT | CC_HEX))
+#define IS_IDENT(x) (char_class[(unsigned char)(x)] & (CC_LETTER | CC_DIGIT))
+#define IS_SPACE(x) (char_class[(unsigned char)(x)] & CC_SPACE)
 
 static char *current_position;
 static char *last_position;
@@ -57,8 +78,47 @@ static int current_enter_size;
 
 static int line;
 
-static struct identifier *sym_table;
 static struct identifier *last_identifier = {0};
+
+/**
+ * Identifiers live in chunks of SYM_CHUNK_SIZE entries which are never
+ * moved, AST nodes and struct members keep pointers into them.
+ * Only the array of chunk pointers is reallocated when it fills up.
+ */
+#define SYM_CHUNK_SIZE 256
+#define SYM_AT(i) (sym_chunks[(i) / SYM_CHUNK_SIZE] + (i) % SYM_CHUNK_SIZE)
+
+static struct identifier **sym_chunks;
+static int sym_chunk_count;
+static int sym_count;
+
+/**
+ * Open addressing index over the identifiers, keyed on identifier->hash.
+ * Slots hold the identifier index + 1, 0 marks an empty slot.
+ */
+static int *sym_index;
+static int sym_index_size;
+static int sym_index_bits;  /* log2(sym_index_size) */
+
+static int source_size;
+
+/**
+ * Token stream written by tokenize() and consumed by the parser through next().
+ * Stored as a structure of arrays, value holds the symbol index for identifiers
+ * and keywords, the literal for numbers and strings and the asm block index
+ * for the '{' opening an asm block.
+ */
+static struct token_stream {
+    unsigned char *kind;
+    int *value;
+    int *line;
+    int count;
+    int capacity;
+    int pos;
+} tokens;
+
+static char **asm_blocks;
+static int asm_count;
 static struct member *members[MAX_MEMBERS] = {0};
 
 static struct ast_node *ast_root;
@@ -68,18 +128,79 @@ static struct ast_node *current = NULL;
 /* Prototypes */
 struct ast_node *parse();
 static void next();
+static void lex();
+static void tokenize();
 static struct ast_node *expression(int level);
 static struct ast_node *statement();
 static void include(char *file);
-static int free_ast(struct ast_node *node);
+static struct ast_node *ast_alloc();
 static void dump_identifier(struct identifier *id);
 
-int free_ast(struct ast_node *node) {
-    if (!node) return 0;
-    free_ast(node->left);
-    free_ast(node->right);
-    free(node);
-    return 0;
+/**
+ * Fibonacci hashing: the top bits of the product depend on all bits of
+ * hash, the low ones only on its low bits, which mostly encode the name length
+ */
+#define SYM_SLOT(hash) (((unsigned int)(hash) * 2654435769u) >> (32 - sym_index_bits))
+
+static void sym_index_grow() {
+    int *old_index = sym_index;
+    int old_size = sym_index_size;
+
+    sym_index_size = old_size ? old_size * 2 : 1024;
+    sym_index_bits = old_size ? sym_index_bits + 1 : 10;
+    sym_index = zmalloc(sym_index_size * sizeof(int));
+    if (!sym_index) {printf("Unable to malloc sym_index\n");exit(-1);}
+
+    for (int i = 0; i < old_size; i++) {
+        if (!old_index[i]) continue;
+
+        int slot = SYM_SLOT(SYM_AT(old_index[i] - 1)->hash);
+        while (sym_index[slot]) {
+            slot = (slot + 1) & (sym_index_size - 1);
+        }
+        sym_index[slot] = old_index[i];
+    }
+    free(old_index);
+}
+
+static struct identifier *sym_new() {
+    if (sym_count == sym_chunk_count * SYM_CHUNK_SIZE) {
+        /* Chunk pointer array doubles, starting at 16 chunks */
+        if (!(sym_chunk_count & (sym_chunk_count - 1))) {
+            struct identifier **chunks = zmalloc((sym_chunk_count ? sym_chunk_count * 2 : 16) * sizeof(struct identifier *));
+            if (!chunks) {printf("Unable to malloc sym_chunks\n");exit(-1);}
+            if (sym_chunks) {
+                memcpy(chunks, sym_chunks, sym_chunk_count * sizeof(struct identifier *));
+                free(sym_chunks);
+            }
+            sym_chunks = chunks;
+        }
+
+        sym_chunks[sym_chunk_count] = zmalloc(SYM_CHUNK_SIZE * sizeof(struct identifier));
+        if (!sym_chunks[sym_chunk_count]) {printf("Unable to malloc sym_table chunk\n");exit(-1);}
+        sym_chunk_count++;
+    }
+    sym_count++;
+    return SYM_AT(sym_count - 1);
+}
+
+/* Locals go out of scope, restore the shadowed global definitions */
+static void sym_restore_locals() {
+    for (int i = 0; i < sym_count; i++) {
+        struct identifier *id = SYM_AT(i);
+        if (id->class == Loc) {
+            id->class = id->hclass;
+            id->type = id->htype;
+            id->val = id->hval;
+        }
+    }
+}
+
+/* AST nodes live in one arena for the whole compile and are released together */
+static struct arena ast_arena;
+
+static struct ast_node *ast_alloc() {
+    return arena_alloc(&ast_arena, sizeof(struct ast_node));
 }
 
 int dbgprintf(const char *fmt, ...){
@@ -95,9 +216,10 @@ int dbgprintf(const char *fmt, ...){
 
 struct include_file {
     char file[256];
-    char* buffer;
+    struct source_file source;
 } includes[32] = {0};
 static int include_count = 0;
+static struct source_file source;
 
 static int find_include(char *file) {
     for (int i = 0; i < include_count; i++) {
@@ -109,10 +231,10 @@ static int find_include(char *file) {
     return 0;
 }
 
-static int add_include(char *file, char *buffer) {
+static int add_include(char *file, struct source_file *src) {
     if (include_count < 32) {
         strcpy(includes[include_count].file, file);
-        includes[include_count].buffer = buffer;
+        includes[include_count].source = *src;
         include_count++;
         return 1;
     }
@@ -120,7 +242,8 @@ static int add_include(char *file, char *buffer) {
 }
 
 static void include(char *file) {
-    int fd, len;
+    struct source_file include_source;
+    int len;
 
     if (find_include(file)) {
         dbgprintf("Already included: %s\n", file);
@@ -133,64 +256,156 @@ static void include(char *file) {
     char *original_last_position;
     int original_line;
 
-    /* Store the current parsing state */
+    /* Store the current lexing state */
     original_position = current_position;
     original_last_position = last_position;
     original_line = line;
 
-    char *include_buffer = zmalloc(POOL_SIZE);
-    if (include_buffer == NULL) {
-        printf("Failed to allocate memory for include buffer");
+    len = cc_load(file, &include_source);
+    if (len < 0) {
+        printf("Unable to open include file");
         exit(EXIT_FAILURE);
     }
+    if (len == 0) {
+        printf("Failed to read from file");
+        cc_unload(&include_source);
+        exit(EXIT_FAILURE);
+    }
+    source_size += len;
 
-    fd = cc_open(file,
-#ifndef NATIVE
-        FS_FILE_FLAG_READ
-#else
-        O_RDONLY
-#endif
-    );
-    if (fd >= 0) {
-        len = cc_read(fd, include_buffer, POOL_SIZE - 1);
-        if (len > 0) {
-            include_buffer[len] = '\0';
-            cc_close(fd);  // Close file descriptor after reading
+    /* Switch to new file */
+    current_position = include_source.buffer;
+    last_position = include_source.buffer + len;
 
-            /* Switch to new file */
-            current_position = include_buffer;
-            last_position = include_buffer + len;
+    line = 1;
+    tokenize();
 
-            line = 1;
-            next();
-            parse();
+    /* Restore the original parsing state */
+    current_position = original_position;
+    last_position = original_last_position;
+    line = original_line;
+
+    dbgprintf("Finished including file: %s\n", file);
 
-            /* Restore the original parsing state */
-            current_position = original_position;
-            last_position = original_last_position;
-            line = original_line;
+    add_include(file, &include_source);
+}
 
-            dbgprintf("Finished including file: %s\n", file);
+static void init_char_class() {
+    int c;
+    for (c = 'a'; c <= 'z'; c++) char_class[c] |= CC_LETTER;
+    for (c = 'A'; c <= 'Z'; c++) char_class[c] |= CC_LETTER;
+    for (c = '0'; c <= '9'; c++) char_class[c] |= CC_DIGIT;
+    for (c = 'a'; c <= 'f'; c++) char_class[c] |= CC_HEX;
+    for (c = 'A'; c <= 'F'; c++) char_class[c] |= CC_HEX;
+    char_class['_'] |= CC_LETTER;
+    char_class[' '] |= CC_SPACE;
+    char_class['\t'] |= CC_SPACE;
+    char_class['\n'] |= CC_SPACE;
+    char_class['\v'] |= CC_SPACE;
+    char_class['\f'] |= CC_SPACE;
+    char_class['\r'] |= CC_SPACE;
+}
 
-            add_include(file, include_buffer);
-            return;
-        } else {
-            printf("Failed to read from file");
-            cc_close(fd);
-            free(include_buffer);
-            exit(EXIT_FAILURE);
+#ifdef LEX_SSE2
+/**
+ * The scanners below only use 16 byte aligned loads. An aligned load never
+ * crosses a page boundary, so reading past the '\0' sentinel is safe.
+ * Bytes in front of the start position are masked out of the first block.
+ */
+#define LEX_BLOCK(p) ((const __m128i *)((unsigned long)(p) & ~15UL))
+#define LEX_SKEW(p) ((unsigned long)(p) & 15)
+
+/* Mask of bytes that are in [lo, hi], bytes >= 0x80 compare as negative */
+static inline __m128i lex_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+/* First byte that can not be part of an identifier */
+static char *scan_ident(char *p) {
+    const __m128i *block = LEX_BLOCK(p);
+    unsigned int mask = ~0u << LEX_SKEW(p);
+
+    while (1) {
+        __m128i v = _mm_load_si128(block);
+        __m128i ident = _mm_or_si128(
+            _mm_or_si128(lex_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'), lex_range(v, '0', '9')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+
+        unsigned int end = ~_mm_movemask_epi8(ident) & mask & 0xffff;
+        if (end) return (char *)block + __builtin_ctz(end);
+
+        mask = ~0u;
+        block++;
+    }
+}
+
+/* First non whitespace byte, counting the newlines on the way */
+static char *scan_space(char *p) {
+    const __m128i *block = LEX_BLOCK(p);
+    unsigned int mask = ~0u << LEX_SKEW(p);
+
+    while (1) {
+        __m128i v = _mm_load_si128(block);
+        __m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+        __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), nl), lex_range(v, '\t', '\r'));
+
+        unsigned int newlines = _mm_movemask_epi8(nl) & mask;
+        unsigned int end = ~_mm_movemask_epi8(space) & mask & 0xffff;
+        if (end) {
+            line += __builtin_popcount(newlines & ((1u << __builtin_ctz(end)) - 1));
+            return (char *)block + __builtin_ctz(end);
         }
-    } else {
-        printf("Unable to open include file");
-        free(include_buffer);
-        exit(EXIT_FAILURE);
+        line += __builtin_popcount(newlines);
+
+        mask = ~0u;
+        block++;
     }
 }
 
-static void next() {
+/* Next '\n' or '\0', used to skip line comments */
+static char *scan_line(char *p) {
+    const __m128i *block = LEX_BLOCK(p);
+    unsigned int mask = ~0u << LEX_SKEW(p);
+
+    while (1) {
+        __m128i v = _mm_load_si128(block);
+        __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+        unsigned int end = _mm_movemask_epi8(stop) & mask;
+        if (end) return (char *)block + __builtin_ctz(end);
+
+        mask = ~0u;
+        block++;
+    }
+}
+#else
+static char *scan_ident(char *p) {
+    while (IS_IDENT(*p)) p++;
+    return p;
+}
+
+static char *scan_space(char *p) {
+    while (IS_SPACE(*p)) {
+        if (*p++ == '\n') ++line;
+    }
+    return p;
+}
+
+static char *scan_line(char *p) {
+    while (*p != 0 && *p != '\n') p++;
+    return p;
+}
+#endif
+
+static void lex() {
     char *position;
 
     while((token = *current_position)){
+        /* Skip whitespace runs in one go */
+        if(IS_SPACE(token)){
+            current_position = scan_space(current_position);
+            continue;
+        }
         ++current_position;
 
         /* Check if new identifier*/
@@ -198,26 +413,32 @@ static void next() {
             /* Store the current position */
             position = current_position - 1;
 
-            /* Move to the end of the identifier */
-            while(IS_LETTER(*current_position) || IS_DIGIT(*current_position)){
+            /* Find the end of the identifier, then hash it */
+            char *end = scan_ident(current_position);
+            while(current_position < end){
                 token = token * 147 + *current_position++;
             }
 
-             /* Hash the token and include the length */
+            /* Hash the token and include the length */
             token = (token << 6) + (current_position - position);
-            last_identifier = sym_table;
 
-            /* Iterate over the symbol table to check for existing identifiers */
-            while(last_identifier->tk){
+            /* Probe the hash index for an existing identifier */
+            int slot = SYM_SLOT(token);
+            while (sym_index[slot]) {
+                last_identifier = SYM_AT(sym_index[slot] - 1);
                 /* Compare the hash and name of the current identifier with the token */
-                if(token == last_identifier->hash && !memcmp(last_identifier->name, position, current_position - position)){
+                if(token == last_identifier->hash && last_identifier->name_length == current_position - position
+                    && !memcmp(last_identifier->name, position, current_position - position)){
                     token = last_identifier->tk;
+                    ival = sym_index[slot] - 1;
                     return;
                 }
-                last_identifier = last_identifier + 1;
+                slot = (slot + 1) & (sym_index_size - 1);
             }
 
             /* Store the name, hash, and token type of the new identifier */
+            last_identifier = sym_new();
+            sym_index[slot] = sym_count;
             last_identifier->name = position;
             last_identifier->name_length = current_position - position;
 
@@ -226,12 +447,18 @@ static void next() {
             last_identifier->tk = Id;
             last_identifier->class = 0;
             token = Id;
+            ival = sym_count - 1;
+
+            /* Keep the load factor at or below 1/2 */
+            if (sym_count * 2 > sym_index_size) {
+                sym_index_grow();
+            }
             return;
 
         } else if (IS_DIGIT(token)){
             /* Convert the token to an integer */
             if((ival = token - '0')){
-                while (*current_position >= '0' && *current_position <= '9')
+                while (IS_DIGIT(*current_position))
                     ival = ival * 10 + *current_position++ - '0'; 
             } else if(*current_position == 'x' || *current_position == 'X'){
                 /* Hex */
@@ -248,18 +475,11 @@ static void next() {
             return;
         }
 
-        /* Check for new line, spaces, tabs, etc */
         switch(token){
-            case '\n':
-                ++line;
-            case ' ': case '\t': case '\v': case '\f': case '\r':
-                break;
             /* Check for comments or division */
             case '/':
                 if(*current_position == '/'){
-                    while(*current_position != 0 && *current_position != '\n'){
-                        ++current_position;
-                    }
+                    current_position = scan_line(current_position);
                 } else {
                     token = Div;
                     return;
@@ -291,7 +511,7 @@ static void next() {
             /* Check for string literals */
             case '"':
             case '\'':
-                /* Write string to data */
+                /* Write string to data, character literals are only a Num */
                 position = data;
                 while (*current_position != 0 && *current_position != token) {
                     if ((ival = *current_position++) == '\\') {
@@ -303,11 +523,15 @@ static void next() {
                             case 'r': ival = '\r';
                         }
                     }
-                    *data++ = ival;
+                    if (token == '"') *data++ = ival;
                 }
-                *data++ = 0; /* Null-terminate the string */
                 ++current_position;
-                if (token == '"') ival = (int) position; else token = Num;
+                if (token == '"') {
+                    *data++ = 0; /* Null-terminate the string */
+                    ival = (int) position;
+                } else {
+                    token = Num;
+                }
                 return;
             case '=':
                 /* Check for equality or assignment */
@@ -395,6 +619,113 @@ static void next() {
     }
 }
 
+static void token_push() {
+    if (tokens.count == tokens.capacity) {
+        int capacity = tokens.capacity ? tokens.capacity * 2 : 4096;
+        unsigned char *kind = zmalloc(capacity);
+        int *value = zmalloc(capacity * sizeof(int));
+        int *lines = zmalloc(capacity * sizeof(int));
+        if (!kind || !value || !lines) {printf("Unable to malloc token stream\n");exit(-1);}
+
+        if (tokens.count) {
+            memcpy(kind, tokens.kind, tokens.count);
+            memcpy(value, tokens.value, tokens.count * sizeof(int));
+            memcpy(lines, tokens.line, tokens.count * sizeof(int));
+        }
+        free(tokens.kind);
+        free(tokens.value);
+        free(tokens.line);
+
+        tokens.kind = kind;
+        tokens.value = value;
+        tokens.line = lines;
+        tokens.capacity = capacity;
+    }
+
+    tokens.kind[tokens.count] = token;
+    tokens.value[tokens.count] = ival;
+    tokens.line[tokens.count] = line;
+    tokens.count++;
+}
+
+/**
+ * @brief Copy the raw body of an asm block, current_position is just past the '{'.
+ * The code is stored in asm_blocks and the lexer continues at the closing '}'.
+ * @return index into asm_blocks
+ */
+static int lex_asm_block() {
+    char *asm_code_start = current_position;
+
+    // Collect assembly code until the closing brace
+    while (*current_position != '}' && *current_position != '\0') {
+        if (*current_position == '\n') ++line;
+        current_position++;
+    }
+
+    if (*current_position == '\0') {
+        printf("%d: Unexpected end of file in asm block\n", line);
+        exit(-1);
+    }
+
+    size_t asm_code_length = current_position - asm_code_start;
+    char *asm_code = (char *)malloc(asm_code_length + 1);
+    if (!asm_code) {
+        printf("Failed to allocate memory for asm code\n");
+        exit(-1);
+    }
+    strncpy(asm_code, asm_code_start, asm_code_length);
+    asm_code[asm_code_length] = '\0';
+
+    if (!(asm_count & (asm_count - 1))) {
+        char **blocks = zmalloc((asm_count ? asm_count * 2 : 8) * sizeof(char *));
+        if (!blocks) {printf("Failed to allocate memory for asm code\n");exit(-1);}
+        if (asm_blocks) {
+            memcpy(blocks, asm_blocks, asm_count * sizeof(char *));
+            free(asm_blocks);
+        }
+        asm_blocks = blocks;
+    }
+    asm_blocks[asm_count] = asm_code;
+    return asm_count++;
+}
+
+/**
+ * @brief Lex the current buffer to the end and append the tokens to the stream.
+ * Included files are lexed into the same stream, without their EOF token.
+ */
+static void tokenize() {
+    while (1) {
+        lex();
+        if (!token) return;
+
+        /* Both `asm { ... }` and `asm name { ... }` take their body as raw text */
+        if (token == '{' && ((tokens.count >= 1 && tokens.kind[tokens.count - 1] == Asm)
+            || (tokens.count >= 2 && tokens.kind[tokens.count - 1] == Id && tokens.kind[tokens.count - 2] == Asm))) {
+            ival = lex_asm_block();
+        }
+
+        /* Keep data aligned after a run of string literals */
+        if (token != '"' && tokens.count && tokens.kind[tokens.count - 1] == '"') {
+            data = (char *)(((long)data + sizeof(int)) & -sizeof(int));
+        }
+        token_push();
+    }
+}
+
+/* Advance the parser to the next token in the stream */
+static void next() {
+    token = tokens.kind[tokens.pos];
+    ival = tokens.value[tokens.pos];
+    line = tokens.line[tokens.pos];
+
+    /* Identifiers and keywords carry their symbol index */
+    if (token == Id || (token >= Break && token <= Asm)) {
+        last_identifier = SYM_AT(ival);
+    }
+
+    if (token) tokens.pos++;
+}
+
 /* Parse prototypes */
 static struct ast_node *create_ast_node(int type, int value, int data_type);
 static struct ast_node *parse_sizeof();
@@ -432,7 +763,6 @@ static struct ast_node *expression(int level) {
             while (token == '"') {
                 next();
             }
-            data = (char *)(((long)data + sizeof(int)) & -sizeof(int));
             break;
         case Sizeof:
             node = parse_sizeof();
@@ -488,8 +818,16 @@ static struct ast_node *expression(int level) {
     return node;
 }
 
+/* Reference id from node, keeping what sym_restore_locals() will overwrite */
+static void ast_set_sym(struct ast_node *node, struct identifier *id) {
+    node->sym = id;
+    node->sym_class = id->class;
+    node->sym_type = id->type;
+    node->sym_array = id->array != 0;
+}
+
 static struct ast_node *create_ast_node(int type, int value, int data_type) {
-    struct ast_node *node = zmalloc(sizeof(struct ast_node));
+    struct ast_node *node = ast_alloc();
     node->type = type;
     node->value = value;
     node->data_type = data_type;
@@ -544,7 +882,7 @@ static struct ast_node *parse_identifier() {
 
     if(token == '('){
         node = create_ast_node(AST_FUNCALL, 0, 0);
-        node->ident = *id;
+        ast_set_sym(node, id);
         next();
 
         int args = id->args;
@@ -572,7 +910,7 @@ static struct ast_node *parse_identifier() {
         type = id->type;
     } else {
         node = create_ast_node(AST_IDENT, 0, id->type);
-        node->ident = *id;
+        ast_set_sym(node, id);
         if(id->class == Loc){
             if(id->loc_type == LOCAL_DEFINTION){
                 node->value = -id->val;
@@ -906,7 +1244,7 @@ static struct ast_node *parse_member_access(struct ast_node *left) {
 
 static struct ast_node *parse_member_func_call(struct ast_node *node) {
     struct ast_node *func_call_node = create_ast_node(AST_FUNCALL, 0, 0);
-    func_call_node->ident = *node->member->ident;
+    ast_set_sym(func_call_node, node->member->ident);
 
     next();
 
@@ -963,7 +1301,7 @@ static struct ast_node *parse_array_access(struct ast_node *left) {
     node->right = right;
     left = node;
 
-    node = create_ast_node(left->left->ident.array == 0 ? AST_DEREF : AST_ADDR, 0, left->data_type - PTR);
+    node = create_ast_node(left->left->sym_array == 0 ? AST_DEREF : AST_ADDR, 0, left->data_type - PTR);
     node->left = left;
 
     return node;
@@ -990,10 +1328,10 @@ static struct ast_node *statement() {
             }
             next();
 
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_IF;
             node->left = condition;
-            node->right = zmalloc(sizeof(struct ast_node));
+            node->right = ast_alloc();
             node->right->left = statement();
 
             if(token == Else){
@@ -1013,32 +1351,13 @@ static struct ast_node *statement() {
                 exit(-1);
             }
 
-            char *asm_code_start = current_position;
-
-            // Collect assembly code until the closing brace
-            while (*current_position != '}' && *current_position != '\0') {
-                current_position++;
-            }
-
-            if (*current_position == '\0') {
-                printf("%d: Unexpected end of file in asm block\n", line);
-                exit(-1);
-            }
-
-            size_t asm_code_length = current_position - asm_code_start;
-            char *asm_code = (char *)malloc(asm_code_length + 1);
-            if (!asm_code) {
-                printf("Failed to allocate memory for asm code\n");
-                exit(-1);
-            }
-            strncpy(asm_code, asm_code_start, asm_code_length);
-            asm_code[asm_code_length] = '\0';
+            // The lexer collected the assembly code up to the closing brace
+            char *asm_code = asm_blocks[ival];
 
             next(); // Consume the closing `}`
 
             // Create an AST node for the inline `asm` block
-            node = zmalloc(sizeof(struct ast_node));
-            node->ident = (struct identifier){0};
+            node = ast_alloc();
             node->type = AST_ASM;
             node->asm_code = asm_code;
 
@@ -1059,7 +1378,7 @@ static struct ast_node *statement() {
             }
             next();
 
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_WHILE;
             node->left = condition;
             node->right = statement();
@@ -1082,7 +1401,7 @@ static struct ast_node *statement() {
             }
             next();
 
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_SWITCH;
             node->left = condition;
             node->right = statement();
@@ -1091,7 +1410,7 @@ static struct ast_node *statement() {
         
         case Case:
             next();
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_CASE;
             node->left = expression(Or);
             if(token != ':'){
@@ -1111,7 +1430,7 @@ static struct ast_node *statement() {
             }
             next();
 
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_BREAK;
 
             return node;
@@ -1124,7 +1443,7 @@ static struct ast_node *statement() {
             }
             next();
 
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_DEFAULT;
             node->left = statement();
 
@@ -1132,7 +1451,7 @@ static struct ast_node *statement() {
 
         case Return:
             next();
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_RETURN;
             node->value = current_enter_size;
             if(token != ';'){
@@ -1151,7 +1470,7 @@ static struct ast_node *statement() {
 
         case '{':
             next();
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_BLOCK;
             node->left = statement();
             struct ast_node *current = node->left;
@@ -1165,7 +1484,7 @@ static struct ast_node *statement() {
         
         case ';':
             next();
-            node = zmalloc(sizeof(struct ast_node));
+            node = ast_alloc();
             node->type = AST_EXPR_STMT;
             node->left = NULL;
             return node;
@@ -1177,7 +1496,7 @@ static struct ast_node *statement() {
                 exit(-1);
             }
             next();
-            struct ast_node *stmt = zmalloc(sizeof(struct ast_node));
+            struct ast_node *stmt = ast_alloc();
             stmt->type = AST_EXPR_STMT;
             stmt->left = node;
             return stmt;
@@ -1283,26 +1602,8 @@ struct ast_node* parse() {
                 exit(-1);
             }
 
-            char *asm_code_start = current_position;
-
-            // Collect assembly code until the closing brace
-            while (*current_position != '}' && *current_position != '\0') {
-                current_position++;
-            }
-
-            if (*current_position == '\0') {
-                printf("%d: Unexpected end of file in asm block\n", line);
-                exit(-1);
-            }
-
-            size_t asm_code_length = current_position - asm_code_start;
-            char *asm_code = (char *)malloc(asm_code_length + 1);
-            if (!asm_code) {
-                printf("Failed to allocate memory for asm code\n");
-                exit(-1);
-            }
-            strncpy(asm_code, asm_code_start, asm_code_length);
-            asm_code[asm_code_length] = '\0';
+            // The lexer collected the assembly code up to the closing brace
+            char *asm_code = asm_blocks[ival];
 
             next(); // Consume the closing `}`
 
@@ -1311,9 +1612,8 @@ struct ast_node* parse() {
             id->val = (int)asm_code; // Store the code pointer for later use
 
             // Create an AST node for the `asm` block
-            struct ast_node *asm_node = (struct ast_node *)zmalloc(sizeof(struct ast_node));
+            struct ast_node *asm_node = ast_alloc();
             asm_node->type = AST_ASM;
-            asm_node->ident = *id;
             asm_node->asm_code = asm_code;
 
             if (!root) {
@@ -1499,10 +1799,10 @@ void parse_global_declarations(int bt) {
 
             int loc_decl_i = parse_local_declarations();
 
-            struct ast_node *enter_node = zmalloc(sizeof(struct ast_node));
+            struct ast_node *enter_node = ast_alloc();
             enter_node->type = AST_ENTER;
             enter_node->value = (loc_decl_i);
-            enter_node->ident = *func;
+            ast_set_sym(enter_node, func);
 
             current_enter_size = loc_decl_i;
 
@@ -1520,7 +1820,7 @@ void parse_global_declarations(int bt) {
             }
 
             if(current->type != AST_RETURN) {
-                struct ast_node *ret_node = zmalloc(sizeof(struct ast_node));
+                struct ast_node *ret_node = ast_alloc();
                 ret_node->type = AST_LEAVE;
                 ret_node->value = current_enter_size;
 
@@ -1528,15 +1828,7 @@ void parse_global_declarations(int bt) {
                 current = ret_node;
             }
 
-            last_identifier = sym_table;
-            while(last_identifier->tk) {
-                if(last_identifier->class == Loc) {
-                    last_identifier->class = last_identifier->hclass;
-                    last_identifier->type = last_identifier->htype;
-                    last_identifier->val = last_identifier->hval;
-                }
-                last_identifier = last_identifier + 1;
-            }
+            sym_restore_locals();
         } else {
             last_identifier->class = Glo;
             last_identifier->val = (int)data;
@@ -1593,10 +1885,10 @@ void parse_struct_members(int bt, struct identifier *current_struct) {
 
                 int loc_decl_i = parse_local_declarations();
                 
-                struct ast_node *enter_node = zmalloc(sizeof(struct ast_node));
+                struct ast_node *enter_node = ast_alloc();
                 enter_node->type = AST_ENTER;
                 enter_node->value = loc_decl_i;
-                enter_node->ident = *func;
+                ast_set_sym(enter_node, func);
                 if (!root) {
                     root = enter_node;
                 } else {
@@ -1613,7 +1905,7 @@ void parse_struct_members(int bt, struct identifier *current_struct) {
                 }
 
                 if(current->type != AST_RETURN) {
-                    struct ast_node *ret_node = zmalloc(sizeof(struct ast_node));
+                    struct ast_node *ret_node = ast_alloc();
                     ret_node->type = AST_LEAVE;
                     ret_node->value = loc_decl_i;
 
@@ -1623,15 +1915,7 @@ void parse_struct_members(int bt, struct identifier *current_struct) {
 
                 next();
 
-                last_identifier = sym_table;
-                while(last_identifier->tk) {
-                    if(last_identifier->class == Loc) {
-                        last_identifier->class = last_identifier->hclass;
-                        last_identifier->type = last_identifier->htype;
-                        last_identifier->val = last_identifier->hval;
-                    }
-                    last_identifier = last_identifier + 1;
-                }
+                sym_restore_locals();
                 continue;
             }
 
@@ -1665,24 +1949,8 @@ void parse_struct_members(int bt, struct identifier *current_struct) {
 }
 
 void compile_and_run(char* filename, int argc, char *argv[]){
-    
-    int fd;
-
-    if ((fd = cc_open(config.source,
-#ifndef NATIVE
-        FS_FILE_FLAG_READ
-#else
-        O_RDONLY
-#endif
-    )) < 0)
-    {
-        printf("Unable to open source file: %s\n", config.source);
-        exit(-1);
-    }
 
     /* Allocate memory */
-    sym_table = (struct identifier *)zmalloc(POOL_SIZE);
-    if (!sym_table) {printf("Unable to malloc sym_table\n");exit(-1);}
 
     org_data = data = (char *)zmalloc(POOL_SIZE);
     if (!data) {printf("Unable to malloc data\n");exit(-1);}
@@ -1690,60 +1958,119 @@ void compile_and_run(char* filename, int argc, char *argv[]){
     type_size = (int *)zmalloc(PTR * sizeof(int));
     if (!type_size) {printf("Unable to malloc type_size\n");exit(-1);}
 
+    sym_count = 0;
+    sym_index_grow();
+    init_char_class();
+
     memset(members, 0, MAX_MEMBERS * sizeof(struct member *));
     current_position = keywords;
 
     /* Read in symbols */
     int i = Break;
     while (i <= Asm) {
-        next();
+        lex();
         last_identifier->tk = i++;
     }
 
     /* Read in keywords */
     i = INTERRUPT;
     while (i <= __UNUSED) {
-        next();
+        lex();
         last_identifier->class = Sys;
         last_identifier->type = INT;
         last_identifier->val = i++;
     }
     i = EXIT;
-    next();
+    lex();
     last_identifier->tk = Char;
-    next();
+    lex();
 
     /* Read in src file */
-    if (!(last_position = current_position = zmalloc(POOL_SIZE))) {
-        printf("could not zmalloc(%d) source area\n", POOL_SIZE);
+    if ((i = cc_load(config.source, &source)) < 0) {
+        printf("Unable to open source file: %s\n", config.source);
         exit(-1);
     }
-
-    if ((i = cc_read(fd, current_position, POOL_SIZE - 1)) <= 0) {
-        printf("cc_read() returned %d\n", i);
+    if (i == 0) {
+        printf("Source file is empty: %s\n", config.source);
         exit(-1);
     }
 
-    current_position[i] = 0;
-    cc_close(fd);
+    current_position = source.buffer;
+    last_position = source.buffer + i;
+    source_size = i;
 
     type_size[type_new++] = sizeof(char);
     type_size[type_new++] = sizeof(int);
 
-    /* Parse the source code */
+    /* Lex the source code */
+    long lex_start = cc_clock_us();
     line = 1;
+    tokenize();
+    token = 0;
+    token_push();
+    long lex_time = cc_clock_us() - lex_start;
+
+    /* Parse the source code */
+    long parse_start = cc_clock_us();
     next();
     ast_root = parse();
+    long parse_time = cc_clock_us() - parse_start;
 
     dbgprintf("CC: Done parsing\n");
 
+    passes_run_ast(&ast_root);
+
     if(config.ast || 0) {
         print_ast(ast_root);
     }
     
-    write_x86(ast_root, org_data, (int)data - (long)org_data);
+    long codegen_start = cc_clock_us();
+    write_x86(ast_root, org_data, data_compact(org_data, (int)data - (long)org_data));
+    long codegen_time = cc_clock_us() - codegen_start;
+
+    long output_start = cc_clock_us();
+    int output_size = write_opcodes();
+    long output_time = cc_clock_us() - output_start;
     
     dbgprintf("CC: Done writing x86\n");
+
+    int ast_nodes = ast_arena.allocations;
+    int ast_bytes = ast_arena.bytes;
+    long free_start = cc_clock_us();
+    arena_release(&ast_arena);
+    ast_root = NULL;
+    long free_time = cc_clock_us() - free_start;
+
+    if(config.time_report) {
+        printf("Time report:\n");
+        printf("  lex:       %8ld us  %d tokens, %d identifiers, %d bytes (%ld MB/s)\n",
+            lex_time, tokens.count, sym_count, source_size, lex_time ? source_size / lex_time : 0);
+        printf("  parse:     %8ld us  %d nodes, %d KB\n", parse_time, ast_nodes, ast_bytes / 1024);
+        printf("  fold:      %8ld us\n", passes[PASS_FOLD].time);
+        printf("  shake:     %8ld us\n", passes[PASS_SHAKE].time);
+        printf("  codegen:   %8ld us\n", codegen_time);
+        printf("  output:    %8ld us  %d bytes\n", output_time, output_size);
+        printf("  free ast:  %8ld us\n", free_time);
+        printf("  peak rss:  %8ld KB\n", cc_peak_rss_kb());
+    }
+    
+    if(config.stats) {
+        printf("Stats:\n");
+        printf("  folded:    %8d nodes\n", passes[PASS_FOLD].changes);
+        printf("  evaluated: %8d calls\n", passes[PASS_EVAL].changes);
+        shake_print_stats();
+        printf("  inlined:   %8d calls\n", ir_stats.inlined);
+        printf("  promoted:  %8d locals\n", ir_stats.promoted);
+        printf("  tail:      %8d calls\n", ir_stats.tail_calls);
+        printf("  tables:    %8d switches\n", ir_stats.tables);
+        printf("  hoisted:   %8d instructions\n", ir_stats.hoisted);
+        printf("  spilled:   %8d values\n", ir_stats.spilled);
+        peephole_print_stats();
+    }
+
+    if(config.time_passes) {
+        passes_print_times();
+    }
     
     cleanup();
     dbgprintf("Done cleanup\n");
@@ -1761,24 +2088,29 @@ int cleanup(){
     }
 
     /* AST */
-    free_ast(ast_root);
+    arena_release(&ast_arena);
     /* Free include buffer */
     for(int i = 0; i < include_count; i++){
-        free(includes[i].buffer);
+        cc_unload(&includes[i].source);
     }
 
-    free(sym_table);
+    for(int i = 0; i < sym_chunk_count; i++){
+        free(sym_chunks[i]);
+    }
+    free(sym_chunks);
+    free(sym_index);
     free(org_data);
     free(type_size);
-    //free(include_buffer);
-    free(last_position);   
+    cc_unload(&source);
+    free(tokens.kind);
+    free(tokens.value);
+    free(tokens.line);
+    free(asm_blocks);
 
     return 0;
 }
 
-void print_ast_node(struct ast_node *node, int indent_level) {
-    if (!node) return;
-
+static void print_ast_line(struct ast_node *node, int indent_level) {
     for (int i = 0; i < indent_level; i++) {
         printf("  ");
     }
@@ -1790,7 +2122,7 @@ void print_ast_node(struct ast_node *node, int indent_level) {
             printf("String: %d\n", node->value);
             break;
         case AST_IDENT:
-            printf("Identifier: %.*s %d (%d)\n", node->ident.name_length, node->ident.name, node->ident.val, node->value);
+            printf("Identifier: %.*s %d (%d)\n", node->sym->name_length, node->sym->name, node->sym->val, node->value);
             break;
         case AST_BINOP:
             printf("Binop: %d\n", node->value);
@@ -1799,13 +2131,13 @@ void print_ast_node(struct ast_node *node, int indent_level) {
             printf("Unop: %d\n", node->value);
             break;
         case AST_FUNCALL:
-            printf("Call: %.*s\n", node->ident.name_length, node->ident.name);
+            printf("Call: %.*s\n", node->sym->name_length, node->sym->name);
             break;
         case AST_FUNCDEF:
             printf("Function\n");
             break;
         case AST_ASM:
-            printf("Asm: %.*s\n", node->ident.name_length, node->ident.name);
+            printf("Asm: %s\n", node->asm_code);
             break;
         case AST_VARDECL:
             printf("Vardecl\n");
@@ -1850,7 +2182,7 @@ void print_ast_node(struct ast_node *node, int indent_level) {
             printf("Addrref.\n");
             break;
         case AST_ENTER:
-            printf("Enter 0x%x (%.*s) (%d args)\n", node->value, node->ident.name_length, node->ident.name, node->ident.args);
+            printf("Enter 0x%x (%.*s) (%d args)\n", node->value, node->sym->name_length, node->sym->name, node->sym->args);
             break;
         case AST_LEAVE:
             printf("Leave\n");
@@ -1859,17 +2191,15 @@ void print_ast_node(struct ast_node *node, int indent_level) {
             printf("UNKNOWN NODE TYPE\n");
             break;
     }
+}
 
-
-    if (node->left) {
+/* Statement lists are walked in a loop, only nesting recurses */
+void print_ast_node(struct ast_node *node, int indent_level) {
+    for (; node; node = node->next) {
+        print_ast_line(node, indent_level);
         print_ast_node(node->left, indent_level + 1);
-    }
-    if (node->right) {
         print_ast_node(node->right, indent_level + 1);
     }
-    if (node->next) {
-        print_ast_node(node->next, indent_level);
-    }
 }
 
 void print_ast(struct ast_node *root) {
@@ -1891,7 +2221,13 @@ struct config config = {
     .elf = 1,
     .org = 0x08048000,
 #endif
-    .ast = 0  
+    .ast = 0,
+    .time_report = 0,
+    .stats = 0,
+    .ir = 0,
+    .inline_limit = 12,
+    .opt_level = 2,
+    .time_passes = 0
 };
 
 void usage(char *argv[]){
@@ -1905,6 +2241,16 @@ void usage(char *argv[]){
 #endif
     printf("  -s: Print assembly\n");
     printf("  --ast: Print AST tree\n");
+    printf("  --ir: Print IR of each function\n");
+    printf("  --stats: Print optimization statistics\n");
+    printf("  -O0, -O1, -O2: Optimization level (default -O2)\n");
+    printf("  -fno-<pass>: Disable a pass: fold, eval, shake, inline, promote, licm,\n");
+    printf("      jump-tables, addressing, strength, tail-calls, peephole\n");
+    printf("  -finline-limit=<n>: Inline functions up to n IR instructions larger than their call\n");
+    printf("  --time-passes: Print time and AST node or instruction delta of each pass\n");
+#ifdef NATIVE
+    printf("  --time-report: Print time spent in each compiler phase\n");
+#endif
     exit(EXIT_FAILURE);
 }
 
@@ -1929,6 +2275,33 @@ int main(int argc, char *argv[]) {
 #endif
             } else if (argv[i][1] == '-' && argv[i][2] == 'a' && argv[i][3] == 's' && argv[i][4] == 't') {
                 config.ast = 1;
+            } else if (strcmp(argv[i], "--ir") == 0) {
+                config.ir = 1;
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                config.stats = 1;
+            } else if (argv[i][1] == 'O') {
+                /* -O alone is -O1, levels above 2 run the -O2 passes */
+                if (argv[i][2] && (argv[i][2] < '0' || argv[i][2] > '9' || argv[i][3])) usage(argv);
+                config.opt_level = argv[i][2] ? argv[i][2] - '0' : 1;
+            } else if (strncmp(argv[i], "-fno-", 5) == 0) {
+                if (!pass_disable(argv[i] + 5)) {
+                    printf("Unknown pass: %s\n", argv[i] + 5);
+                    usage(argv);
+                }
+            } else if (strcmp(argv[i], "--time-passes") == 0) {
+                config.time_passes = 1;
+            } else if (strncmp(argv[i], "-finline-limit=", 15) == 0) {
+                config.inline_limit = 0;
+                for (char *c = argv[i] + 15; *c >= '0' && *c <= '9'; c++) {
+                    config.inline_limit = config.inline_limit * 10 + *c - '0';
+                }
+            } else if (strcmp(argv[i], "--time-report") == 0) {
+#ifdef NATIVE
+                config.time_report = 1;
+#else
+                printf("Error: time-report not supported\n");
+                exit(-1);
+#endif
             } else {
                 usage(argv);
             }
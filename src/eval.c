@@ -0,0 +1,350 @@
+/**
+ * @file eval.c
+ * @brief Compile time evaluation of calls with constant arguments.
+ *
+ * An AST pass run after constant folding. A call whose arguments are all
+ * constants is run in a small virtual machine over the unoptimized IR of the
+ * callee, and the AST_FUNCALL becomes the returned constant if the call
+ * finishes within the step budget. The machine gives up on anything whose
+ * result could differ at run time: globals, function addresses, builtins,
+ * uninitialized memory, addresses it did not hand out itself and divisions
+ * that would trap. The result then depends on the arguments alone, whatever
+ * path the callee takes, so the callee needs no purity analysis.
+ *
+ * Frames are laid out like the generated code lays them out on the stack:
+ * arguments, return address and saved %ebp, then the locals below %ebp.
+ */
+#include <ir.h>
+#include <cc.h>
+#include <passes.h>
+
+#define EVAL_STEPS 100000       /* IR instructions one evaluated call may run */
+#define EVAL_TOTAL_STEPS 10000000
+#define EVAL_DEPTH 256
+#define EVAL_MEMORY (64 * 1024)
+#define EVAL_BASE 0x10000       /* Address of the first byte of the machine's memory */
+
+/* Per byte state of the memory */
+#define BYTE_WRITTEN 1
+#define BYTE_ADDRESS 2          /* Part of an address stored by the machine */
+
+struct value {
+    int v;
+    int address;                /* v is an address into the machine's memory */
+};
+
+struct eval_func {
+    struct ast_node *enter;
+    struct ir_func *ir;         /* Lowered on first use */
+    int has_asm;
+};
+
+static struct eval_func *funcs;
+static int func_count;
+static unsigned char *memory;
+static unsigned char *bytes;
+static int steps;
+static int total_steps;
+
+static void *alloc_or_die(int size) {
+    void *ptr = zmalloc(size);
+    if (!ptr) {
+        printf("Unable to malloc evaluator state\n");
+        exit(-1);
+    }
+    return ptr;
+}
+
+static struct eval_func *find_func(int id) {
+    for (int i = 0; i < func_count; i++) {
+        if (funcs[i].enter->sym->val == id) return funcs + i;
+    }
+    return NULL;
+}
+
+static int contains_asm(struct ast_node *node) {
+    for (; node && node->type != AST_ENTER; node = node->next) {
+        if (node->type == AST_ASM || contains_asm(node->left) || contains_asm(node->right)) return 1;
+    }
+    return 0;
+}
+
+/* Offset of size bytes at address in memory, -1 if they are outside */
+static int offset_of(struct value address, int size) {
+    int offset = address.v - EVAL_BASE;
+    if (!address.address || offset < 0 || offset > EVAL_MEMORY - size) return -1;
+    return offset;
+}
+
+static int load(struct value address, int size, struct value *result) {
+    int offset = offset_of(address, size);
+    if (offset < 0) return 0;
+    int kind = bytes[offset];
+    for (int k = 0; k < size; k++) {
+        if (!(bytes[offset + k] & BYTE_WRITTEN) || bytes[offset + k] != kind) return 0;
+    }
+    if (size == 1) {
+        if (kind & BYTE_ADDRESS) return 0;
+        result->v = memory[offset];
+    } else {
+        memcpy(&result->v, memory + offset, 4);
+    }
+    result->address = (kind & BYTE_ADDRESS) != 0;
+    return 1;
+}
+
+static int store(struct value address, int size, struct value value) {
+    int offset = offset_of(address, size);
+    if (offset < 0 || (size == 1 && value.address)) return 0;
+    if (size == 1) memory[offset] = value.v; else memcpy(memory + offset, &value.v, 4);
+    memset(bytes + offset, BYTE_WRITTEN | (value.address ? BYTE_ADDRESS : 0), size);
+    return 1;
+}
+
+/* a <op> b as the generated code computes it, 0 if it would trap or depends on where memory is */
+static int binary(int op, struct value a, struct value b, struct value *r) {
+    unsigned x = a.v, y = b.v;
+    r->address = 0;
+    if (a.address || b.address) {
+        int both = a.address && b.address;
+        switch (op) {
+            case Add:
+                if (both) return 0;
+                r->v = x + y;
+                r->address = 1;
+                return 1;
+            case Sub:
+                if (b.address && !both) return 0;
+                r->v = x - y;
+                r->address = !both;
+                return 1;
+            case Inc:
+            case Dec:
+                if (!a.address) return 0;
+                r->v = op == Inc ? x + 1 : x - 1;
+                r->address = 1;
+                return 1;
+            case Eq:
+            case Ne:
+                /* The machine's addresses are never null, other integers may be anything */
+                if (!both && (a.address ? b.v : a.v) != 0) return 0;
+                break;
+            case Lt: case Gt: case Le: case Ge:
+                if (!both) return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+    switch (op) {
+        case Add: r->v = x + y; break;
+        case Sub: r->v = x - y; break;
+        case Mul: r->v = x * y; break;
+        case Div:
+        case Mod:
+            if (b.v == 0 || (a.v == (int)0x80000000 && b.v == -1)) return 0;
+            r->v = op == Div ? a.v / b.v : a.v % b.v;
+            break;
+        case And: r->v = x & y; break;
+        case Or: r->v = x | y; break;
+        case Xor: r->v = x ^ y; break;
+        case Shl: r->v = x << (y & 31); break;
+        case Shr: r->v = a.v >> (y & 31); break;
+        case Inc: r->v = x + 1; break;
+        case Dec: r->v = x - 1; break;
+        case Eq: r->v = a.v == b.v; break;
+        case Ne: r->v = a.v != b.v; break;
+        case Lt: r->v = a.v < b.v; break;
+        case Gt: r->v = a.v > b.v; break;
+        case Le: r->v = a.v <= b.v; break;
+        case Ge: r->v = a.v >= b.v; break;
+        default: return 0;
+    }
+    return 1;
+}
+
+static int unary(int op, struct value a, struct value *r) {
+    unsigned x = a.v;
+    r->address = 0;
+    if (a.address) return 0;
+    switch (op) {
+        case Ne: r->v = !a.v; break;
+        case Sub: r->v = 0u - x; break;
+        case Xor: r->v = ~x; break;
+        default: return 0;
+    }
+    return 1;
+}
+
+/**
+ * Run function id with argc arguments, args[k] is at 8 + 4 * k(%ebp) and
+ * the caller's frame ends at sp.
+ * Returns 0 if the call cannot be evaluated.
+ */
+static int call(int id, struct value *args, int argc, int sp, int depth, struct value *result) {
+    struct eval_func *f = find_func(id);
+    if (!f || f->has_asm || depth > EVAL_DEPTH) return 0;
+    if (!f->ir) {
+        /* Lowering for evaluation must not show up in --stats */
+        struct ir_stats saved = ir_stats;
+        struct ast_node *node = f->enter;
+        f->ir = ir_lower_function(&node);
+        ir_stats = saved;
+    }
+    struct ir_func *fn = f->ir;
+    int base = sp - 4 * argc, ebp = base - 8, low = ebp - fn->frame_size;
+    if (argc != fn->sym->args || low < 0) return 0;
+
+    memset(bytes + low, 0, sp - low);
+    for (int k = 0; k < argc; k++) {
+        struct value slot = { EVAL_BASE + base + 4 * k, 1 };
+        store(slot, 4, args[k]);
+    }
+
+    struct value *regs = alloc_or_die((fn->vregs + 1) * sizeof(struct value));
+    struct value *pushed = alloc_or_die((fn->insn_count + 1) * sizeof(struct value));
+    int ok = 0, top = 0, i = 0;
+    result->v = 0;
+    result->address = 0;
+
+    while (i < fn->insn_count) {
+        struct ir_insn *insn = fn->insns + i++;
+        struct value *dst = regs + insn->dst, a = regs[insn->a], b = regs[insn->b];
+        struct value address = { a.v + insn->imm, a.address };
+        if (++steps > EVAL_STEPS || ++total_steps > EVAL_TOTAL_STEPS) goto done;
+
+        switch (insn->op) {
+            case IR_IMM:
+                dst->v = insn->imm;
+                dst->address = 0;
+                break;
+            case IR_LOCAL:
+                dst->v = EVAL_BASE + ebp + insn->imm;
+                dst->address = 1;
+                break;
+            case IR_LOAD:
+                if (!load(address, insn->size, dst)) goto done;
+                break;
+            case IR_STORE:
+                if (!store(address, insn->size, b)) goto done;
+                break;
+            case IR_BIN:
+                if (!binary(insn->aux, a, b, dst)) goto done;
+                break;
+            case IR_UN:
+                if (!unary(insn->aux, a, dst)) goto done;
+                break;
+            case IR_MOV:
+                *dst = a;
+                break;
+            case IR_ARG:
+                pushed[top++] = a;
+                break;
+            case IR_CALL: {
+                /* The last argument pushed ends up at 8(%ebp) */
+                struct value callee_args[16];
+                if (insn->aux > 16 || insn->aux > top) goto done;
+                for (int k = 0; k < insn->aux; k++) callee_args[k] = pushed[top - 1 - k];
+                top -= insn->aux;
+                if (!call(insn->imm, callee_args, insn->aux, low, depth + 1, dst)) goto done;
+                break;
+            }
+            case IR_JMP:
+                i = fn->blocks[insn->imm].start;
+                break;
+            case IR_JCC: {
+                struct value taken;
+                if (!binary(insn->aux, a, b, &taken)) goto done;
+                if (taken.v) i = fn->blocks[insn->imm].start;
+                break;
+            }
+            case IR_SWITCH: {
+                struct ir_table *table = fn->tables + insn->imm;
+                unsigned entry = (unsigned)a.v - table->low;
+                if (a.address) goto done;
+                /* Values outside the table go on to the comparisons that follow */
+                if (entry < (unsigned)table->count) i = fn->blocks[table->blocks[entry]].start;
+                break;
+            }
+            case IR_RET:
+                if (insn->a) *result = a;
+                ok = 1;
+                goto done;
+            case IR_NOP:
+                break;
+            default:
+                /* Globals, function addresses and builtins */
+                goto done;
+        }
+    }
+    /* Falling off the end returns nothing, like a return without a value */
+    ok = 1;
+done:
+    free(regs);
+    free(pushed);
+    return ok;
+}
+
+/* Replace calls in node and below up to the next function, arguments are evaluated first so nested calls fold too */
+static int evaluate(struct ast_node *node) {
+    int count = 0;
+    for (; node && node->type != AST_ENTER; node = node->next) {
+        count += evaluate(node->left) + evaluate(node->right);
+        if (node->type != AST_FUNCALL || node->sym_class != Fun) continue;
+
+        struct value args[16], result;
+        int argc = 0, constant = 1;
+        /* Arguments are chained last to first, the last one is pushed last and ends up at 8(%ebp) */
+        for (struct ast_node *arg = node->left; arg; arg = arg->next) {
+            if (argc == 16 || arg->type != AST_NUM || arg->left || arg->right) { constant = 0; break; }
+            args[argc].v = arg->value;
+            args[argc].address = 0;
+            argc++;
+        }
+        if (!constant) continue;
+
+        steps = 0;
+        if (!call(node->sym->val, args, argc, EVAL_MEMORY, 0, &result) || result.address) continue;
+        node->type = AST_NUM;
+        node->value = result.v;
+        node->left = NULL;
+        node->right = NULL;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Replace calls with constant arguments by their result where it is known at compile time.
+ * @return Number of calls replaced
+ */
+int evaluate_calls(struct ast_node **root) {
+    for (struct ast_node *node = *root; node; node = node->next) func_count += node->type == AST_ENTER;
+    funcs = alloc_or_die((func_count + 1) * sizeof(struct eval_func));
+    memory = alloc_or_die(EVAL_MEMORY);
+    bytes = alloc_or_die(EVAL_MEMORY);
+    func_count = 0;
+    for (struct ast_node *node = *root; node; node = node->next) {
+        if (node->type != AST_ENTER) continue;
+        funcs[func_count].enter = node;
+        funcs[func_count].has_asm = contains_asm(node->next);
+        func_count++;
+    }
+
+    int count = 0;
+    for (struct ast_node *node = *root; node; node = node->next) {
+        if (node->type == AST_ENTER) count += evaluate(node->next);
+    }
+    /* Results may fold further, f(2) * 4 */
+    if (count && pass_enabled(PASS_FOLD)) fold_constants(*root);
+
+    for (int i = 0; i < func_count; i++) {
+        if (funcs[i].ir) ir_free(funcs[i].ir);
+    }
+    free(funcs);
+    free(memory);
+    free(bytes);
+    funcs = NULL;
+    func_count = 0;
+    return count;
+}
@@ -1,7 +1,9 @@
 #pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
 #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
 
-#include <ast.h>
+#include <ir.h>
+#include <peephole.h>
+#include <passes.h>
 #include <func.h>
 #include <io.h>
 
@@ -13,8 +15,15 @@
 
 #define ELF_HEADER_SIZE 84
 
+/* Code and data of the program, grown as functions are emitted */
+#define OPCODES_INITIAL_SIZE 4096
+
 static uint8_t* opcodes;
 static int opcodes_count = 0;
+static int opcodes_capacity = 0;
+
+static void x86_byte(int b);
+static void x86_int(int v);
 
 int asmprintf(void* file, const char *format, ...) {
     if(config.assembly_set == 0){
@@ -33,1098 +42,1336 @@ int asmprintf(void* file, const char *format, ...) {
     return 0;
 }
 
-#define ADJUST_SIZE(node) (node->value > 0 ? node->value*4 : node->value)
-
 #define GEN_X86_LEAL_EBP(val)\
-    opcodes[opcodes_count++] = 0x8d;\
-    opcodes[opcodes_count++] = 0x45;\
-    *((int*)(opcodes + opcodes_count)) = val;\
-    opcodes_count += 4;
+    x86_byte(0x8d);\
+    x86_byte(0x45);\
+    x86_int(val);
 
 #define GEN_X86_ESP_EBP()\
-    opcodes[opcodes_count++] = 0x89;\
-    opcodes[opcodes_count++] = 0xe5;
+    x86_byte(0x89);\
+    x86_byte(0xe5);
 
 #define GEN_X86_PUSH_EBP()\
-    opcodes[opcodes_count++] = 0x55;
+    x86_byte(0x55);
 
 #define GEN_X86_SUB_ESP(val)\
-    opcodes[opcodes_count++] = 0x81;\
-    opcodes[opcodes_count++] = 0xec;\
-    *((int*)(opcodes + opcodes_count)) = val;\
-    opcodes_count += 4;
+    x86_byte(0x81);\
+    x86_byte(0xec);\
+    x86_int(val);
 
 #define GEN_X86_ADD_ESP(val)\
-    opcodes[opcodes_count++] = 0x81;\
-    opcodes[opcodes_count++] = 0xc4;\
-    *((int*)(opcodes + opcodes_count)) = val;\
-    opcodes_count += 4;
+    x86_byte(0x81);\
+    x86_byte(0xc4);\
+    x86_int(val);
 
 #define GEN_X86_POP_EBP()\
-    opcodes[opcodes_count++] = 0x5d;
+    x86_byte(0x5d);
 
 #define GEN_X86_POP_EBX()\
-    opcodes[opcodes_count++] = 0x5b;
+    x86_byte(0x5b);
 
 #define GEN_X86_PUSH_EAX()\
-    opcodes[opcodes_count++] = 0x50;
+    x86_byte(0x50);
 
 #define GEN_X86_RET()\
-    opcodes[opcodes_count++] = 0xc3;
+    x86_byte(0xc3);
 
 #define GEN_X86_CALL(offset)\
-    opcodes[opcodes_count++] = 0xe8;\
-    *((int*)(opcodes + opcodes_count)) = offset;\
-    opcodes_count += 4;
+    x86_byte(0xe8);\
+    x86_int(offset);
 
 #define GEN_X86_JMP(offset)\
-    opcodes[opcodes_count++] = 0xe9;\
-    *((int*)(opcodes + opcodes_count)) = offset;\
-    opcodes_count += 4;
+    x86_byte(0xe9);\
+    x86_int(offset);
 
 #define GEN_X86_EAX_EBX()\
-    opcodes[opcodes_count++] = 0x89;\
-    opcodes[opcodes_count++] = 0xc3;
+    x86_byte(0x89);\
+    x86_byte(0xc3);
 
 #define GEN_X86_IMD_EAX(val)\
-    opcodes[opcodes_count++] = 0xb8;\
-    *((int*)(opcodes + opcodes_count)) = val;\
-    opcodes_count += 4;
+    x86_byte(0xb8);\
+    x86_int(val);
 
 #define GEN_X86_INT(val)\
-    opcodes[opcodes_count++] = 0xcd;\
-    opcodes[opcodes_count++] = val;
-
-int derefence = 0;
-int lable_count = 0;
-void generate_x86(struct ast_node *node, void* *file) {
-    if (!node) return;
-
-    switch (node->type) {
-        case AST_NUM:
-            asmprintf(file, "movl $%d, %%eax\n", node->value);
-            GEN_X86_IMD_EAX(node->value);
-            return;
-        case AST_STR:{
-                /**
-                 * The Data section is located at the start of the file.
-                 * With ELF, its located after the ELF header.
-                 * However, the first 5 bytes are reserved for the JMP to main.
-                 */
-                int offset = (node->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-
-                asmprintf(file, "movl $0x%x, %%eax # str\n", (config.org+5) + offset);
-                opcodes[opcodes_count++] = 0xb8;
-                *((int*)(opcodes + opcodes_count)) = (config.org+5) + offset;
-                opcodes_count += 4;
-            }
-            return;
-        case AST_IDENT:
-            if(node->ident.class == Loc && (node->ident.type <= INT || node->ident.type >= PTR)  && node->ident.array == 0){
+    x86_byte(0xcd);\
+    x86_byte(val);
+
+/**
+ * Emission from IR after register allocation.
+ * Every vreg lives in a register or in a frame slot, %eax is the scratch
+ * register for operands that have to be in memory or in a fixed register.
+ * Constants and frame/global addresses used by a single load or store are
+ * folded into that instruction instead of being materialized.
+ */
+#define ABS -1
+
+static struct ir_func *fn;
+static int *def_at;         /* Instruction defining each vreg */
+static unsigned char *lazy; /* Vreg is folded into its user */
+
+static int *block_offset;
+static int *table_offset;   /* Code offset of each jump table */
+static int frame_escapes;   /* The address of a local or parameter is used as a value */
+static int *fixups;         /* Pairs of rel32 position and target block */
+static int fixup_count;
+
+/* Make room for size more bytes, doubling keeps appending amortized constant time */
+static void opcodes_reserve(int size) {
+    if (opcodes_count + size <= opcodes_capacity) return;
+    int capacity = opcodes_capacity ? opcodes_capacity : OPCODES_INITIAL_SIZE;
+    while (capacity < opcodes_count + size) capacity *= 2;
+
+    uint8_t *grown = zmalloc(capacity);
+    if (!grown) {
+        printf("Failed to allocate memory for opcodes\n");
+        exit(-1);
+    }
+    if (opcodes) {
+        memcpy(grown, opcodes, opcodes_count);
+        free(opcodes);
+    }
+    opcodes = grown;
+    opcodes_capacity = capacity;
+}
 
-                // Checking node value because stack pushed chars are stored as ints
-                if(node->data_type == CHAR && node->value < 0 && 0){ 
-                    asmprintf(file, "movzbl %d(%%ebp), %%eax # Type %d\n", node->value > 0 ? node->value*4 : node->value, node->ident.type);
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = ADJUST_SIZE(node);
+static void x86_byte(int b) {
+    opcodes_reserve(1);
+    opcodes[opcodes_count++] = b;
+}
 
-                } else {
-                    asmprintf(file, "movl3 %d(%%ebp), %%eax # Type %d\n", node->value > 0 ? node->value*4 : node->value, node->data_type);
-                    opcodes[opcodes_count++] = 0x8b;
-                    opcodes[opcodes_count++] = 0x45;
-                    opcodes[opcodes_count++] = ADJUST_SIZE(node);
-                }
-                
-                return;
-            }
+static void x86_int(int v) {
+    opcodes_reserve(4);
+    *((int*)(opcodes + opcodes_count)) = v;
+    opcodes_count += 4;
+}
 
-            if(node->ident.class == Glo && (node->ident.type <= INT || node->ident.type >= PTR) && node->ident.array == 0){
-                int offset = (node->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                int address = config.org+5 + offset;
+/* ModRM (and displacement) for [base + disp], base ABS for an absolute address */
+static void x86_mem(int reg, int base, int disp) {
+    if (base == ABS) {
+        x86_byte(0x05 | reg << 3);
+        x86_int(disp);
+    } else if (disp == 0 && base != EBP) {
+        x86_byte(reg << 3 | base);
+    } else if (disp >= -128 && disp <= 127) {
+        x86_byte(0x40 | reg << 3 | base);
+        x86_byte(disp);
+    } else {
+        x86_byte(0x80 | reg << 3 | base);
+        x86_int(disp);
+    }
+}
 
-                asmprintf(file, "movl $0x%x, %%eax\n", address);
-                opcodes[opcodes_count++] = 0xb8;
-                *((int*)(opcodes + opcodes_count)) = address;
-                opcodes_count += 4;
+/* log2 of an index scale as encoded in the SIB byte */
+static int scale_bits(int scale) {
+    return scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+}
 
-                asmprintf(file, "movl3 (%%eax), %%eax\n");
-                opcodes[opcodes_count++] = 0x8b;
-                opcodes[opcodes_count++] = 0x00;
-                return;
-            }
+/* ModRM, SIB and displacement for [base + index * scale + disp], index -1 for none */
+static void x86_addr(int reg, int base, int index, int scale, int disp) {
+    if (index < 0) {
+        x86_mem(reg, base, disp);
+        return;
+    }
+    int sib = scale_bits(scale) << 6 | index << 3;
+    if (base == ABS) {
+        x86_byte(0x04 | reg << 3);
+        x86_byte(sib | 5);
+        x86_int(disp);
+    } else if (disp == 0 && base != EBP) {
+        x86_byte(0x04 | reg << 3);
+        x86_byte(sib | base);
+    } else if (disp >= -128 && disp <= 127) {
+        x86_byte(0x44 | reg << 3);
+        x86_byte(sib | base);
+        x86_byte(disp);
+    } else {
+        x86_byte(0x84 | reg << 3);
+        x86_byte(sib | base);
+        x86_int(disp);
+    }
+}
 
+/* ModRM for the location of v, a register or its frame slot */
+static void x86_rm(int reg, int v) {
+    if (fn->reg[v] >= 0) {
+        x86_byte(0xc0 | reg << 3 | fn->reg[v]);
+    } else {
+        x86_mem(reg, EBP, fn->slot[v]);
+    }
+}
 
-            if (node->ident.class == Loc) {
-                asmprintf(file, "leal %d(%%ebp), %%eax\n", node->value > 0 ? node->value*4 : node->value); 
-                opcodes[opcodes_count++] = 0x8d;
-                opcodes[opcodes_count++] = 0x45;
-                opcodes[opcodes_count++] = node->value;
-                
-            } else if (node->ident.class == Glo) {
-                int offset = (node->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-
-                asmprintf(file, "movl $0x%x, %%eax\n", config.org+5 + offset);
-                opcodes[opcodes_count++] = 0xb8;
-                *((int*)(opcodes + opcodes_count)) = config.org+5 + offset;
-                opcodes_count += 4;
-            } else {
-                asmprintf(file, "Unknown identifier class\n");
-                exit(-1);
-            }
+static const char *x86_reg_name(int reg) {
+    static const char *names[] = { "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi" };
+    return names[reg];
+}
 
-            /* Load value if it's not a pointer type */
-            if ((node->ident.type <= INT || node->ident.type > PTR) && node->ident.array == 0) {
-                asmprintf(file, "%s (%%eax), %%eax\n", (node->ident.type == CHAR) ? "movzb" : "movl"); // 
+static void asm_loc(int v) {
+    if (fn->reg[v] >= 0) {
+        asmprintf(NULL, "%s", x86_reg_name(fn->reg[v]));
+    } else {
+        asmprintf(NULL, "%d(%%ebp)", fn->slot[v]);
+    }
+}
 
-                if(node->ident.type == CHAR){
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0x00;
-                } else {
-                    opcodes[opcodes_count++] = 0x8b;
-                    opcodes[opcodes_count++] = 0x00;
-                }
-            }
-            return;
-        case AST_BINOP:
-            /**
-             * First the address of the left operand is pushed onto the stack,
-             * then the right operand is evaluated and the result is stored in %eax.
-             * The left operand is then popped into %ebx and the operation is performed. 
-             */
-            generate_x86(node->right, file);
-
-            asmprintf(file, "pushl %%eax\n");
-            opcodes[opcodes_count++] = 0x50;
-
-            generate_x86(node->left, file);
-
-            asmprintf(file, "popl %%ebx\n");
-            opcodes[opcodes_count++] = 0x5b;
-
-            switch (node->value) {
-                case Add: {
-                    asmprintf(file, "addl %%ebx, %%eax\n");
-                    opcodes[opcodes_count++] = 0x01;
-                    opcodes[opcodes_count++] = 0xd8;
-                    }break;
-                case Sub: {
-                    asmprintf(file, "subl %%ebx, %%eax\n");
-                    opcodes[opcodes_count++] = 0x29;
-                    opcodes[opcodes_count++] = 0xd8;
-
-                    } break;
-                case Mul:{
-                    asmprintf(file, "imull %%ebx, %%eax\n"); 
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xaf;
-                    opcodes[opcodes_count++] = 0xc3;
-                    }break;
-                case Div: {
-                    asmprintf(file, "movl $0, %%edx\n");
-                    asmprintf(file, "idivl %%ebx\n"); 
-                    
-                    opcodes[opcodes_count++] = 0x89;
-                    opcodes[opcodes_count++] = 0xd2;
-                    opcodes[opcodes_count++] = 0xf7;
-                    opcodes[opcodes_count++] = 0xfb;
-                    
-                    }break;
-                case Eq: {
-                    asmprintf(file, "cmpl %%ebx, %%eax\nsete %%al\nmovzb %%al, %%eax\n");
-                    opcodes[opcodes_count++] = 0x39;
-                    opcodes[opcodes_count++] = 0xd8;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0x94;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
-                    } break;
-                case Ne: {
-                    asmprintf(file, "cmpl %%ebx, %%eax\nsetne %%al\nmovzb %%al, %%eax\n");
-                    opcodes[opcodes_count++] = 0x39;
-                    opcodes[opcodes_count++] = 0xd8;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0x95;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
-                    } break;
-                case Gt: {
-                    asmprintf(file, "cmpl %%ebx, %%eax\nsetg %%al\nmovzb %%al, %%eax\n");
-                    opcodes[opcodes_count++] = 0x39;
-                    opcodes[opcodes_count++] = 0xd8;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0x9f;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
-                    } break;
-                case Ge: {
-                    asmprintf(file, "cmpl %%ebx, %%eax\nsetge %%al\nmovzb %%al, %%eax\n");
-                    opcodes[opcodes_count++] = 0x39;
-                    opcodes[opcodes_count++] = 0xd8;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0x9d;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
-                    } break;
-               case Lt: {
-                    asmprintf(file, "cmpl %%ebx, %%eax\nsetl %%al\nmovzb %%al, %%eax\n");
-                    opcodes[opcodes_count++] = 0x39;   // cmpl %ebx, %eax
-                    opcodes[opcodes_count++] = 0xd8;   
-                    opcodes[opcodes_count++] = 0x0f;   
-                    opcodes[opcodes_count++] = 0x9c;   // setl %al
-                    opcodes[opcodes_count++] = 0xc0;   
-                    opcodes[opcodes_count++] = 0x0f;   
-                    opcodes[opcodes_count++] = 0xb6;   // movzb %al, %eax
-                    opcodes[opcodes_count++] = 0xc0;   
-                } break;
-                case Le: {
-                    asmprintf(file, "cmpl %%ebx, %%eax\nsetle %%al\nmovzb %%al, %%eax\n");
-                    opcodes[opcodes_count++] = 0x39;
-                    opcodes[opcodes_count++] = 0xd8;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0x9e;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
-                    } break;
-                case Or: {
-                    asmprintf(file, "orl %%ebx, %%eax\n");
-                    opcodes[opcodes_count++] = 0x09;
-                    opcodes[opcodes_count++] = 0xd8;
-                    } break;
-                case And: {
-                    asmprintf(file, "andl %%ebx, %%eax\n");
-                    opcodes[opcodes_count++] = 0x21;
-                    opcodes[opcodes_count++] = 0xd8;
-                    } break;
-                case Xor: {
-                    asmprintf(file, "xorl %%ebx, %%eax\n");
-                    opcodes[opcodes_count++] = 0x31;
-                    opcodes[opcodes_count++] = 0xd8;
-                    } break;
-                case Shl: {
-                    asmprintf(file, "movl %%ebx, %%ecx\n");
-                    asmprintf(file, "shll %%cl, %%eax\n");
-                    opcodes[opcodes_count++] = 0x89;
-                    opcodes[opcodes_count++] = 0xd9;
-                    opcodes[opcodes_count++] = 0xd3;
-                    opcodes[opcodes_count++] = 0xe0;
-                    } break;
-                case Shr: {
-                    asmprintf(file, "movl %%ebx, %%ecx\n");
-                    asmprintf(file, "sarl %%cl, %%eax\n");
-                    
-                    opcodes[opcodes_count++] = 0x89;
-                    opcodes[opcodes_count++] = 0xd9;
-                    opcodes[opcodes_count++] = 0xd3;
-                    opcodes[opcodes_count++] = 0xf8;
-                    
-                    } break;
-                case Mod: {
-                    asmprintf(file, "movl $0, %%edx\n");
-                    asmprintf(file, "idivl %%ebx\n");
-                    asmprintf(file, "movl %%edx, %%eax\n");
-                    opcodes[opcodes_count++] = 0x89;
-                    opcodes[opcodes_count++] = 0xd2;
-                    opcodes[opcodes_count++] = 0xf7;
-                    opcodes[opcodes_count++] = 0xfb;
-                    opcodes[opcodes_count++] = 0x89;
-                    opcodes[opcodes_count++] = 0xc0;
-                    } break;
-                case Dec: {
-                    asmprintf(file, "subl $1, %%eax\n");
-                    opcodes[opcodes_count++] = 0x83;
-                    opcodes[opcodes_count++] = 0xe8;
-                    opcodes[opcodes_count++] = 0x01;
-                    } break;
-                case Inc: {
-                    asmprintf(file, "addl $1, %%eax\n");
-                    opcodes[opcodes_count++] = 0x83;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x01;
-                    } break;
-                case Lan:{
-                    asmprintf(file, "cmpl $0, %%eax\n");
-                    asmprintf(file, "setne %%al\n");
-                    asmprintf(file, "movzb %%al, %%eax\n");
-
-                    opcodes[opcodes_count++] = 0x83;
-                    opcodes[opcodes_count++] = 0xf8;
-                    opcodes[opcodes_count++] = 0x00;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0x94;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
-
-                    } break;
-                case Lor:{
-                    asmprintf(file, "cmpl $0, %%eax\n");    
-                    asmprintf(file, "setne %%al\n");
-                    asmprintf(file, "movzb %%al, %%eax\n");
-
-                    opcodes[opcodes_count++] = 0x83;
-                    opcodes[opcodes_count++] = 0xf8;
-                    opcodes[opcodes_count++] = 0x00;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0x95;
-                    opcodes[opcodes_count++] = 0xc0;
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
-                } break;
-                default:
-                    printf("Unknown binary operator %d\n", node->value);
-                    exit(-1);
-            }
-            break;
-        case AST_UNOP:
-            generate_x86(node->left, file);
-            switch (node->value) {
-                case Ne:
-                    asmprintf(file, "cmpl $0, %%eax\n");
-                    asmprintf(file, "sete %%al\n");
-                    asmprintf(file, "movzb %%al, %%eax\n");
-
-                    opcodes[opcodes_count++] = 0x83;
-                    opcodes[opcodes_count++] = 0xf8;
-                    
-                    opcodes[opcodes_count++] = 0x00;
-                    opcodes[opcodes_count++] = 0x0f;
-                    
-                    opcodes[opcodes_count++] = 0xb6;
-                    opcodes[opcodes_count++] = 0xc0;
+static void asm_mem(int base, int disp) {
+    if (base == ABS) {
+        asmprintf(NULL, "0x%x", disp);
+    } else {
+        asmprintf(NULL, "%d(%s)", disp, x86_reg_name(base));
+    }
+}
 
-                    break;
-                case Sub:
-                    asmprintf(file, "negl %%eax\n");
-                    opcodes[opcodes_count++] = 0xf7;
-                    opcodes[opcodes_count++] = 0xd8;
-                    break;
-            }
-            break;
-        case AST_FUNCALL:
-            /* Collect arguments in a list to push them in reverse order */
-            asmprintf(file, "# Function call\n");
-            if (node->left) {
-                struct ast_node *args[16]; // assuming a max of 16 args for simplicity
-                int arg_count = 0;
-                struct ast_node *arg = node->left;
-                while (arg) {
-                    if (arg_count >= 16) {
-                        printf("Too many arguments for function call\n");
-                        exit(-1);
-                    }
-                    args[arg_count++] = arg;
-                    arg = arg->next;
-                }
-                /* Push arguments in reverse order */
-                for (int i = arg_count - 1; i >= 0; i--) {
-                    arg = args[i];
-                    generate_x86(arg, file);
-                    
-                    asmprintf(file, "pushl %%eax\n");
-                    opcodes[opcodes_count++] = 0x50;
-                }
-            }
+static void asm_addr(int base, int index, int scale, int disp) {
+    if (index < 0) {
+        asm_mem(base, disp);
+    } else if (base == ABS) {
+        asmprintf(NULL, "0x%x(,%s,%d)", disp, x86_reg_name(index), scale);
+    } else {
+        asmprintf(NULL, "%d(%s,%s,%d)", disp, x86_reg_name(base), x86_reg_name(index), scale);
+    }
+}
 
-            /* Sys functions are akin to __builtins */
-            if(node->ident.class == Sys) {
-                switch (node->ident.val) {
-                    case INTERRUPT: {
-                        /**
-                         * Interrupt: For the time being, linux style interrupts.
-                         * __interrupt(int number, int eax, int ebx, int ecx, int edx, int esi)
-                         * The number is the interrupt to call.
-                         * Use pushed arguments, pop them into registers and call interrupt.
-                         */                        
-                        /* Pop intterupt */
-                        asmprintf(file, "popl %%esi\n"); opcodes[opcodes_count++] = 0x5e;
-                        asmprintf(file, "popl %%edx\n"); opcodes[opcodes_count++] = 0x5a;
-                        asmprintf(file, "popl %%ecx\n"); opcodes[opcodes_count++] = 0x59;
-                        asmprintf(file, "popl %%ebx\n"); opcodes[opcodes_count++] = 0x5b;
-                        asmprintf(file, "popl %%eax\n"); opcodes[opcodes_count++] = 0x58;
-
-                        /* pop number */
-                        asmprintf(file, "popl %%edi\n"); opcodes[opcodes_count++] = 0x5f;
-
-                        /* xor edi and ebp */
-                        asmprintf(file, "pushl %%ebp\n"); opcodes[opcodes_count++] = 0x55;
-                        asmprintf(file, "xorl %%ebp, %%ebp\n"); opcodes[opcodes_count++] = 0x31; opcodes[opcodes_count++] = 0xed;
-                        asmprintf(file, "xorl %%edi, %%edi\n"); opcodes[opcodes_count++] = 0x31; opcodes[opcodes_count++] = 0xff;
-
-                        /* TODO: This is techincally only for mmap */
-                        asmprintf(file, "dec %%edi\n"); opcodes[opcodes_count++] = 0x4f;
-
-                        int interrupt = 0;
-                        // last argument
-                        struct ast_node *arg = node->left;
-                        while (arg->next) {
-                            arg = arg->next;
-                        }
-                        interrupt = arg->value;
-
-                        /* Call interrupt */
-                        asmprintf(file, "int $0%d\n", interrupt);
-                        GEN_X86_INT(interrupt);
-
-                        asmprintf(file, "popl %%ebp\n"); opcodes[opcodes_count++] = 0x5d;
-
-                        break;
-                    }
-                    case INPORTB: {
-                        asmprintf(file, "xorl %%eax, %%eax\n");
-                        opcodes[opcodes_count++] = 0x31;
-                        opcodes[opcodes_count++] = 0xc0;
-                        asmprintf(file, "xorl %%edx, %%edx\n");
-                        opcodes[opcodes_count++] = 0x31;
-                        opcodes[opcodes_count++] = 0xd2;
-                        asmprintf(file, "popl %%edx\n"); opcodes[opcodes_count++] = 0x5a;
-                        asmprintf(file, "inb %%dx, %%al\n");
-                        opcodes[opcodes_count++] = 0xec;
-                        break;
-                    }
-                    case OUTPORTB: {
-                        asmprintf(file, "popl %%edx\n"); opcodes[opcodes_count++] = 0x5a;
-                        asmprintf(file, "popl %%eax\n"); opcodes[opcodes_count++] = 0x58;
-                        asmprintf(file, "outb %%al, %%dx\n");
-                        opcodes[opcodes_count++] = 0xee;
-                        break;
-                    }
-                    default: {
-                        printf("Unsupported builtin %d\n", node->ident.val);
-                        exit(-1);
-                    }
-                }
-            } else if (node->ident.class == Fun) {
+/* Address of the byte at code offset pos once loaded */
+static int code_address(int pos) {
+    return config.org + pos + (config.elf ? ELF_HEADER_SIZE : 0);
+}
 
-                struct function *f = find_function_id(node->ident.val);
-                if (!f || !f->entry) {
-                    printf("Function %.*s not found in JSR\n", node->ident.name_length, node->ident.name);
-                    exit(-1);
-                }
+/* The data section follows the jump to _start */
+static int global_address(int offset) {
+    return code_address(5 + offset);
+}
 
-                asmprintf(file, "call %.*s %d\n", node->ident.name_length, node->ident.name,-opcodes_count);
-        
-                int offset = (int)f->entry - opcodes_count;
-                GEN_X86_CALL(offset-5);
-            } else {
-                printf("Unknown x86 function call: %.*s, %d\n", node->ident.name_length, node->ident.name, node->ident.class);
-                exit(-1);
-            }
-            if (node->left) {
-                int arg_count = 0;
-                struct ast_node *arg = node->left;
-                while (arg) {
-                    arg_count++;
-                    arg = arg->next;
-                }
-                if (arg_count > 0 && node->ident.class == Fun) {
-                    asmprintf(file, "addl $%d, %%esp # Cleanup stack\n", arg_count * 4);
-                    opcodes[opcodes_count++] = 0x81;
-                    opcodes[opcodes_count++] = 0xc4;
-                    *((int*)(opcodes + opcodes_count)) = arg_count * 4;
-                    opcodes_count += 4;
+static void x86_jump_to(int block) {
+    fixups[fixup_count * 2] = opcodes_count;
+    fixups[fixup_count * 2 + 1] = block;
+    fixup_count++;
+    x86_int(0);
+}
 
-                }
-            }
-            break;
-        case AST_RETURN:
-            if (node->left) {
-                generate_x86(node->left, file);
-            }
+/* Register the result of v is computed in, %eax if v is spilled */
+static int dst_reg(int v) {
+    return fn->reg[v] >= 0 ? fn->reg[v] : EAX;
+}
 
-            asmprintf(file, "# Cleaning up stack frame\n");
-            if(node->value > 0){
-                asmprintf(file, "addl $%d, %%esp\n", node->value);
-                GEN_X86_ADD_ESP(node->value);
-            }
-            asmprintf(file, "popl %%ebp\n");
-            asmprintf(file, "ret\n\n");
+static void load_reg(int reg, int v) {
+    if (fn->reg[v] == reg) return;
+    asmprintf(NULL, "movl ");
+    asm_loc(v);
+    asmprintf(NULL, ", %s\n", x86_reg_name(reg));
+    x86_byte(0x8b); x86_rm(reg, v);
+}
 
-            GEN_X86_POP_EBP();
-            GEN_X86_RET();
-            /* leave and ret is done by AST_LEAVE */
-            break;
-        case AST_IF: {
-            asmprintf(file, "# If statement\n");
-            int lfalse = lable_count++;
-            int lend = lable_count++;
-
-            generate_x86(node->left, file);
-           
-            asmprintf(file, "cmpl $0, %%eax\n");
-            opcodes[opcodes_count++] = 0x83;
-            opcodes[opcodes_count++] = 0xf8;
-            opcodes[opcodes_count++] = 0x00;
-
-            /* jmp to false placeholder */
-            asmprintf(file, "je .Lfalse%d\n", lfalse);
-            opcodes[opcodes_count++] = 0x0f;
-            opcodes[opcodes_count++] = 0x84;
-            int lfalse_patch = opcodes_count;
-            *((int*)(opcodes + opcodes_count)) = 0;
-            opcodes_count += 4;
-
-            asmprintf(file, "# If true\n");
-            generate_x86(node->right->left, file);
-
-            if (node->right->right) {
-
-                /* jmp to end placeholder */
-                asmprintf(file, "jmp .Lend%d\n", lend);
-                opcodes[opcodes_count++] = 0xe9;
-                int lend_patch = opcodes_count;
-                *((int*)(opcodes + opcodes_count)) = 0;
-                opcodes_count += 4;
-
-                asmprintf(file, ".Lfalse%d:\n", lfalse);
-                *((int*)(opcodes + lfalse_patch)) = opcodes_count - lfalse_patch - 4;
-
-                generate_x86(node->right->right, file);
-                
-                asmprintf(file, ".Lend%d:\n", lend);
-                *((int*)(opcodes + lend_patch)) = opcodes_count - lend_patch - 4;
-            } else {
-                asmprintf(file, ".Lfalse%d:\n", lfalse);
-                *((int*)(opcodes + lfalse_patch)) = opcodes_count - lfalse_patch - 4;
-            }
-            break;
-        }
-        case AST_WHILE: {
-            asmprintf(file, "# While statement\n");
-            int lstart = lable_count++;
-            int lend = lable_count++;
+static void store_reg(int v, int reg) {
+    if (fn->reg[v] == reg || fn->reg[v] == REG_NONE) return;
+    asmprintf(NULL, "movl %s, ", x86_reg_name(reg));
+    asm_loc(v);
+    asmprintf(NULL, "\n");
+    x86_byte(0x89); x86_rm(reg, v);
+}
+
+/* reg = reg <op> v, for the "op r32, r/m32" encodings */
+static void x86_op_rm(int opcode, const char *name, int reg, int v) {
+    asmprintf(NULL, "%s ", name);
+    asm_loc(v);
+    asmprintf(NULL, ", %s\n", x86_reg_name(reg));
+    if (opcode > 0xff) x86_byte(opcode >> 8);
+    x86_byte(opcode & 0xff);
+    x86_rm(reg, v);
+}
+
+static int is_commutative(int op) {
+    return op == Add || op == Mul || op == And || op == Or || op == Xor || op == Eq || op == Ne;
+}
 
+/* x86 condition code of a comparison operator, as in setcc and jcc */
+static int cc_code(int op) {
+    switch (op) {
+        case Eq: return 0x4;
+        case Ne: return 0x5;
+        case Lt: return 0xc;
+        case Ge: return 0xd;
+        case Le: return 0xe;
+    }
+    return 0xf;
+}
 
-            asmprintf(file, ".Lstart%d:\n", lstart);
-            int while_start = opcodes_count;
+static const char *cc_name(int op) {
+    switch (op) {
+        case Eq: return "e";
+        case Ne: return "ne";
+        case Lt: return "l";
+        case Ge: return "ge";
+        case Le: return "le";
+    }
+    return "g";
+}
 
-            generate_x86(node->left, file);
+/* Comparison with its operands swapped */
+static int mirror_compare(int op) {
+    switch (op) {
+        case Lt: return Gt;
+        case Gt: return Lt;
+        case Le: return Ge;
+        case Ge: return Le;
+    }
+    return op;
+}
 
-            asmprintf(file, "cmpl $0, %%eax\n");
-            opcodes[opcodes_count++] = 0x83;
-            opcodes[opcodes_count++] = 0xf8;
-            opcodes[opcodes_count++] = 0x00;
+/* Binary operators with an immediate form for their right operand */
+static int has_imm_form(int op) {
+    return op != Div && op != Mod && op != Inc && op != Dec;
+}
 
+/* Value of an IR_IMM or IR_GLOBAL definition */
+static int const_value(struct ir_insn *def) {
+    return def->op == IR_GLOBAL ? global_address(def->imm) : def->imm;
+}
 
-            asmprintf(file, "je .Lend%d\n", lend);
-            opcodes[opcodes_count++] = 0x0f;
-            opcodes[opcodes_count++] = 0x84;
-            int while_end_patch = opcodes_count;
-            *((int*)(opcodes + opcodes_count)) = 0;
-            opcodes_count += 4;
-            
-            /* Generate */
-            generate_x86(node->right, file);
+/* Divisor that emit_const_div() handles without idivl */
+static int is_const_divisor(struct ir_insn *def) {
+    return def->op == IR_IMM && def->imm != (int)0x80000000 && (def->imm > 1 || def->imm < -1);
+}
 
-            asmprintf(file, "jmp .Lstart%d\n", lstart);
-            opcodes[opcodes_count++] = 0xe9;
-            *((int*)(opcodes + opcodes_count)) = while_start - opcodes_count - 4;
-            opcodes_count += 4;
+/* Definition of v if it is the only one and v has a single use */
+static struct ir_insn *single_def(int *uses, int *defs, int v) {
+    return v && uses[v] == 1 && defs[v] == 1 ? fn->insns + def_at[v] : NULL;
+}
 
-            asmprintf(file, ".Lend%d:\n", lend);
-            *((int*)(opcodes + while_end_patch)) = opcodes_count - while_end_patch - 4;        
+static int single_imm(int *uses, int *defs, int v, int *value) {
+    struct ir_insn *def = single_def(uses, defs, v);
+    if (!def || def->op != IR_IMM) return 0;
+    *value = def->imm;
+    return 1;
+}
 
-            break;
+/* v keeps its value between the instructions at from and to */
+static int unchanged(int v, int from, int to) {
+    for (int i = from + 1; v && i < to; i++) {
+        if (fn->insns[i].dst == v) return 0;
+    }
+    return 1;
+}
+
+static void nop(struct ir_insn *insn) {
+    memset(insn, 0, sizeof(struct ir_insn));
+    insn->op = IR_NOP;
+}
+
+/**
+ * Match v = i * scale, or i << log2(scale), for a scale of 1, 2, 4 or 8
+ * and a single use of v at the instruction at. Returns the multiplication
+ * with i in *index.
+ */
+static struct ir_insn *scaled_index(int *uses, int *defs, int v, int at, int *index, int *scale) {
+    struct ir_insn *mul = single_def(uses, defs, v);
+    int value;
+    if (!mul || mul->op != IR_BIN || (mul->aux != Mul && mul->aux != Shl)) return NULL;
+    if (single_imm(uses, defs, mul->b, &value)) {
+        *index = mul->a;
+    } else if (mul->aux == Mul && single_imm(uses, defs, mul->a, &value)) {
+        *index = mul->b;
+    } else {
+        return NULL;
+    }
+    if (mul->aux == Shl) value = value >= 0 && value <= 3 ? 1 << value : 0;
+    if (value != 1 && value != 2 && value != 4 && value != 8) return NULL;
+    if (!unchanged(*index, mul - fn->insns, at)) return NULL;
+    *scale = value;
+    return mul;
+}
+
+/**
+ * Rewrite the add at j as an IR_LEA when one operand is an index scaled by
+ * 1, 2, 4 or 8, or when its only use is as the address of a load or store.
+ * An index of the form i + c adds c * scale to the displacement instead.
+ */
+static void select_lea(int *uses, int *defs, unsigned char *address_use, int j) {
+    struct ir_insn *add = fn->insns + j, *mul, *inner;
+    int base = add->a, index = 0, scale = 1, disp = 0, value;
+    int address = address_use[add->dst] && single_def(uses, defs, add->dst);
+
+    if ((mul = scaled_index(uses, defs, add->b, j, &index, &scale))) {
+        base = add->a;
+    } else if ((mul = scaled_index(uses, defs, add->a, j, &index, &scale))) {
+        base = add->b;
+    } else if (!address) {
+        return;
+    } else if (single_imm(uses, defs, add->b, &disp)) {
+        nop(fn->insns + def_at[add->b]);
+    } else if (single_imm(uses, defs, add->a, &disp)) {
+        base = add->b;
+        nop(fn->insns + def_at[add->a]);
+    } else {
+        index = add->b;
+    }
+    if (mul) {
+        nop(fn->insns + def_at[mul->a == index ? mul->b : mul->a]);
+        nop(mul);
+        inner = single_def(uses, defs, index);
+        if (inner && inner->op == IR_BIN && (inner->aux == Add || inner->aux == Sub) &&
+            single_imm(uses, defs, inner->b, &value) && unchanged(inner->a, inner - fn->insns, j)) {
+            unsigned offset = inner->aux == Add ? (unsigned)value : 0u - value;
+            disp = (int)(offset * scale);
+            index = inner->a;
+            nop(fn->insns + def_at[inner->b]);
+            nop(inner);
         }
-        case AST_BLOCK:
-            generate_x86(node->left, file);
-            return;
-        case AST_EXPR_STMT:
-            generate_x86(node->left, file);
-            break;
-        case AST_ASSIGN:
+    }
 
-            if(node->left->type != AST_IDENT && node->left->type != AST_MEMBER_ACCESS && node->left->type != AST_DEREF && node->left->type != AST_ADDR){
-                printf("Assign: Left-hand side of assignment must be an identifier or member access 2\n");
-                exit(-1);
+    add->op = IR_LEA;
+    add->a = base;
+    add->b = 0;
+    add->index = index;
+    add->scale = index ? scale : 0;
+    add->imm = disp;
+    add->aux = 0;
+}
+
+/**
+ * Instruction selection for addresses: fold base + index * scale + disp
+ * computations into an IR_LEA, and an IR_LEA used only as the address of a
+ * load or store into that load or store's memory operand.
+ */
+static void select_addresses(int *uses, int *defs) {
+    unsigned char *address_use = zmalloc(fn->vregs + 1);
+    if (!address_use) {
+        printf("Unable to malloc codegen state\n");
+        exit(-1);
+    }
+    for (int j = 0; j < fn->insn_count; j++) {
+        struct ir_insn *insn = fn->insns + j;
+        if (insn->op == IR_LOAD || (insn->op == IR_STORE && insn->b != insn->a)) address_use[insn->a] = 1;
+    }
+
+    for (int j = 0; j < fn->insn_count; j++) {
+        struct ir_insn *insn = fn->insns + j, *lea;
+        if (insn->op == IR_BIN && insn->aux == Add && insn->a != insn->b) {
+            select_lea(uses, defs, address_use, j);
+        } else if ((insn->op == IR_LOAD || insn->op == IR_STORE) && address_use[insn->a]) {
+            lea = single_def(uses, defs, insn->a);
+            if (!lea || lea->op != IR_LEA) continue;
+            if (!unchanged(lea->a, lea - fn->insns, j) || !unchanged(lea->index, lea - fn->insns, j)) continue;
+            insn->a = lea->a;
+            insn->index = lea->index;
+            insn->scale = lea->scale;
+            insn->imm += lea->imm;
+            nop(lea);
+        }
+    }
+    free(address_use);
+}
+
+/**
+ * Fold constants and addresses that their single user can encode directly,
+ * frame/global addresses into loads and stores, constants into stores,
+ * pushed arguments, return values and the immediate form of binary operators.
+ */
+static void select_lazy(int *uses, int *defs) {
+    for (int j = 0; j < fn->insn_count; j++) {
+        struct ir_insn *use = fn->insns + j;
+        int a = use->a, b = use->b;
+        int a_op = uses[a] == 1 && defs[a] == 1 ? fn->insns[def_at[a]].op : -1;
+        int b_op = uses[b] == 1 && defs[b] == 1 ? fn->insns[def_at[b]].op : -1;
+
+        if (use->op == IR_ARG || use->op == IR_RET) {
+            lazy[a] = a_op == IR_IMM || a_op == IR_GLOBAL;
+        } else if (use->op == IR_LOAD || use->op == IR_STORE || use->op == IR_LEA) {
+            lazy[a] = a_op == IR_LOCAL || a_op == IR_GLOBAL;
+            if (use->op == IR_STORE && b != a) lazy[b] = b_op == IR_IMM;
+        } else if (use->op == IR_BIN && has_imm_form(use->aux)) {
+            int a_const = a_op == IR_IMM || a_op == IR_GLOBAL;
+            int b_const = b_op == IR_IMM || b_op == IR_GLOBAL;
+            if (a_const && !b_const && a != b && is_commutative(use->aux)) {
+                use->a = b;
+                use->b = a;
+                b_const = 1;
             }
-            if(node->right->type == AST_FUNCALL){
-                /** 
-                 * Optimization: If we know that right is a function, we know the result will be in %eax.
-                 * Therefor we can simple store the result in the left operand.
-                 */
-                generate_x86(node->right, file);
-                if(node->left->type == AST_IDENT){
-                    if(node->left->ident.class == Loc){
-                        asmprintf(file, "movl %%eax, %d(%%ebp)\n", node->left->value);
-                        opcodes[opcodes_count++] = 0x89; opcodes[opcodes_count++] = 0x45; opcodes[opcodes_count++] = node->left->value;
-                    }
-                    else if(node->left->ident.class == Glo){
-                        int offset = (node->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                        int address = config.org+5 + offset;
+            if (b_const && use->a != use->b) lazy[use->b] = 1;
+        } else if (use->op == IR_JCC) {
+            int a_const = a_op == IR_IMM || a_op == IR_GLOBAL;
+            int b_const = b_op == IR_IMM || b_op == IR_GLOBAL;
+            if (a_const && !b_const && a != b) {
+                use->a = b;
+                use->b = a;
+                use->aux = mirror_compare(use->aux);
+                b_const = 1;
+            }
+            if (b_const && use->a != use->b) lazy[use->b] = 1;
+        } else if (use->op == IR_BIN && (use->aux == Div || use->aux == Mod)) {
+            lazy[b] = b_op == IR_IMM && a != b && is_const_divisor(fn->insns + def_at[b]) && pass_enabled(PASS_STRENGTH);
+        }
+    }
+}
 
-                        /* insert %eax into address */
-                        asmprintf(file, "movl %%eax, $0x%x\n", address);
-                        opcodes[opcodes_count++] = 0xc7; opcodes[opcodes_count++] = 0x05; *((int*)(opcodes + opcodes_count)) = address; opcodes_count += 4;
-                    }
-                } else if(node->left->type == AST_MEMBER_ACCESS){
-                    if(node->left->left->ident.class == Loc){
-                        asmprintf(file, "movl %%eax, %d(%%ebp)\n", ADJUST_SIZE(node->left->left) + node->left->member->offset);
-                        opcodes[opcodes_count++] = 0x89; opcodes[opcodes_count++] = 0x45; opcodes[opcodes_count++] = ADJUST_SIZE(node->left->left) + node->left->member->offset;
-                    }
-                    else if(node->left->left->ident.class == Glo){
-                        int offset = (node->left->left->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                        int address = config.org+5 + offset;
+static void emit_value(struct ir_insn *insn) {
+    struct function *f;
+    int v = insn->dst, reg = dst_reg(v);
+    if (fn->reg[v] == REG_NONE) return;
 
-                        /* insert %eax into address with member offset */
-                        asmprintf(file, "movl %%eax, $0x%x\n", address + node->left->member->offset);
-                        opcodes[opcodes_count++] = 0xc7; opcodes[opcodes_count++] = 0x05; *((int*)(opcodes + opcodes_count)) = address + node->left->member->offset; opcodes_count += 4;
-                    }
-                    else {
-                        printf("Unknown identifier class\n");
-                        exit(-1);
-                    }
-                }
+    switch (insn->op) {
+        case IR_IMM:
+            if (fn->reg[v] == REG_SPILLED) {
+                asmprintf(NULL, "movl $%d, %d(%%ebp)\n", insn->imm, fn->slot[v]);
+                x86_byte(0xc7); x86_mem(0, EBP, fn->slot[v]); x86_int(insn->imm);
                 return;
             }
+            asmprintf(NULL, "movl $%d, %s\n", insn->imm, x86_reg_name(reg));
+            x86_byte(0xb8 + reg); x86_int(insn->imm);
+            break;
+        case IR_LOCAL:
+            asmprintf(NULL, "leal %d(%%ebp), %s\n", insn->imm, x86_reg_name(reg));
+            x86_byte(0x8d); x86_mem(reg, EBP, insn->imm);
+            break;
+        case IR_GLOBAL:
+            asmprintf(NULL, "movl $0x%x, %s\n", global_address(insn->imm), x86_reg_name(reg));
+            x86_byte(0xb8 + reg); x86_int(global_address(insn->imm));
+            break;
+        case IR_FUNC:
+            f = find_function_id(insn->imm);
+            if (!f || !f->entry) {
+                printf("Function %d not found\n", insn->imm);
+                exit(-1);
+            }
+            printf("Function %s address: 0x%x\n", f->name, config.org + (int)f->entry);
+            asmprintf(NULL, "movl $0x%x, %s\n", (int)f->entry, x86_reg_name(reg));
+            x86_byte(0xb8 + reg); x86_int((int)f->entry);
+            break;
+    }
+    store_reg(v, reg);
+}
 
-            if(node->right->type == AST_NUM){
-                /* Optimization: assign constant to variable */
-                if (node->left->type == AST_IDENT) {
-                    if (node->left->ident.class == Loc) {
-                        asmprintf(file, "movl $%d, %d(%%ebp)\n", node->right->value, node->left->value);
+/* The address operand of a load, store or lea needs a scratch register */
+static int address_in_memory(struct ir_insn *insn) {
+    return (!lazy[insn->a] && fn->reg[insn->a] < 0) || (insn->index && fn->reg[insn->index] < 0);
+}
 
-                        opcodes[opcodes_count++] = 0xc7;
-                        opcodes[opcodes_count++] = 0x45;
-                        opcodes[opcodes_count++] = node->left->value;
-                        *((int*)(opcodes + opcodes_count)) = node->right->value;
-                        opcodes_count += 4;
+/**
+ * Base, index and displacement of the address operand of a load, store or
+ * lea. Operands in memory are loaded into scratch, when both are the scaled
+ * index is added to the base there.
+ */
+static int address(struct ir_insn *insn, int scratch, int *index, int *disp) {
+    int base, in_memory = !lazy[insn->a] && fn->reg[insn->a] < 0;
+    *disp = insn->imm;
+    *index = insn->index ? fn->reg[insn->index] : -1;
+
+    if (insn->index && *index < 0 && in_memory) {
+        load_reg(scratch, insn->index);
+        if (insn->scale > 1) {
+            asmprintf(NULL, "shll $%d, %s\n", scale_bits(insn->scale), x86_reg_name(scratch));
+            x86_byte(0xc1); x86_byte(0xe0 | scratch); x86_byte(scale_bits(insn->scale));
+        }
+        x86_op_rm(0x03, "addl", scratch, insn->a);
+        *index = -1;
+        return scratch;
+    }
+    if (lazy[insn->a]) {
+        struct ir_insn *def = fn->insns + def_at[insn->a];
+        *disp += def->op == IR_LOCAL ? def->imm : global_address(def->imm);
+        base = def->op == IR_LOCAL ? EBP : ABS;
+    } else if (in_memory) {
+        load_reg(scratch, insn->a);
+        base = scratch;
+    } else {
+        base = fn->reg[insn->a];
+    }
+    if (insn->index && *index < 0) {
+        load_reg(scratch, insn->index);
+        *index = scratch;
+    }
+    return base;
+}
 
-                    } else if (node->left->ident.class == Glo) {
-                        int offset = (node->left->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                        int address = config.org+5 + offset ;
+static void emit_load(struct ir_insn *insn) {
+    int disp, index, reg = dst_reg(insn->dst);
+    if (fn->reg[insn->dst] == REG_NONE) return;
+
+    int base = address(insn, EAX, &index, &disp);
+    asmprintf(NULL, "%s ", insn->size == 1 ? "movzb" : "movl");
+    asm_addr(base, index, insn->scale, disp);
+    asmprintf(NULL, ", %s\n", x86_reg_name(reg));
+    if (insn->size == 1) {
+        x86_byte(0x0f); x86_byte(0xb6);
+    } else {
+        x86_byte(0x8b);
+    }
+    x86_addr(reg, base, index, insn->scale, disp);
+    store_reg(insn->dst, reg);
+}
 
-                        /* insert constant into address */
-                        asmprintf(file, "movl $%d, $0x%x\n", node->right->value, address);
-                        opcodes[opcodes_count++] = 0xc7; opcodes[opcodes_count++] = 0x05; *((int*)(opcodes + opcodes_count)) = address; opcodes_count += 4;
+static void emit_store(struct ir_insn *insn) {
+    int base, index, disp, src = EAX, borrowed = 0;
 
-                    }
-                } else if (node->left->type == AST_MEMBER_ACCESS) {
-
-                    /* If the ident if a pointer, we need to adjust the code */
-                    if(node->left->left->ident.type >= PTR && node->left->left->ident.type < PTR2){
-                        asmprintf(file, "movl %d(%%ebp), %%eax\n", ADJUST_SIZE(node->left->left));
-                        opcodes[opcodes_count++] = 0x8b;
-                        opcodes[opcodes_count++] = 0x45;
-                        opcodes[opcodes_count++] = ADJUST_SIZE(node->left->left);
-
-                        asmprintf(file, "movl $%d, %d(%%eax)\n", node->right->value,  node->left->member->offset);
-                        opcodes[opcodes_count++] = 0xc7;
-                        opcodes[opcodes_count++] = 0x40;
-                        opcodes[opcodes_count++] = node->left->member->offset;
-                        *((int*)(opcodes + opcodes_count)) = node->right->value;
-                        opcodes_count += 4;
-
-                        return;
-                    } 
-
-                    if(node->left->left->ident.class == Loc){
-                        asmprintf(file, "movl $%d, %d(%%ebp)\n", node->right->value, ADJUST_SIZE(node->left->left) + node->left->member->offset);
-                        opcodes[opcodes_count++] = 0xc7;
-                        opcodes[opcodes_count++] = 0x45;
-                        opcodes[opcodes_count++] = ADJUST_SIZE(node->left->left) + node->left->member->offset;
-                        *((int*)(opcodes + opcodes_count)) = node->right->value;
-                        opcodes_count += 4;
-                    }
-                    else if(node->left->left->ident.class == Glo){
-                        int offset = (node->left->left->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                        int address = config.org+5 + offset;
-
-                        /* insert constant into address with member offset */                        
-                        asmprintf(file, "movl $%d, 0x%x\n", node->right->value, address + node->left->member->offset);
-                        opcodes[opcodes_count++] = 0xc7;  /* Opcode for movl with immediate to memory */
-                        opcodes[opcodes_count++] = 0x05;  /* ModR/M byte for direct addressing */
-                        *((unsigned int *)(opcodes + opcodes_count)) = address + node->left->member->offset;  /* Address + offset */
-                        opcodes_count += 4;
-                        *((int *)(opcodes + opcodes_count)) = node->right->value;  /* Immediate value */
-                        opcodes_count += 4;
-                    }             
-                    else {
-                        printf("Unknown identifier class\n");
-                        exit(-1);
-                    }
-                } else if(node->left->type == AST_DEREF){
-                    generate_x86(node->left->left, file);
-
-                    asmprintf(file, "movl $%d, (%%eax)\n", node->right->value);
-                    opcodes[opcodes_count++] = 0xc7;
-                    opcodes[opcodes_count++] = 0x00;
-                    *((int*)(opcodes + opcodes_count)) = node->right->value;
-                    opcodes_count += 4;
-                } else if(node->left->type == AST_ADDR){
-                    generate_x86(node->left->left, file);
-
-                    asmprintf(file, "movl $%d, (%%eax)\n", node->right->value);
-                    opcodes[opcodes_count++] = 0xc7;
-                    opcodes[opcodes_count++] = 0x00;
-                    *((int*)(opcodes + opcodes_count)) = node->right->value;
-                    opcodes_count += 4;                    
+    if (!lazy[insn->b]) {
+        src = fn->reg[insn->b];
+        /* Only %eax to %ebx have a byte register */
+        if (src < 0 || (insn->size == 1 && src > EBX)) {
+            load_reg(EAX, insn->b);
+            src = EAX;
+        }
+    }
+    if (src == EAX && address_in_memory(insn)) {
+        /* Value and address both in memory, borrow %ecx, or %edx if the other address operand is in %ecx */
+        borrowed = fn->reg[insn->a] == ECX || (insn->index && fn->reg[insn->index] == ECX) ? EDX : ECX;
+        asmprintf(NULL, "pushl %s\n", x86_reg_name(borrowed));
+        x86_byte(0x50 + borrowed);
+        base = address(insn, borrowed, &index, &disp);
+    } else {
+        base = address(insn, EAX, &index, &disp);
+    }
 
-                } else {
-                    printf("Assign 2: Left-hand side of assignment must be an identifier or member access\n");
-                    exit(-1);
-                }
+    if (lazy[insn->b]) {
+        int imm = fn->insns[def_at[insn->b]].imm;
+        asmprintf(NULL, "movl $%d, ", imm);
+        asm_addr(base, index, insn->scale, disp);
+        asmprintf(NULL, "\n");
+        x86_byte(insn->size == 1 ? 0xc6 : 0xc7);
+        x86_addr(0, base, index, insn->scale, disp);
+        if (insn->size == 1) x86_byte(imm); else x86_int(imm);
+    } else {
+        asmprintf(NULL, "movl %s, ", x86_reg_name(src));
+        asm_addr(base, index, insn->scale, disp);
+        asmprintf(NULL, "\n");
+        x86_byte(insn->size == 1 ? 0x88 : 0x89);
+        x86_addr(src, base, index, insn->scale, disp);
+    }
 
+    if (borrowed) {
+        asmprintf(NULL, "popl %s\n", x86_reg_name(borrowed));
+        x86_byte(0x58 + borrowed);
+    }
+}
 
-                return; 
-            }
+static void emit_lea(struct ir_insn *insn) {
+    int disp, index, reg = dst_reg(insn->dst);
+    if (fn->reg[insn->dst] == REG_NONE) return;
+
+    int base = address(insn, EAX, &index, &disp);
+    asmprintf(NULL, "leal ");
+    asm_addr(base, index, insn->scale, disp);
+    asmprintf(NULL, ", %s\n", x86_reg_name(reg));
+    x86_byte(0x8d);
+    x86_addr(reg, base, index, insn->scale, disp);
+    store_reg(insn->dst, reg);
+}
 
-            /* Push the address of the left operand onto the stack */
-            if (node->left->type == AST_IDENT) {
-                
-                /* If the ident if a pointer, we need to adjust the code */
-                if(node->left->ident.type >= PTR && node->left->ident.type < PTR2 && node->right->type == AST_NUM){
-                    asmprintf(file, "movl %d(%%ebp), %%eax\n", ADJUST_SIZE(node->left));
-                    opcodes[opcodes_count++] = 0x8b;
-                    opcodes[opcodes_count++] = 0x45;
-                    opcodes[opcodes_count++] = ADJUST_SIZE(node->left);
-
-                    asmprintf(file, "pushl %%eax\n");
-                    opcodes[opcodes_count++] = 0x50;
-
-                    asmprintf(file, "movl $%d, (%%eax)\n", node->right->value);
-                    opcodes[opcodes_count++] = 0xc7;
-                    opcodes[opcodes_count++] = 0x00;
-                    *((int*)(opcodes + opcodes_count)) = node->right->value;
-                    opcodes_count += 4;
-
-                    return;
-                }
+static void emit_mov(struct ir_insn *insn) {
+    int reg = fn->reg[insn->dst];
+    if (reg == REG_NONE) return;
+    if (reg >= 0) {
+        load_reg(reg, insn->a);
+    } else if (fn->reg[insn->a] >= 0) {
+        store_reg(insn->dst, fn->reg[insn->a]);
+    } else {
+        load_reg(EAX, insn->a);
+        store_reg(insn->dst, EAX);
+    }
+}
+
+/* reg = reg <op> imm, ext is the opcode extension of the 0x81/0x83 group */
+static void x86_op_imm(int ext, const char *name, int reg, int imm) {
+    asmprintf(NULL, "%s $%d, %s\n", name, imm, x86_reg_name(reg));
+    if (imm >= -128 && imm <= 127) {
+        x86_byte(0x83); x86_byte(0xc0 | ext << 3 | reg); x86_byte(imm);
+    } else {
+        x86_byte(0x81); x86_byte(0xc0 | ext << 3 | reg); x86_int(imm);
+    }
+}
+
+/* Two operand instruction with b as register, memory or immediate operand */
+static void x86_alu(int opcode, int ext, const char *name, int reg, int b) {
+    if (lazy[b]) {
+        x86_op_imm(ext, name, reg, const_value(fn->insns + def_at[b]));
+    } else {
+        x86_op_rm(opcode, name, reg, b);
+    }
+}
+
+/* Signed magic number and shift for division by d >= 2, Hacker's Delight 10-1 */
+static void div_magic(int d, int *magic, int *shift) {
+    unsigned two31 = 0x80000000, ad = d;
+    unsigned anc = two31 - 1 - (two31 - 1) % ad;
+    unsigned q1 = two31 / anc, r1 = two31 - q1 * anc;
+    unsigned q2 = two31 / ad, r2 = two31 - q2 * ad, delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2; r1 *= 2;
+        if (r1 >= anc) { q1++; r1 -= anc; }
+        q2 *= 2; r2 *= 2;
+        if (r2 >= ad) { q2++; r2 -= ad; }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *magic = q2 + 1;
+    *shift = p - 32;
+}
+
+/**
+ * a / d or a % d for a constant divisor without idivl, returns the register
+ * holding the result. Powers of two shift after adding 2^k-1 to negative
+ * dividends so the quotient rounds towards zero, other divisors multiply by
+ * a magic number and keep the high half. Only %eax and %edx are written.
+ */
+static int emit_const_div(int op, int a, int d) {
+    int ad = d < 0 ? -d : d, k = 0, magic, shift;
+    while ((1u << k) < (unsigned)ad) k++;
+
+    if ((1u << k) == (unsigned)ad) {
+        load_reg(EAX, a);
+        asmprintf(NULL, "cltd\n");
+        x86_byte(0x99);
+        x86_op_imm(4, "andl", EDX, ad - 1);
+        asmprintf(NULL, "addl %%edx, %%eax\n");
+        x86_byte(0x01); x86_byte(0xd0);
+        if (op == Mod) {
+            x86_op_imm(4, "andl", EAX, ad - 1);
+            asmprintf(NULL, "subl %%edx, %%eax\n");
+            x86_byte(0x29); x86_byte(0xd0);
+            return EAX;
+        }
+        asmprintf(NULL, "sarl $%d, %%eax\n", k);
+        x86_byte(0xc1); x86_byte(0xf8); x86_byte(k);
+        if (d < 0) {
+            asmprintf(NULL, "negl %%eax\n");
+            x86_byte(0xf7); x86_byte(0xd8);
+        }
+        return EAX;
+    }
 
-                if (node->left->ident.class == Loc) {
-                    asmprintf(file, "leal %d(%%ebp), %%eax\n", node->left->value);
-                    opcodes[opcodes_count++] = 0x8d;
-                    opcodes[opcodes_count++] = 0x45;
-                    opcodes[opcodes_count++] = node->left->value;
+    div_magic(ad, &magic, &shift);
+    asmprintf(NULL, "movl $%d, %%eax\n", magic);
+    x86_byte(0xb8); x86_int(magic);
+    asmprintf(NULL, "imull ");
+    asm_loc(a);
+    asmprintf(NULL, "\n");
+    x86_byte(0xf7); x86_rm(5, a);
+    /* A magic number above 2^31 was multiplied as negative, add a back */
+    if (magic < 0) x86_op_rm(0x03, "addl", EDX, a);
+    if (shift) {
+        asmprintf(NULL, "sarl $%d, %%edx\n", shift);
+        x86_byte(0xc1); x86_byte(0xfa); x86_byte(shift);
+    }
+    /* Add one for negative quotients */
+    asmprintf(NULL, "movl %%edx, %%eax\nshrl $31, %%eax\naddl %%eax, %%edx\n");
+    x86_byte(0x89); x86_byte(0xd0);
+    x86_byte(0xc1); x86_byte(0xe8); x86_byte(31);
+    x86_byte(0x01); x86_byte(0xc2);
+    if (op == Div) {
+        if (d < 0) {
+            asmprintf(NULL, "negl %%edx\n");
+            x86_byte(0xf7); x86_byte(0xda);
+        }
+        return EDX;
+    }
+    asmprintf(NULL, "imull $%d, %%edx, %%edx\n", ad);
+    x86_byte(0x69); x86_byte(0xd2); x86_int(ad);
+    load_reg(EAX, a);
+    asmprintf(NULL, "subl %%edx, %%eax\n");
+    x86_byte(0x29); x86_byte(0xd0);
+    return EAX;
+}
 
+static void emit_binop(struct ir_insn *insn) {
+    int d = insn->dst, a = insn->a, b = insn->b;
+    if (fn->reg[d] == REG_NONE) return;
 
-                } else if (node->left->ident.class == Glo) {
-                    int offset = (node->left->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                    int address = config.org+5 + offset;
+    /* Two operand forms compute in the destination register unless it holds b */
+    if (fn->reg[d] >= 0 && fn->reg[d] == fn->reg[b] && is_commutative(insn->aux)) {
+        a = insn->b;
+        b = insn->a;
+    }
+    int work = fn->reg[d] >= 0 && fn->reg[d] != fn->reg[b] ? fn->reg[d] : EAX;
 
-                    asmprintf(file, "movl $0x%x, %%eax # Ident\n", address);
-                    opcodes[opcodes_count++] = 0xb8;
-                    *((int*)(opcodes + opcodes_count)) = address;
-                    opcodes_count += 4;
+    switch (insn->aux) {
+        case Add:
+            load_reg(work, a);
+            x86_alu(0x03, 0, "addl", work, b);
+            break;
+        case Sub:
+            load_reg(work, a);
+            x86_alu(0x2b, 5, "subl", work, b);
+            break;
+        case Mul:
+            if (lazy[b]) {
+                int imm = const_value(fn->insns + def_at[b]), k = 0;
+                while (k < 31 && (1 << k) < imm) k++;
+                if (imm > 0 && (1 << k) == imm && pass_enabled(PASS_STRENGTH)) {
+                    load_reg(work, a);
+                    if (k) {
+                        asmprintf(NULL, "shll $%d, %s\n", k, x86_reg_name(work));
+                        x86_byte(0xc1); x86_byte(0xe0 | work); x86_byte(k);
+                    }
+                    break;
                 }
-                asmprintf(file, "pushl %%eax\n");
-                opcodes[opcodes_count++] = 0x50;
-            } else if (node->left->type == AST_MEMBER_ACCESS) {
-                /* If the ident if a pointer, we need to adjust the code */
-                if(node->left->left->ident.type >= PTR && node->left->left->ident.type < PTR2){
-                    asmprintf(file, "movl %d(%%ebp), %%eax\n", ADJUST_SIZE(node->left->left));
-                    opcodes[opcodes_count++] = 0x8b;
-                    opcodes[opcodes_count++] = 0x45;
-                    opcodes[opcodes_count++] = ADJUST_SIZE(node->left->left);
-
-                    
-                    if(node->right->type == AST_NUM){
-                        asmprintf(file, "movl $%d, %d(%%eax)\n", node->right->value,  node->left->member->offset);
-                        opcodes[opcodes_count++] = 0xc7;
-                        opcodes[opcodes_count++] = 0x40;
-                        opcodes[opcodes_count++] = node->left->member->offset;
-                        *((int*)(opcodes + opcodes_count)) = node->right->value;
-                        opcodes_count += 4;
-
-                        return;
-                    } else {
-                        asmprintf(file, "pushl %%eax\n");
-                        opcodes[opcodes_count++] = 0x50;
-
-                        generate_x86(node->right, file);
-                        asmprintf(file, "popl %%ebx\n");
-                        opcodes[opcodes_count++] = 0x5b;
-                        asmprintf(file, "movl %%eax, %d(%%ebx)\n", node->left->member->offset);
-                        opcodes[opcodes_count++] = 0x89;
-                        opcodes[opcodes_count++] = 0x43;
-                        opcodes[opcodes_count++] = node->left->member->offset;
-                
+                if ((imm == 3 || imm == 5 || imm == 9) && pass_enabled(PASS_STRENGTH)) {
+                    /* a + a * 2, 4 or 8 */
+                    int src = fn->reg[a];
+                    if (src < 0) {
+                        load_reg(work, a);
+                        src = work;
                     }
-                    return;
-                } 
-
-                /* TODO: Assumes Loc */
-                asmprintf(file, "leal %d(%%ebp), %%eax\n", ADJUST_SIZE(node->left->left) + node->left->member->offset );
-                opcodes[opcodes_count++] = 0x8d;
-                opcodes[opcodes_count++] = 0x45;
-                opcodes[opcodes_count++] = ADJUST_SIZE(node->left->left) + node->left->member->offset;
-                
-                asmprintf(file, "pushl %%eax\n");
-                opcodes[opcodes_count++] = 0x50;
-            } else if(node->left->type == AST_DEREF){
-                generate_x86(node->left->left, file);
-                asmprintf(file, "pushl %%eax\n");
-                opcodes[opcodes_count++] = 0x50;
-            } else if(node->left->type == AST_ADDR){
-                generate_x86(node->left->left, file);
-                asmprintf(file, "pushl %%eax\n");
-                opcodes[opcodes_count++] = 0x50;
-            } else {
-                printf("Assign 3: Left-hand side of assignment must be an identifier or member access\n");
-                exit(-1);
+                    asmprintf(NULL, "leal (%s,%s,%d), %s\n", x86_reg_name(src), x86_reg_name(src), imm - 1, x86_reg_name(work));
+                    x86_byte(0x8d); x86_byte(0x04 | work << 3);
+                    x86_byte((imm == 3 ? 0x40 : imm == 5 ? 0x80 : 0xc0) | src << 3 | src);
+                    break;
+                }
+                /* Three operand form, a is read in place */
+                asmprintf(NULL, "imull $%d, ", imm);
+                asm_loc(a);
+                asmprintf(NULL, ", %s\n", x86_reg_name(work));
+                x86_byte(0x69); x86_rm(work, a); x86_int(imm);
+                break;
             }
-
-            asmprintf(file, "# Assignment\n");
-            /* Evaluate the right operand and store the result in %eax */
-            generate_x86(node->right, file);
-
-            /* Pop the address of the left operand into %ebx and perform the assignment */
-            asmprintf(file, "popl %%ebx\n");
-            GEN_X86_POP_EBX();
-
-            // Fix this for lib.c and tmp.c
-            if(node->data_type == CHAR && node->left->type == AST_IDENT && 0){
-                asmprintf(file, "movzb %%eax, (%%ebx) # Type %d - %d - %d\n", node->data_type, node->left->ident.type, node->left->type);
-                opcodes[opcodes_count++] = 0x0f;
-                opcodes[opcodes_count++] = 0xb6;
-                opcodes[opcodes_count++] = 0x03;
-            } else {
-                asmprintf(file, "movl %%eax, (%%ebx) # Type %d\n", node->data_type);
-                opcodes[opcodes_count++] = 0x89;
-                opcodes[opcodes_count++] = 0x03;
+            load_reg(work, a);
+            x86_op_rm(0x0faf, "imull", work, b);
+            break;
+        case Or:
+            load_reg(work, a);
+            x86_alu(0x0b, 1, "orl", work, b);
+            break;
+        case And:
+            load_reg(work, a);
+            x86_alu(0x23, 4, "andl", work, b);
+            break;
+        case Xor:
+            load_reg(work, a);
+            x86_alu(0x33, 6, "xorl", work, b);
+            break;
+        case Div:
+        case Mod:
+            if (lazy[b]) {
+                work = emit_const_div(insn->aux, a, fn->insns[def_at[b]].imm);
+                break;
             }
-
+            work = insn->aux == Div ? EAX : EDX;
+            load_reg(EAX, a);
+            asmprintf(NULL, "cltd\n");
+            x86_byte(0x99);
+            asmprintf(NULL, "idivl ");
+            asm_loc(b);
+            asmprintf(NULL, "\n");
+            x86_byte(0xf7); x86_rm(7, b);
             break;
-        case AST_MEMBER_ACCESS:
-            generate_x86(node->left, file);
-            asmprintf(file, "movl %d(%%eax), %%eax\n", node->member->offset);
-            opcodes[opcodes_count++] = 0x8b;
-            opcodes[opcodes_count++] = 0x40;
-            opcodes[opcodes_count++] = node->member->offset;
-
-            return;
-        case AST_DEREF:
-            asmprintf(file, "# Dereference\n");
-            generate_x86(node->left, file);
-
-            if(node->data_type == CHAR){
-                asmprintf(file, "movzb (%%eax), %%eax\n");
-                opcodes[opcodes_count++] = 0x0f;
-                opcodes[opcodes_count++] = 0xb6;
-                opcodes[opcodes_count++] = 0x00;
-            } else {
-                asmprintf(file, "movl2 (%%eax), %%eax\n");
-                opcodes[opcodes_count++] = 0x8b;
-                opcodes[opcodes_count++] = 0x00;
+        case Eq: case Ne: case Lt: case Gt: case Le: case Ge: {
+            /* Compare a in place, the flag is widened from %al into the destination */
+            int reg = fn->reg[a];
+            if (reg < 0) {
+                load_reg(EAX, a);
+                reg = EAX;
             }
-            return;
+            work = fn->reg[d] >= 0 ? fn->reg[d] : EAX;
+            x86_alu(0x3b, 7, "cmpl", reg, b);
+            asmprintf(NULL, "set%s %%al\nmovzb %%al, %s\n", cc_name(insn->aux), x86_reg_name(work));
+            x86_byte(0x0f); x86_byte(0x90 | cc_code(insn->aux)); x86_byte(0xc0);
+            x86_byte(0x0f); x86_byte(0xb6); x86_byte(0xc0 | work << 3);
             break;
-        case AST_ADDR:{
-
-            if(node->left->type != AST_IDENT && node->left->type != AST_MEMBER_ACCESS){
-                generate_x86(node->left, file);
-
-                /* TODO: Very ugly fix */
-                asmprintf(file, "%s (%%eax), %%eax # array_type %d\n", node->left->left->ident.array_type == CHAR ? "movzb" : "movl2", node->left->left->ident.array_type == CHAR ? CHAR : INT);
-                if(node->left->left->ident.array_type == CHAR){
-                    opcodes[opcodes_count++] = 0x0f;
-                    opcodes[opcodes_count++] = 0xb6;
-                } else {
-                    opcodes[opcodes_count++] = 0x8b;
-                }
-                opcodes[opcodes_count++] = 0x00;
-
-                return;
+        }
+        case Shl:
+        case Shr:
+            if (lazy[b]) {
+                int imm = const_value(fn->insns + def_at[b]) & 31;
+                load_reg(work, a);
+                asmprintf(NULL, "%s $%d, %s\n", insn->aux == Shl ? "shll" : "sarl", imm, x86_reg_name(work));
+                x86_byte(0xc1); x86_byte((insn->aux == Shl ? 0xe0 : 0xf8) | work); x86_byte(imm);
+                break;
             }
+            /* The count has to be in %cl, a result in %ecx is computed in %eax */
+            if (work == ECX) work = EAX;
+            load_reg(work, a);
+            load_reg(ECX, b);
+            asmprintf(NULL, "%s %%cl, %s\n", insn->aux == Shl ? "shll" : "sarl", x86_reg_name(work));
+            x86_byte(0xd3); x86_byte((insn->aux == Shl ? 0xe0 : 0xf8) | work);
+            break;
+        case Dec:
+        case Inc:
+            load_reg(work, a);
+            asmprintf(NULL, "%s $1, %s\n", insn->aux == Inc ? "addl" : "subl", x86_reg_name(work));
+            x86_byte(0x83); x86_byte((insn->aux == Inc ? 0xc0 : 0xe8) | work); x86_byte(0x01);
+            break;
+        default:
+            printf("Unknown binary operator %d\n", insn->aux);
+            exit(-1);
+    }
+    store_reg(d, work);
+}
 
-            if(node->left->type == AST_IDENT ){
-                  if(node->left->ident.class == Loc){
-                    asmprintf(file, "# Reference\n");
-                    asmprintf(file, "leal %d(%%ebp), %%eax\n", ADJUST_SIZE(node->left));
-                    opcodes[opcodes_count++] = 0x8d;
-                    opcodes[opcodes_count++] = 0x45;
-                    opcodes[opcodes_count++] = ADJUST_SIZE(node->left);
-
-                } else if(node->left->ident.class == Glo){
-                    int offset = (node->left->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                    int address = config.org+5 + offset;
-
-                    asmprintf(file, "# Reference\n");
-                    asmprintf(file, "movl $0x%x, %%eax\n", address);
-                    opcodes[opcodes_count++] = 0xb8;
-                    *((int*)(opcodes + opcodes_count)) = address;
-                    opcodes_count += 4;
-                } else if(node->left->ident.class == Fun){
-
-                    struct function *f = find_function_id(node->left->ident.val);
-                    if (!f) {
-                        printf("Function %.*s not found\n", node->left->ident.name_length, node->left->ident.name);
-                        exit(-1);
-                    }
+static void emit_unop(struct ir_insn *insn) {
+    if (fn->reg[insn->dst] == REG_NONE) return;
+    load_reg(EAX, insn->a);
+    switch (insn->aux) {
+        case Ne:
+            asmprintf(NULL, "cmpl $0, %%eax\n");
+            asmprintf(NULL, "sete %%al\n");
+            asmprintf(NULL, "movzb %%al, %%eax\n");
+            x86_byte(0x83); x86_byte(0xf8); x86_byte(0x00);
+            x86_byte(0x0f); x86_byte(0x94); x86_byte(0xc0);
+            x86_byte(0x0f); x86_byte(0xb6); x86_byte(0xc0);
+            break;
+        case Sub:
+            asmprintf(NULL, "negl %%eax\n");
+            x86_byte(0xf7); x86_byte(0xd8);
+            break;
+        case Xor:
+            asmprintf(NULL, "notl %%eax\n");
+            x86_byte(0xf7); x86_byte(0xd0);
+            break;
+    }
+    store_reg(insn->dst, EAX);
+}
 
-                    printf("Function %.*s address: 0x%x\n", node->left->ident.name_length, node->left->ident.name, config.org+ (int)f->entry);
+static void emit_builtin(struct ir_insn *insn) {
+    switch (insn->imm) {
+        case INTERRUPT:
+            /**
+             * Interrupt: For the time being, linux style interrupts.
+             * __interrupt(int number, int eax, int ebx, int ecx, int edx, int esi)
+             * The number is the interrupt to call.
+             * Use pushed arguments, pop them into registers and call interrupt.
+             */
+            asmprintf(NULL, "popl %%esi\n"); x86_byte(0x5e);
+            asmprintf(NULL, "popl %%edx\n"); x86_byte(0x5a);
+            asmprintf(NULL, "popl %%ecx\n"); x86_byte(0x59);
+            asmprintf(NULL, "popl %%ebx\n"); x86_byte(0x5b);
+            asmprintf(NULL, "popl %%eax\n"); x86_byte(0x58);
 
-                    asmprintf(file, "# Reference\n");
-                    asmprintf(file, "movl $0x%x, %%eax\n", (int)f->entry);
-                    opcodes[opcodes_count++] = 0xb8;
-                    *((int*)(opcodes + opcodes_count)) = (int)f->entry;
-                    opcodes_count += 4;
-                  
-                } else {
-                    printf("Unknown identifier class\n");
-                    exit(-1);
-                }
-                return;
-            } else {
-                if(node->left->left->ident.class == Loc){
-                    asmprintf(file, "# Reference\n");
-                    asmprintf(file, "leal %d(%%ebp), %%eax\n", ADJUST_SIZE(node->left->left) + node->left->member->offset);
-                    opcodes[opcodes_count++] = 0x8d;
-                    opcodes[opcodes_count++] = 0x45;
-                    opcodes[opcodes_count++] = ADJUST_SIZE(node->left->left) + node->left->member->offset;
-                }
-                else if(node->left->left->ident.class == Glo){
-                    int offset = (node->left->left->value - (long)org_data) + (config.elf ? ELF_HEADER_SIZE : 0);
-                    int address = config.org+5 + offset;
-
-                    asmprintf(file, "# Reference\n");
-                    asmprintf(file, "movl $0x%x, %%eax\n", address + node->left->member->offset);
-                    opcodes[opcodes_count++] = 0xb8;
-                    *((int*)(opcodes + opcodes_count)) = address + node->left->member->offset;
-                    opcodes_count += 4;
-                } else {
-                    printf("Unknown identifier class\n");
-                    exit(-1);
-                }
+            /* pop number */
+            asmprintf(NULL, "popl %%edi\n"); x86_byte(0x5f);
 
-            }
+            /* xor edi and ebp */
+            asmprintf(NULL, "pushl %%ebp\n"); x86_byte(0x55);
+            asmprintf(NULL, "xorl %%ebp, %%ebp\n"); x86_byte(0x31); x86_byte(0xed);
+            asmprintf(NULL, "xorl %%edi, %%edi\n"); x86_byte(0x31); x86_byte(0xff);
 
-          
-            //generate_x86(node->left, file);
-            }return;
-        case AST_ENTER:
-            //printf("Enter %p\n", node);
-            asmprintf(file, "%.*s:\n", node->ident.name_length, node->ident.name);
-            asmprintf(file, "# Setting up stack frame %d\n", opcodes_count);
-            asmprintf(file, "pushl %%ebp\n");
-            asmprintf(file, "movl %%esp, %%ebp\n");
-
-            struct function *f = find_function_id(node->ident.val);
-            if (!f) {
-                printf("Function %.*s not found\n", node->ident.name_length, node->ident.name);
-                exit(-1);
-            }
-            f->entry = (int*)opcodes_count;
+            /* TODO: This is techincally only for mmap */
+            asmprintf(NULL, "dec %%edi\n"); x86_byte(0x4f);
 
-            GEN_X86_PUSH_EBP();
-            GEN_X86_ESP_EBP();
+            asmprintf(NULL, "int $0%d\n", insn->aux);
+            GEN_X86_INT(insn->aux);
 
-            if(node->value > 0){
-                asmprintf(file, "subl $%d, %%esp\n", node->value);
-                GEN_X86_SUB_ESP(node->value);
-            }
+            asmprintf(NULL, "popl %%ebp\n"); x86_byte(0x5d);
             break;
-        case AST_LEAVE:
-            asmprintf(file, "# Cleaning up stack frame\n");
-            if(node->value > 0){
-                asmprintf(file, "addl $%d, %%esp\n", node->value);
-                GEN_X86_ADD_ESP(node->value);
-            }
-            asmprintf(file, "popl %%ebp\n");
-            asmprintf(file, "ret\n\n");
-
-            GEN_X86_POP_EBP();
-            GEN_X86_RET();
+        case INPORTB:
+            asmprintf(NULL, "xorl %%eax, %%eax\n");
+            x86_byte(0x31); x86_byte(0xc0);
+            asmprintf(NULL, "xorl %%edx, %%edx\n");
+            x86_byte(0x31); x86_byte(0xd2);
+            asmprintf(NULL, "popl %%edx\n"); x86_byte(0x5a);
+            asmprintf(NULL, "inb %%dx, %%al\n");
+            x86_byte(0xec);
             break;
-        case AST_ASM:
-            printf("ASM: %.*s\n", node->ident.name_length, node->ident.name);
-            printf("ASM: %s\n", node->asm_code);
-            node->ident.address = opcodes_count;
-
-            /* Parse GAS Intel x86 assembly */
-
+        case OUTPORTB:
+            asmprintf(NULL, "popl %%edx\n"); x86_byte(0x5a);
+            asmprintf(NULL, "popl %%eax\n"); x86_byte(0x58);
+            asmprintf(NULL, "outb %%al, %%dx\n");
+            x86_byte(0xee);
             break;
         default:
-            printf("Unknown AST node type: %d\n", node->type);
+            printf("Unsupported builtin %d\n", insn->imm);
             exit(-1);
     }
+    store_reg(insn->dst, EAX);
+}
 
-    if (node->next) {
-        generate_x86(node->next, file);
+/* Callee-saved registers in prologue push order */
+static const int saved_order[] = { EBX, ESI, EDI };
+
+/* Restore the callee-saved registers and the caller's frame */
+static void emit_epilogue() {
+    for (int k = 2; k >= 0; k--) {
+        if (!(fn->saved_regs >> saved_order[k] & 1)) continue;
+        asmprintf(NULL, "popl %s\n", x86_reg_name(saved_order[k]));
+        x86_byte(0x58 + saved_order[k]);
+    }
+    if (fn->frame_size > 0) {
+        asmprintf(NULL, "addl $%d, %%esp\n", fn->frame_size);
+        GEN_X86_ADD_ESP(fn->frame_size);
+    }
+    asmprintf(NULL, "popl %%ebp\n");
+    GEN_X86_POP_EBP();
+}
+
+/**
+ * A call at index i is in tail position when its result is returned right
+ * away. The arguments replace the function's own, so they must fit in its
+ * parameter area, and nothing may point into the frame that is reused.
+ */
+static int is_tail_call(int i) {
+    struct ir_insn *call = fn->insns + i, *next = fn->insns + i + 1;
+    if (i + 1 >= fn->insn_count || next->op != IR_RET || next->a != call->dst) return 0;
+    return pass_enabled(PASS_TAIL_CALLS) && !frame_escapes && call->aux <= fn->sym->args;
+}
+
+/**
+ * Pop the pushed arguments over the incoming ones, then jump to the first
+ * block for a self call, or tear the frame down and jump to the callee,
+ * which returns to our caller.
+ */
+static void emit_tail_call(struct ir_insn *call, struct function *callee, int self) {
+    for (int k = 0; k < call->aux; k++) {
+        asmprintf(NULL, "popl %d(%%ebp)\n", 8 + 4 * k);
+        x86_byte(0x8f); x86_mem(0, EBP, 8 + 4 * k);
+    }
+    ir_stats.tail_calls++;
+    if (self) {
+        asmprintf(NULL, "jmp .L%d_0\n", fn->sym->val);
+        x86_byte(0xe9);
+        x86_jump_to(0);
+        return;
+    }
+    emit_epilogue();
+    asmprintf(NULL, "jmp %s\n", callee->name);
+    x86_byte(0xe9); x86_int((int)callee->entry - opcodes_count - 4);
+}
+
+static void count_uses(int *uses, int *defs) {
+    memset(uses, 0, (fn->vregs + 1) * sizeof(int));
+    memset(defs, 0, (fn->vregs + 1) * sizeof(int));
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        uses[insn->a]++;
+        uses[insn->b]++;
+        uses[insn->index]++;
+        defs[insn->dst]++;
+        def_at[insn->dst] = i;
     }
 }
 
-void write_opcodes(){
+static void emit_function(struct ir_func *ir) {
+    fn = ir;
+    int *uses = zmalloc((fn->vregs + 1) * sizeof(int));
+    int *defs = zmalloc((fn->vregs + 1) * sizeof(int));
+    def_at = zmalloc((fn->vregs + 1) * sizeof(int));
+    lazy = zmalloc(fn->vregs + 1);
+    block_offset = zmalloc(fn->block_count * sizeof(int));
+    fixups = zmalloc(fn->insn_count * 2 * sizeof(int));
+    if (!uses || !defs || !def_at || !lazy || !block_offset || !fixups) {
+        printf("Unable to malloc codegen state\n");
+        exit(-1);
+    }
+    fixup_count = 0;
+
+    count_uses(uses, defs);
+    if (pass_enabled(PASS_ADDRESSING)) {
+        int before = config.time_passes ? ir_count_insns(fn) : 0;
+        long start = pass_begin();
+        select_addresses(uses, defs);
+        pass_end(PASS_ADDRESSING, start, config.time_passes ? ir_count_insns(fn) - before : 0);
+        count_uses(uses, defs);
+    }
+    select_lazy(uses, defs);
+    ir_allocate_registers(fn, lazy);
+    if (config.ir) ir_print(fn);
+
+    struct function *f = find_function_id(fn->sym->val);
+    if (!f) {
+        printf("Function %.*s not found\n", fn->sym->name_length, fn->sym->name);
+        exit(-1);
+    }
+    /* Jump tables go in front of the function, their entries are filled in once its code is final */
+    table_offset = zmalloc((fn->table_count + 1) * sizeof(int));
+    if (!table_offset) {
+        printf("Unable to malloc codegen state\n");
+        exit(-1);
+    }
+    if (fn->table_count) {
+        while (opcodes_count % 4) x86_byte(0x90);
+    }
+    for (int t = 0; t < fn->table_count; t++) {
+        asmprintf(NULL, ".Ltable%d_%d:\n", fn->sym->val, t);
+        for (int e = 0; e < fn->tables[t].count; e++) {
+            asmprintf(NULL, ".long .L%d_%d\n", fn->sym->val, fn->tables[t].blocks[e]);
+        }
+        table_offset[t] = opcodes_count;
+        opcodes_reserve(fn->tables[t].count * 4);
+        opcodes_count += fn->tables[t].count * 4;
+    }
+    f->entry = (int*)opcodes_count;
+
+    asmprintf(NULL, "%.*s:\n", fn->sym->name_length, fn->sym->name);
+    asmprintf(NULL, "pushl %%ebp\n");
+    asmprintf(NULL, "movl %%esp, %%ebp\n");
+    GEN_X86_PUSH_EBP();
+    GEN_X86_ESP_EBP();
+    if (fn->frame_size > 0) {
+        asmprintf(NULL, "subl $%d, %%esp\n", fn->frame_size);
+        GEN_X86_SUB_ESP(fn->frame_size);
+    }
+    for (int k = 0; k < 3; k++) {
+        if (!(fn->saved_regs >> saved_order[k] & 1)) continue;
+        asmprintf(NULL, "pushl %s\n", x86_reg_name(saved_order[k]));
+        x86_byte(0x50 + saved_order[k]);
+    }
+
+    int block = 0, skip = -1;
+    frame_escapes = 0;
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->a && fn->insns[def_at[insn->a]].op == IR_LOCAL && insn->op != IR_LOAD && insn->op != IR_STORE) frame_escapes = 1;
+        if (insn->b && fn->insns[def_at[insn->b]].op == IR_LOCAL) frame_escapes = 1;
+    }
+
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+
+        while (block < fn->block_count && fn->blocks[block].start == i) {
+            asmprintf(NULL, ".L%d_%d:\n", fn->sym->val, block);
+            block_offset[block++] = opcodes_count;
+        }
+        if (i == skip) continue;
+
+        switch (insn->op) {
+            case IR_IMM:
+            case IR_LOCAL:
+            case IR_GLOBAL:
+            case IR_FUNC:
+                emit_value(insn);
+                break;
+            case IR_LOAD:
+                emit_load(insn);
+                break;
+            case IR_STORE:
+                emit_store(insn);
+                break;
+            case IR_LEA:
+                emit_lea(insn);
+                break;
+            case IR_MOV:
+                emit_mov(insn);
+                break;
+            case IR_BIN:
+                emit_binop(insn);
+                break;
+            case IR_UN:
+                emit_unop(insn);
+                break;
+            case IR_ARG:
+                if (lazy[insn->a]) {
+                    int imm = const_value(fn->insns + def_at[insn->a]);
+                    asmprintf(NULL, "pushl $%d\n", imm);
+                    if (imm >= -128 && imm <= 127) {
+                        x86_byte(0x6a); x86_byte(imm);
+                    } else {
+                        x86_byte(0x68); x86_int(imm);
+                    }
+                    break;
+                }
+                asmprintf(NULL, "pushl ");
+                asm_loc(insn->a);
+                asmprintf(NULL, "\n");
+                if (fn->reg[insn->a] >= 0) {
+                    x86_byte(0x50 + fn->reg[insn->a]);
+                } else {
+                    x86_byte(0xff); x86_rm(6, insn->a);
+                }
+                break;
+            case IR_CALL: {
+                struct function *callee = find_function_id(insn->imm);
+                if (!callee || !callee->entry) {
+                    printf("Function %s not found in JSR\n", callee ? callee->name : "?");
+                    exit(-1);
+                }
+                if (is_tail_call(i)) {
+                    emit_tail_call(insn, callee, callee == f);
+                    /* The return is still needed if it starts a block that is jumped to */
+                    if (fn->blocks[block - 1].start + fn->blocks[block - 1].count > i + 1) skip = i + 1;
+                    break;
+                }
+                asmprintf(NULL, "call %s\n", callee->name);
+                int offset = (int)callee->entry - opcodes_count - 5;
+                GEN_X86_CALL(offset);
+                if (insn->aux > 0) {
+                    asmprintf(NULL, "addl $%d, %%esp # Cleanup stack\n", insn->aux * 4);
+                    GEN_X86_ADD_ESP(insn->aux * 4);
+                }
+                store_reg(insn->dst, EAX);
+                break;
+            }
+            case IR_BUILTIN:
+                emit_builtin(insn);
+                break;
+            case IR_JMP:
+                asmprintf(NULL, "jmp .L%d_%d\n", fn->sym->val, insn->imm);
+                x86_byte(0xe9);
+                x86_jump_to(insn->imm);
+                break;
+            case IR_JCC: {
+                /* Compare a in place when it is in a register or b is an immediate */
+                int reg = fn->reg[insn->a];
+                if (lazy[insn->b] && reg < 0) {
+                    int imm = const_value(fn->insns + def_at[insn->b]);
+                    asmprintf(NULL, "cmpl $%d, ", imm);
+                    asm_loc(insn->a);
+                    asmprintf(NULL, "\n");
+                    if (imm >= -128 && imm <= 127) {
+                        x86_byte(0x83); x86_rm(7, insn->a); x86_byte(imm);
+                    } else {
+                        x86_byte(0x81); x86_rm(7, insn->a); x86_int(imm);
+                    }
+                } else {
+                    if (reg < 0) {
+                        load_reg(EAX, insn->a);
+                        reg = EAX;
+                    }
+                    x86_alu(0x3b, 7, "cmpl", reg, insn->b);
+                }
+                asmprintf(NULL, "j%s .L%d_%d\n", cc_name(insn->aux), fn->sym->val, insn->imm);
+                x86_byte(0x0f); x86_byte(0x80 | cc_code(insn->aux));
+                x86_jump_to(insn->imm);
+                break;
+            }
+            case IR_SWITCH: {
+                /* Index the table with a - low in %eax, values out of range fall through */
+                struct ir_table *table = fn->tables + insn->imm;
+                int reg = fn->reg[insn->a];
+                if (reg < 0) {
+                    load_reg(EAX, insn->a);
+                    if (table->low) x86_op_imm(5, "subl", EAX, table->low);
+                    reg = EAX;
+                } else if (table->low) {
+                    asmprintf(NULL, "leal %d(%s), %%eax\n", (int)(0u - table->low), x86_reg_name(reg));
+                    x86_byte(0x8d); x86_mem(EAX, reg, (int)(0u - table->low));
+                    reg = EAX;
+                }
+                x86_op_imm(7, "cmpl", reg, table->count - 1);
+                asmprintf(NULL, "ja .L%d_%d\n", fn->sym->val, block);
+                x86_byte(0x0f); x86_byte(0x87);
+                x86_jump_to(block);
+                asmprintf(NULL, "jmp *.Ltable%d_%d(,%s,4)\n", fn->sym->val, insn->imm, x86_reg_name(reg));
+                x86_byte(0xff); x86_byte(0x24); x86_byte(0x85 | reg << 3);
+                x86_int(code_address(table_offset[insn->imm]));
+                break;
+            }
+            case IR_RET:
+                if (insn->a && lazy[insn->a]) {
+                    int imm = const_value(fn->insns + def_at[insn->a]);
+                    asmprintf(NULL, "movl $%d, %%eax\n", imm);
+                    GEN_X86_IMD_EAX(imm);
+                } else if (insn->a) {
+                    load_reg(EAX, insn->a);
+                }
+                emit_epilogue();
+                asmprintf(NULL, "ret\n\n");
+                GEN_X86_RET();
+                break;
+        }
+    }
+    while (block < fn->block_count) {
+        block_offset[block++] = opcodes_count;
+    }
+
+    for (int i = 0; i < fixup_count; i++) {
+        int pos = fixups[i * 2];
+        *((int*)(opcodes + pos)) = block_offset[fixups[i * 2 + 1]] - pos - 4;
+    }
 
-    char* buffer = malloc(32*1024);
-    if(!buffer){
-        printf("Failed to allocate memory for buffer\n");
+    int label_count = 0, k = 0;
+    for (int t = 0; t < fn->table_count; t++) label_count += fn->tables[t].count;
+    int *labels = zmalloc((label_count + 1) * sizeof(int));
+    if (!labels) {
+        printf("Unable to malloc codegen state\n");
         exit(-1);
     }
+    for (int t = 0; t < fn->table_count; t++) {
+        for (int e = 0; e < fn->tables[t].count; e++) labels[k++] = block_offset[fn->tables[t].blocks[e]];
+    }
+    if (pass_enabled(PASS_PEEPHOLE)) {
+        int before = opcodes_count;
+        long start = pass_begin();
+        opcodes_count = peephole(opcodes, (int)f->entry, opcodes_count, labels, label_count);
+        pass_end(PASS_PEEPHOLE, start, opcodes_count - before);
+    }
+    k = 0;
+    for (int t = 0; t < fn->table_count; t++) {
+        for (int e = 0; e < fn->tables[t].count; e++) {
+            *((int*)(opcodes + table_offset[t] + 4 * e)) = code_address(labels[k++]);
+        }
+    }
 
-    int pos = 0;
+    free(uses);
+    free(defs);
+    free(def_at);
+    free(lazy);
+    free(block_offset);
+    free(table_offset);
+    free(labels);
+    free(fixups);
+}
+
+/**
+ * @brief Write the program to config.output.
+ * The ELF header and the code buffer go out as they are, without joining them first.
+ * @return Bytes written
+ */
+int write_opcodes(){
+    char header[ELF_HEADER_SIZE];
+    int header_size = 0;
 
     int fd = cc_open(config.output,
 #ifndef NATIVE
         FS_FILE_FLAG_WRITE | FS_FILE_FLAG_CREATE
 #else
-        O_WRONLY | O_CREAT
+        O_WRONLY | O_CREAT | O_TRUNC
 #endif
     );
     
     if (fd < 0) { 
         printf("Failed to open output file: %d\n", fd);
-        return;
+        return 0;
     }
 
 #ifdef NATIVE
     if(config.elf){
-        write_elf_header(buffer, config.org, opcodes_count, 0);
-        pos += ELF_HEADER_SIZE;
+        write_elf_header(header, config.org, opcodes_count, 0);
+        header_size = ELF_HEADER_SIZE;
     }
 #endif
 
-    memcpy(buffer + pos, opcodes, opcodes_count);
-    pos += opcodes_count;
+    if (cc_write_parts(fd, header, header_size, (char*)opcodes, opcodes_count) < 0) {
+        printf("Failed to write output file: %s\n", config.output);
+        cc_close(fd);
+        exit(-1);
+    }
 
 #ifdef NATIVE
     chmod(config.output, 0755);
 #endif
 
-    cc_write(fd, buffer, pos);
     cc_close(fd);
-    free(buffer);
 
     printf("Successfully compiled to %s\n", config.output);
 
-    return;
+    return header_size + opcodes_count;
 }
 
 
 void write_x86(struct ast_node *node, char* data_section, int data_section_size) {
     void* file = NULL;
 
-    opcodes = malloc(32*1024);
-    if (!opcodes) {
-        printf("Failed to allocate memory for opcodes\n");
-        exit(-1);
-    }
-    memset(opcodes, 0, 32*1024);
-
     /* Prepare jump to _start */
-    opcodes[opcodes_count++] = 0xe9;
-    uint8_t *placeholder = opcodes + opcodes_count;
-    *((int*)(opcodes + opcodes_count)) = 0;
-    opcodes_count += 4;
+    x86_byte(0xe9);
+    int placeholder = opcodes_count;
+    x86_int(0);
 
     /* Write data section */
-    for(int i = 0; i < data_section_size; i++){
-        opcodes[opcodes_count++] = data_section[i];
-    }    
-    generate_x86(node, NULL);
+    opcodes_reserve(data_section_size);
+    memcpy(opcodes + opcodes_count, data_section, data_section_size);
+    opcodes_count += data_section_size;
+
+    while (node) {
+        if (node->type == AST_ENTER) {
+            struct ir_func *ir = ir_lower_function(&node);
+            passes_run_ir(ir);
+            emit_function(ir);
+            ir_free(ir);
+        } else if (node->type == AST_ASM) {
+            printf("ASM: %s\n", node->asm_code);
+            node = node->next;
+        } else {
+            printf("Unknown AST node type: %d\n", node->type);
+            exit(-1);
+        }
+    }
+    ir_inline_free();
 
     asmprintf(file, ".globl _start\n");
     asmprintf(file, "_start:\n");
@@ -1139,7 +1386,7 @@ void write_x86(struct ast_node *node, char* data_section, int data_section_size)
     int offset = (int)f->entry - opcodes_count;
     
     /* Placeholder for jump to _start */
-    *((int*)placeholder) = (opcodes_count-5);
+    *((int*)(opcodes + placeholder)) = (opcodes_count-5);
 
     /* Should call main, not first function */
     GEN_X86_CALL((offset-5));
@@ -1157,6 +1404,4 @@ void write_x86(struct ast_node *node, char* data_section, int data_section_size)
     GEN_X86_IMD_EAX(3);
     GEN_X86_INT(0x30);
 #endif
-
-    write_opcodes();
 }
@@ -0,0 +1,300 @@
+/**
+ * @file inline.c
+ * @brief Inlining of small leaf functions at their call sites.
+ *
+ * Functions are lowered in source order and callees are defined before
+ * their callers, so every function is inlined into before it is considered
+ * as a callee itself. A function that is left without calls and is small
+ * enough is kept as a copy of its unoptimized IR. At a call site its
+ * parameters and locals get fresh slots in the caller's frame, the pushed
+ * arguments become stores to the parameter slots and every return becomes
+ * a move to the call's result and a jump past the inlined body.
+ * ir_promote_locals() then keeps the copied parameters in registers.
+ */
+#include <ir.h>
+#include <cc.h>
+
+/* Instructions a call costs besides one push per argument: call, prologue, epilogue, cleanup */
+#define CALL_OVERHEAD 4
+#define MAX_ARGS 16
+
+struct inline_site {
+    int call;           /* Index of the IR_CALL */
+    struct ir_func *callee;
+    int param_base;     /* Caller frame offset of parameter 0 */
+    int local_base;     /* Added to the callee's local offsets */
+    int block;          /* New index of the callee's block 0 */
+};
+
+static struct ir_func **candidates;
+static int candidate_count;
+static int candidate_capacity;
+
+/* Function being rebuilt */
+static struct ir_func *out;
+
+static void put(struct ir_insn *insn) {
+    if (out->insn_count == out->insn_capacity) {
+        int capacity = out->insn_capacity ? out->insn_capacity * 2 : 64;
+        struct ir_insn *insns = zmalloc(capacity * sizeof(struct ir_insn));
+        if (!insns) {printf("Unable to malloc IR\n");exit(-1);}
+        if (out->insns) {
+            memcpy(insns, out->insns, out->insn_count * sizeof(struct ir_insn));
+            free(out->insns);
+        }
+        out->insns = insns;
+        out->insn_capacity = capacity;
+    }
+    out->insns[out->insn_count++] = *insn;
+    out->blocks[out->block_count - 1].count++;
+}
+
+static void start_block() {
+    out->blocks[out->block_count].start = out->insn_count;
+    out->blocks[out->block_count].count = 0;
+    out->block_count++;
+}
+
+static struct ir_func *find_candidate(int id) {
+    for (int i = 0; i < candidate_count; i++) {
+        if (candidates[i]->sym->val == id) return candidates[i];
+    }
+    return NULL;
+}
+
+static int ir_size(struct ir_func *fn) {
+    int size = 0;
+    for (int i = 0; i < fn->insn_count; i++) size += fn->insns[i].op != IR_NOP;
+    return size;
+}
+
+/* Number of 4 byte parameter slots the function uses */
+static int param_count(struct ir_func *fn) {
+    int count = fn->sym->args;
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->op == IR_LOCAL && insn->imm >= 8 && (insn->imm - 8) / 4 + 1 > count) count = (insn->imm - 8) / 4 + 1;
+    }
+    return count;
+}
+
+/**
+ * Find the IR_ARG instructions pushed for the call at index call, parameter 0
+ * first. Arguments of calls nested in the arguments are skipped, builtins
+ * consume a varying number of arguments and stop the search.
+ */
+static int find_args(struct ir_func *fn, int call, int *args) {
+    int found = 0, nested = 0;
+    for (int i = call - 1; i >= 0 && found < fn->insns[call].aux; i--) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->op == IR_BUILTIN) break;
+        if (insn->op == IR_CALL) nested += insn->aux;
+        if (insn->op != IR_ARG) continue;
+        if (nested) nested--; else args[found++] = i;
+    }
+    return found == fn->insns[call].aux;
+}
+
+/* Append the callee's blocks for one site, dst receives the return value */
+static void copy_body(struct inline_site *site, int dst) {
+    struct ir_func *callee = site->callee;
+    int vreg_base = out->vregs;
+    out->vregs += callee->vregs;
+
+    for (int b = 0; b < callee->block_count; b++) {
+        start_block();
+        for (int i = callee->blocks[b].start; i < callee->blocks[b].start + callee->blocks[b].count; i++) {
+            struct ir_insn insn = callee->insns[i];
+            if (insn.op == IR_NOP) continue;
+            if (insn.dst) insn.dst += vreg_base;
+            if (insn.a) insn.a += vreg_base;
+            if (insn.b) insn.b += vreg_base;
+
+            if (insn.op == IR_LOCAL) {
+                insn.imm += insn.imm >= 8 ? site->param_base - 8 : site->local_base;
+            } else if (insn.op == IR_JMP || insn.op == IR_JCC) {
+                insn.imm += site->block;
+            } else if (insn.op == IR_RET) {
+                struct ir_insn mov = { .op = IR_MOV, .dst = dst, .a = insn.a };
+                if (!insn.a) {
+                    /* Functions without a return value leave 0 */
+                    struct ir_insn zero = { .op = IR_IMM, .dst = ++out->vregs };
+                    put(&zero);
+                    mov.a = zero.dst;
+                }
+                put(&mov);
+                if (b + 1 < callee->block_count) {
+                    struct ir_insn jmp = { .op = IR_JMP, .imm = site->block + callee->block_count };
+                    put(&jmp);
+                }
+                /* The rest of the block is unreachable */
+                break;
+            }
+            put(&insn);
+        }
+    }
+}
+
+/**
+ * @brief Inline calls to recorded candidates into fn.
+ * The function is rebuilt in place and its blocks are renumbered.
+ */
+void ir_inline_calls(struct ir_func *fn) {
+    struct inline_site *sites = zmalloc((fn->insn_count + 1) * sizeof(struct inline_site));
+    int *arg_slot = zmalloc((fn->insn_count + 1) * sizeof(int));
+    int *block_map = zmalloc(fn->block_count * sizeof(int));
+    int args[MAX_ARGS], site_count = 0;
+    if (!sites || !arg_slot || !block_map) {printf("Unable to malloc inliner state\n");exit(-1);}
+
+    for (int b = 0; b < fn->block_count; b++) {
+        for (int i = fn->blocks[b].start; i < fn->blocks[b].start + fn->blocks[b].count; i++) {
+            struct ir_insn *insn = fn->insns + i;
+            if (insn->op != IR_CALL) continue;
+            struct ir_func *callee = find_candidate(insn->imm);
+            if (!callee || insn->aux > MAX_ARGS) continue;
+            /* Inline when the body is at most the limit larger than the call sequence it replaces */
+            if (ir_size(callee) - insn->aux - CALL_OVERHEAD > config.inline_limit) continue;
+            if (!find_args(fn, i, args)) continue;
+
+            /* Callee locals first, then its parameters in stack order, below the caller's frame */
+            struct inline_site *site = sites + site_count++;
+            site->call = i;
+            site->callee = callee;
+            site->local_base = -fn->frame_size;
+            fn->frame_size += callee->frame_size + 4 * param_count(callee);
+            site->param_base = -fn->frame_size;
+            for (int k = 0; k < insn->aux; k++) arg_slot[args[k]] = site->param_base + 4 * k;
+        }
+    }
+    if (site_count) {
+        ir_stats.inlined += site_count;
+
+        /* Every site splits its block and adds the callee's blocks in between */
+        int blocks = 0, s = 0;
+        for (int b = 0; b < fn->block_count; b++) {
+            block_map[b] = blocks++;
+            for (; s < site_count && sites[s].call < fn->blocks[b].start + fn->blocks[b].count; s++) {
+                sites[s].block = blocks;
+                blocks += sites[s].callee->block_count + 1;
+            }
+        }
+
+        out = zmalloc(sizeof(struct ir_func));
+        if (!out) {printf("Unable to malloc IR\n");exit(-1);}
+        out->vregs = fn->vregs;
+        out->blocks = zmalloc(blocks * sizeof(struct ir_block));
+        out->block_capacity = blocks;
+        if (!out->blocks) {printf("Unable to malloc IR\n");exit(-1);}
+
+        s = 0;
+        for (int b = 0; b < fn->block_count; b++) {
+            start_block();
+            for (int i = fn->blocks[b].start; i < fn->blocks[b].start + fn->blocks[b].count; i++) {
+                struct ir_insn insn = fn->insns[i];
+                if (s < site_count && sites[s].call == i) {
+                    copy_body(sites + s++, insn.dst);
+                    start_block();
+                    continue;
+                }
+                if (insn.op == IR_ARG && arg_slot[i]) {
+                    struct ir_insn local = { .op = IR_LOCAL, .dst = ++out->vregs, .imm = arg_slot[i], .aux = 1 };
+                    struct ir_insn store = { .op = IR_STORE, .size = 4, .a = local.dst, .b = insn.a };
+                    put(&local);
+                    put(&store);
+                    continue;
+                }
+                if (insn.op == IR_JMP || insn.op == IR_JCC) insn.imm = block_map[insn.imm];
+                put(&insn);
+            }
+        }
+
+        for (int t = 0; t < fn->table_count; t++) {
+            for (int e = 0; e < fn->tables[t].count; e++) fn->tables[t].blocks[e] = block_map[fn->tables[t].blocks[e]];
+        }
+
+        /* Loops of the inlined bodies never contain the caller's loops, they go first */
+        int loop_count = fn->loop_count;
+        for (s = 0; s < site_count; s++) loop_count += sites[s].callee->loop_count;
+        struct ir_loop *loops = zmalloc((loop_count + 1) * sizeof(struct ir_loop));
+        if (!loops) {printf("Unable to malloc IR\n");exit(-1);}
+        loop_count = 0;
+        for (s = 0; s < site_count; s++) {
+            for (int l = 0; l < sites[s].callee->loop_count; l++) {
+                struct ir_loop *loop = sites[s].callee->loops + l;
+                loops[loop_count].preheader = loop->preheader + sites[s].block;
+                loops[loop_count].header = loop->header + sites[s].block;
+                loops[loop_count].exit = loop->exit + sites[s].block;
+                loop_count++;
+            }
+        }
+        for (int l = 0; l < fn->loop_count; l++) {
+            loops[loop_count].preheader = block_map[fn->loops[l].preheader];
+            loops[loop_count].header = block_map[fn->loops[l].header];
+            loops[loop_count].exit = block_map[fn->loops[l].exit];
+            loop_count++;
+        }
+        free(fn->loops);
+        fn->loops = loops;
+        fn->loop_count = fn->loop_capacity = loop_count;
+
+        free(fn->insns);
+        free(fn->blocks);
+        fn->insns = out->insns;
+        fn->insn_count = out->insn_count;
+        fn->insn_capacity = out->insn_capacity;
+        fn->blocks = out->blocks;
+        fn->block_count = out->block_count;
+        fn->block_capacity = out->block_capacity;
+        fn->vregs = out->vregs;
+        free(out);
+        out = NULL;
+    }
+    free(sites);
+    free(arg_slot);
+    free(block_map);
+}
+
+/**
+ * @brief Keep a copy of fn if it is a leaf small enough to be inlined.
+ * Must be called before ir_promote_locals() rewrites fn.
+ */
+void ir_inline_record(struct ir_func *fn) {
+    for (int i = 0; i < fn->insn_count; i++) {
+        int op = fn->insns[i].op;
+        /* Jump tables are not copied */
+        if (op == IR_CALL || op == IR_ARG || op == IR_BUILTIN || op == IR_SWITCH) return;
+    }
+    if (ir_size(fn) - param_count(fn) - CALL_OVERHEAD > config.inline_limit) return;
+
+    struct ir_func *copy = zmalloc(sizeof(struct ir_func));
+    if (!copy) {printf("Unable to malloc IR\n");exit(-1);}
+    *copy = *fn;
+    copy->insns = zmalloc(fn->insn_count * sizeof(struct ir_insn));
+    copy->blocks = zmalloc(fn->block_count * sizeof(struct ir_block));
+    copy->loops = zmalloc((fn->loop_count + 1) * sizeof(struct ir_loop));
+    if (!copy->insns || !copy->blocks || !copy->loops) {printf("Unable to malloc IR\n");exit(-1);}
+    memcpy(copy->insns, fn->insns, fn->insn_count * sizeof(struct ir_insn));
+    memcpy(copy->blocks, fn->blocks, fn->block_count * sizeof(struct ir_block));
+    memcpy(copy->loops, fn->loops, fn->loop_count * sizeof(struct ir_loop));
+    copy->insn_capacity = fn->insn_count;
+    copy->block_capacity = fn->block_count;
+    copy->loop_capacity = fn->loop_count;
+
+    if (candidate_count == candidate_capacity) {
+        int capacity = candidate_capacity ? candidate_capacity * 2 : 16;
+        struct ir_func **grown = zmalloc(capacity * sizeof(struct ir_func *));
+        if (!grown) {printf("Unable to malloc IR\n");exit(-1);}
+        if (candidates) memcpy(grown, candidates, candidate_count * sizeof(struct ir_func *));
+        free(candidates);
+        candidates = grown;
+        candidate_capacity = capacity;
+    }
+    candidates[candidate_count++] = copy;
+}
+
+void ir_inline_free() {
+    for (int i = 0; i < candidate_count; i++) ir_free(candidates[i]);
+    free(candidates);
+    candidates = NULL;
+    candidate_count = candidate_capacity = 0;
+}
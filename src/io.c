@@ -1,4 +1,12 @@
 #include <cc.h>
+#include <io.h>
+
+#ifdef NATIVE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#endif
 
 int cc_open(char *file, int flags) {
 #ifdef NATIVE
@@ -24,9 +32,204 @@ void cc_write(int fd, char *buffer, int size) {
     write(fd, buffer, size);
 }
 
+/**
+ * @brief Write header followed by body without copying them into one buffer.
+ * Natively a single writev(), resumed where it stopped on short writes.
+ * @return 0 on success, -1 on failure
+ */
+int cc_write_parts(int fd, char *header, int header_size, char *body, int body_size) {
+#ifdef NATIVE
+    struct iovec parts[2] = { { header, header_size }, { body, body_size } };
+    struct iovec *part = parts;
+    int count = 2;
+
+    while (count) {
+        ssize_t n = writev(fd, part, count);
+        if (n <= 0) return -1;
+        while (count && (size_t)n >= part->iov_len) {
+            n -= part->iov_len;
+            part++;
+            count--;
+        }
+        if (count) {
+            part->iov_base = (char *)part->iov_base + n;
+            part->iov_len -= n;
+        }
+    }
+    return 0;
+#else
+    cc_write(fd, header, header_size);
+    cc_write(fd, body, body_size);
+    return 0;
+#endif
+}
+
+/**
+ * @brief Read a whole file into a growing buffer.
+ * Used on RetrOS and for files that cannot be mapped (pipes, ...).
+ * The buffer doubles until the file fits, so it stays within 2x the file length.
+ */
+static int cc_load_read(int fd, struct source_file *src) {
+    int size = 4096;
+    int len = 0;
+    int n;
+
+    char *buffer = zmalloc(size);
+    if (!buffer) return -1;
+
+    while ((n = cc_read(fd, buffer + len, size - len - 1)) > 0) {
+        len += n;
+        if (len < size - 1) continue;
+
+        char *grown = zmalloc(size * 2);
+        if (!grown) {
+            free(buffer);
+            return -1;
+        }
+        memcpy(grown, buffer, len);
+        free(buffer);
+        buffer = grown;
+        size *= 2;
+    }
+
+    buffer[len] = '\0';
+    src->buffer = buffer;
+    src->length = len;
+    src->mapped = 0;
+    return len;
+}
+
+#ifdef NATIVE
+/**
+ * @brief Map a file read-only, followed by at least one zero byte.
+ * An anonymous mapping one byte longer than the file is reserved first and the
+ * file is mapped over its start, so the lexer always finds a '\0' sentinel,
+ * even when the file length is a multiple of the page size.
+ */
+static int cc_load_map(int fd, struct source_file *src) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) return -1;
+
+    char *view = mmap(NULL, st.st_size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (view == MAP_FAILED) return -1;
+
+    if (mmap(view, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(view, st.st_size + 1);
+        return -1;
+    }
+
+    src->buffer = view;
+    src->length = st.st_size;
+    src->mapped = 1;
+    return src->length;
+}
+#endif
+
+/**
+ * @brief Load a source file as a '\0' terminated buffer.
+ * Native builds map the file, RetrOS reads it into a buffer sized to the file.
+ * @return length of the file, -1 on failure.
+ */
+int cc_load(char *file, struct source_file *src) {
+    int fd, len;
+
+    fd = cc_open(file,
+#ifndef NATIVE
+        FS_FILE_FLAG_READ
+#else
+        O_RDONLY
+#endif
+    );
+    if (fd < 0) return -1;
+
+#ifdef NATIVE
+    if ((len = cc_load_map(fd, src)) < 0)
+#endif
+    len = cc_load_read(fd, src);
+
+    cc_close(fd);
+    return len;
+}
+
+void cc_unload(struct source_file *src) {
+    if (!src->buffer) return;
+#ifdef NATIVE
+    if (src->mapped) {
+        munmap(src->buffer, src->length + 1);
+        src->buffer = NULL;
+        return;
+    }
+#endif
+    free(src->buffer);
+    src->buffer = NULL;
+}
+
+#define ARENA_CHUNK_SIZE (64*1024)
+
+/**
+ * @brief Allocate zeroed memory from an arena.
+ * Chunks are zeroed when created, so allocations need no memset.
+ * Requests larger than a chunk get a chunk of their own.
+ */
+void *arena_alloc(struct arena *arena, int size) {
+    struct arena_chunk *chunk = arena->chunks;
+    size = (size + 7) & ~7;
+
+    if (!chunk || chunk->used + size > chunk->size) {
+        int chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = zmalloc(sizeof(struct arena_chunk) + chunk_size);
+        if (!chunk) {printf("Unable to malloc arena chunk\n");exit(-1);}
+        chunk->size = chunk_size;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->allocations++;
+    arena->bytes += size;
+    return ptr;
+}
+
+/* Free every chunk of the arena, invalidating all allocations from it */
+void arena_release(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunks;
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->allocations = 0;
+    arena->bytes = 0;
+}
+
+/* Monotonic clock in microseconds, only used for --time-report */
+long cc_clock_us() {
+#ifdef NATIVE
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
+
+/* Peak resident set size of the compiler in KB, 0 where it is not known */
+long cc_peak_rss_kb() {
+#ifdef NATIVE
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) return 0;
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
 #ifdef NATIVE
-void *zmalloc(int size) {    
-    return malloc(size);
+void *zmalloc(int size) {
+    /* Callers rely on zeroed memory, as with the RetrOS zmalloc */
+    return calloc(1, size);
 }
 #endif
 
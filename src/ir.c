@@ -0,0 +1,838 @@
+/**
+ * @file ir.c
+ * @brief Lowering of the AST into the linear IR, one function at a time.
+ *
+ * Expressions are lowered right operand before left, the evaluation
+ * order of the original stack based code generator, unless both operands
+ * are free of side effects and the left one needs more registers.
+ */
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+
+#include <ir.h>
+#include <cc.h>
+#include <passes.h>
+
+#define ADJUST_SIZE(node) (node->value > 0 ? node->value*4 : node->value)
+
+static struct ir_func *fn;
+
+/* Offset of a global or string from the start of the data section */
+static int data_offset(int value) {
+    return data_relocate(value - (long)org_data);
+}
+
+/* Element type of an indexed identifier, only identifier nodes carry a symbol */
+static int ast_array_type(struct ast_node *node) {
+    return node->type == AST_IDENT ? node->sym->array_type : CHAR;
+}
+
+static int is_scalar(struct ast_node *node) {
+    return (node->sym_type <= INT || node->sym_type >= PTR) && node->sym_array == 0;
+}
+
+static struct ir_insn *emit(int op) {
+    if (fn->insn_count == fn->insn_capacity) {
+        int capacity = fn->insn_capacity ? fn->insn_capacity * 2 : 64;
+        struct ir_insn *insns = zmalloc(capacity * sizeof(struct ir_insn));
+        if (!insns) {printf("Unable to malloc IR\n");exit(-1);}
+        if (fn->insns) {
+            memcpy(insns, fn->insns, fn->insn_count * sizeof(struct ir_insn));
+            free(fn->insns);
+        }
+        fn->insns = insns;
+        fn->insn_capacity = capacity;
+    }
+    struct ir_insn *insn = fn->insns + fn->insn_count++;
+    memset(insn, 0, sizeof(struct ir_insn));
+    insn->op = op;
+    fn->blocks[fn->block_count - 1].count++;
+    return insn;
+}
+
+static int new_vreg() {
+    return ++fn->vregs;
+}
+
+/* Start a new basic block at the current position and return its index */
+static int new_block() {
+    if (fn->block_count == fn->block_capacity) {
+        int capacity = fn->block_capacity ? fn->block_capacity * 2 : 16;
+        struct ir_block *blocks = zmalloc(capacity * sizeof(struct ir_block));
+        if (!blocks) {printf("Unable to malloc IR\n");exit(-1);}
+        if (fn->blocks) {
+            memcpy(blocks, fn->blocks, fn->block_count * sizeof(struct ir_block));
+            free(fn->blocks);
+        }
+        fn->blocks = blocks;
+        fn->block_capacity = capacity;
+    }
+    fn->blocks[fn->block_count].start = fn->insn_count;
+    fn->blocks[fn->block_count].count = 0;
+    return fn->block_count++;
+}
+
+static int emit_value(int op, int imm) {
+    struct ir_insn *insn = emit(op);
+    insn->dst = new_vreg();
+    insn->imm = imm;
+    return insn->dst;
+}
+
+static int emit_load(int addr, int disp, int size) {
+    struct ir_insn *insn = emit(IR_LOAD);
+    insn->dst = new_vreg();
+    insn->a = addr;
+    insn->imm = disp;
+    insn->size = size;
+    return insn->dst;
+}
+
+/* Address of a local variable, aux marks scalars that ir_promote_locals() may keep in a vreg */
+static int emit_local(struct ast_node *node) {
+    int v = emit_value(IR_LOCAL, ADJUST_SIZE(node));
+    fn->insns[fn->insn_count - 1].aux = is_scalar(node);
+    return v;
+}
+
+static void emit_jump(int op, int value, int block) {
+    struct ir_insn *insn = emit(op);
+    insn->a = value;
+    insn->imm = block;
+}
+
+static int lower_expr(struct ast_node *node);
+static int lower_assign(struct ast_node *node, int want_value);
+
+/* Calls clobber the caller-saved registers, count them as needing all of them */
+#define CALL_NEED 5
+
+static int has_side_effects(struct ast_node *node) {
+    if (!node) return 0;
+    if (node->type == AST_ASSIGN || node->type == AST_FUNCALL) return 1;
+    return has_side_effects(node->left) || has_side_effects(node->right);
+}
+
+/**
+ * @brief Sethi-Ullman number of an expression, the registers needed to
+ * evaluate it without spilling. Constants fold into immediates and need none.
+ */
+static int su_need(struct ast_node *node) {
+    int l, r;
+    switch (node->type) {
+        case AST_NUM:
+        case AST_STR:
+            return 0;
+        case AST_BINOP:
+            l = su_need(node->left);
+            r = su_need(node->right);
+            if (l == 0) l = 1;
+            return l == r ? l + 1 : l > r ? l : r;
+        case AST_FUNCALL:
+            return CALL_NEED;
+        case AST_ASSIGN:
+            r = su_need(node->right);
+            return r > 1 ? r : 1;
+        case AST_UNOP:
+        case AST_DEREF:
+        case AST_MEMBER_ACCESS:
+        case AST_ADDR:
+            l = su_need(node->left);
+            return l > 1 ? l : 1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Lower the address of an assignment target.
+ * Members of struct variables are folded into the variable's address,
+ * members reached through a pointer are returned as a displacement.
+ */
+static int lower_lvalue(struct ast_node *node, int *disp) {
+    *disp = 0;
+    switch (node->type) {
+        case AST_IDENT:
+            if (node->sym_class == Loc) return emit_local(node);
+            if (node->sym_class == Glo) return emit_value(IR_GLOBAL, data_offset(node->value));
+            break;
+        case AST_MEMBER_ACCESS: {
+            struct ast_node *base = node->left;
+            if (base->sym_type >= PTR && base->sym_type < PTR2) {
+                *disp = node->member->offset;
+                return emit_load(emit_local(base), 0, 4);
+            }
+            if (base->sym_class == Loc) return emit_value(IR_LOCAL, ADJUST_SIZE(base) + node->member->offset);
+            if (base->sym_class == Glo) return emit_value(IR_GLOBAL, data_offset(base->value) + node->member->offset);
+            break;
+        }
+        case AST_DEREF:
+        case AST_ADDR:
+            return lower_expr(node->left);
+    }
+    printf("Unknown identifier class\n");
+    exit(-1);
+}
+
+static int lower_call(struct ast_node *node) {
+    struct ast_node *args[16];
+    int arg_count = 0;
+
+    /* Arguments are chained last to first, push them in source order */
+    for (struct ast_node *arg = node->left; arg; arg = arg->next) {
+        if (arg_count >= 16) {
+            printf("Too many arguments for function call\n");
+            exit(-1);
+        }
+        args[arg_count++] = arg;
+    }
+    for (int i = arg_count - 1; i >= 0; i--) {
+        int value = lower_expr(args[i]);
+        emit(IR_ARG)->a = value;
+    }
+
+    struct ir_insn *insn;
+    if (node->sym_class == Sys) {
+        insn = emit(IR_BUILTIN);
+        insn->imm = node->sym->val;
+        /* __interrupt(number, ...), the number is encoded in the instruction */
+        if (node->sym->val == INTERRUPT) insn->aux = args[arg_count - 1]->value;
+    } else if (node->sym_class == Fun) {
+        insn = emit(IR_CALL);
+        insn->imm = node->sym->val;
+        insn->aux = arg_count;
+    } else {
+        printf("Unknown x86 function call: %.*s, %d\n", node->sym->name_length, node->sym->name, node->sym_class);
+        exit(-1);
+    }
+    insn->dst = new_vreg();
+    return insn->dst;
+}
+
+static void lower_operands(struct ast_node *node, int *a, int *b) {
+    /* Evaluating the operand needing more registers first keeps fewer values live */
+    if (su_need(node->left) > su_need(node->right) && !has_side_effects(node)) {
+        *a = lower_expr(node->left);
+        *b = lower_expr(node->right);
+    } else {
+        *b = lower_expr(node->right);
+        *a = lower_expr(node->left);
+    }
+}
+
+static int is_compare(int op) {
+    return op == Eq || op == Ne || op == Lt || op == Gt || op == Le || op == Ge;
+}
+
+static int invert_compare(int op) {
+    switch (op) {
+        case Eq: return Ne;
+        case Ne: return Eq;
+        case Lt: return Ge;
+        case Ge: return Lt;
+        case Gt: return Le;
+    }
+    return Gt;
+}
+
+/**
+ * Jumps whose target block is not known yet are chained through their imm,
+ * as instruction index + 1, until patch() sets the target.
+ */
+static void patch(int list, int block) {
+    while (list) {
+        int next = fn->insns[list - 1].imm;
+        fn->insns[list - 1].imm = block;
+        list = next;
+    }
+}
+
+static int merge(int list, int other) {
+    if (!list) return other;
+    int last = list;
+    while (fn->insns[last - 1].imm) last = fn->insns[last - 1].imm;
+    fn->insns[last - 1].imm = other;
+    return list;
+}
+
+/* Conditional jump to a block that is not known yet, code after it starts a new block */
+static int emit_branch(int a, int b, int op) {
+    struct ir_insn *insn = emit(IR_JCC);
+    insn->a = a;
+    insn->b = b;
+    insn->aux = op;
+    int list = fn->insn_count;
+    new_block();
+    return list;
+}
+
+/* Unconditional jump to a block that is not known yet */
+static int emit_goto() {
+    emit_jump(IR_JMP, 0, 0);
+    int list = fn->insn_count;
+    new_block();
+    return list;
+}
+
+/**
+ * @brief Lower node in a branch context, jumping away when its truth equals jump_if.
+ * Comparisons become a single IR_JCC, && and || short-circuit into chains of jumps.
+ * Code after the jumps starts a new block, the unpatched jumps are returned.
+ */
+static int lower_cond(struct ast_node *node, int jump_if) {
+    int a, b, op = Ne;
+
+    if (node->type == AST_BINOP && (node->value == Lan || node->value == Lor)) {
+        /* The left operand alone decides a || b when true and a && b when false */
+        int decides = node->value == Lor;
+        if (jump_if == decides) {
+            int list = lower_cond(node->left, jump_if);
+            return merge(list, lower_cond(node->right, jump_if));
+        }
+        int skip = lower_cond(node->left, decides);
+        int list = lower_cond(node->right, jump_if);
+        patch(skip, fn->block_count - 1);
+        return list;
+    }
+    if (node->type == AST_UNOP && node->value == Ne) return lower_cond(node->left, !jump_if);
+    if (node->type == AST_NUM) {
+        if ((node->value != 0) != jump_if) return 0;
+        return emit_goto();
+    }
+
+    if (node->type == AST_BINOP && is_compare(node->value)) {
+        op = node->value;
+        lower_operands(node, &a, &b);
+    } else {
+        a = lower_expr(node);
+        b = emit_value(IR_IMM, 0);
+    }
+    return emit_branch(a, b, jump_if ? op : invert_compare(op));
+}
+
+/* a && b and a || b as a value, 1 or 0 assigned on the two paths of the branch */
+static int lower_logical(struct ast_node *node) {
+    int result = new_vreg();
+    int list = lower_cond(node, 0);
+    int value = emit_value(IR_IMM, 1);
+    struct ir_insn *insn = emit(IR_MOV);
+    insn->dst = result;
+    insn->a = value;
+    emit_jump(IR_JMP, 0, 0);
+    int end = fn->insn_count;
+    patch(list, new_block());
+    value = emit_value(IR_IMM, 0);
+    insn = emit(IR_MOV);
+    insn->dst = result;
+    insn->a = value;
+    patch(end, new_block());
+    return result;
+}
+
+static int lower_expr(struct ast_node *node) {
+    struct ir_insn *insn;
+    int a, b;
+
+    switch (node->type) {
+        case AST_NUM:
+            return emit_value(IR_IMM, node->value);
+        case AST_STR:
+            return emit_value(IR_GLOBAL, data_offset(node->value));
+        case AST_IDENT:
+            if (node->sym_class == Loc) {
+                a = emit_local(node);
+            } else if (node->sym_class == Glo) {
+                a = emit_value(IR_GLOBAL, data_offset(node->value));
+            } else {
+                printf("Unknown identifier class\n");
+                exit(-1);
+            }
+            /* Arrays and structs evaluate to their address */
+            return is_scalar(node) ? emit_load(a, 0, 4) : a;
+        case AST_BINOP:
+            if (node->value == Cond) {
+                printf("Unknown binary operator %d\n", node->value);
+                exit(-1);
+            }
+            if (node->value == Lan || node->value == Lor) return lower_logical(node);
+            lower_operands(node, &a, &b);
+            insn = emit(IR_BIN);
+            insn->dst = new_vreg();
+            insn->a = a;
+            insn->b = b;
+            insn->aux = node->value;
+            return insn->dst;
+        case AST_UNOP:
+            a = lower_expr(node->left);
+            insn = emit(IR_UN);
+            insn->dst = new_vreg();
+            insn->a = a;
+            insn->aux = node->value;
+            return insn->dst;
+        case AST_FUNCALL:
+            return lower_call(node);
+        case AST_ASSIGN:
+            return lower_assign(node, 1);
+        case AST_MEMBER_ACCESS:
+            return emit_load(lower_expr(node->left), node->member->offset, 4);
+        case AST_DEREF:
+            return emit_load(lower_expr(node->left), 0, node->data_type == CHAR ? 1 : 4);
+        case AST_ADDR:
+            if (node->left->type == AST_IDENT) {
+                struct ast_node *ident = node->left;
+                if (ident->sym_class == Fun) return emit_value(IR_FUNC, ident->sym->val);
+                if (ident->sym_class == Loc) return emit_value(IR_LOCAL, ADJUST_SIZE(ident));
+                if (ident->sym_class == Glo) return emit_value(IR_GLOBAL, data_offset(ident->value));
+                printf("Unknown identifier class\n");
+                exit(-1);
+            }
+            if (node->left->type == AST_MEMBER_ACCESS) {
+                int disp;
+                a = lower_lvalue(node->left, &disp);
+                if (disp) {
+                    b = emit_value(IR_IMM, disp);
+                    insn = emit(IR_BIN);
+                    insn->dst = new_vreg();
+                    insn->a = a;
+                    insn->b = b;
+                    insn->aux = Add;
+                    return insn->dst;
+                }
+                return a;
+            }
+            /* Array element, left is the address computation */
+            return emit_load(lower_expr(node->left), 0, ast_array_type(node->left->left) == CHAR ? 1 : 4);
+    }
+    printf("Unknown AST node type: %d\n", node->type);
+    exit(-1);
+}
+
+static int lower_assign(struct ast_node *node, int want_value) {
+    struct ast_node *left = node->left;
+    int addr, value, disp;
+
+    if (left->type != AST_IDENT && left->type != AST_MEMBER_ACCESS && left->type != AST_DEREF && left->type != AST_ADDR) {
+        printf("Assign: Left-hand side of assignment must be an identifier or member access 2\n");
+        exit(-1);
+    }
+
+    /* A call leaves its result in %eax, evaluate it before the target address */
+    if (node->right->type == AST_FUNCALL && (left->type == AST_IDENT || left->type == AST_MEMBER_ACCESS)) {
+        value = lower_expr(node->right);
+        addr = lower_lvalue(left, &disp);
+    } else {
+        addr = lower_lvalue(left, &disp);
+        value = lower_expr(node->right);
+    }
+
+    struct ir_insn *insn = emit(IR_STORE);
+    insn->a = addr;
+    insn->b = value;
+    insn->imm = disp;
+    insn->size = 4;
+    return want_value ? value : 0;
+}
+
+/* A switch is dispatched through a jump table when at least this many cases fill this share of their range */
+#define MIN_TABLE_CASES 4
+#define MIN_TABLE_DENSITY 40
+
+struct switch_case {
+    int value;
+    int block;      /* Block of the case label */
+    int jumps;      /* Pending jumps to the label */
+};
+
+struct switch_state {
+    struct switch_case *cases;  /* Sorted by value */
+    int count;
+    int capacity;
+    int otherwise;  /* Block of the default label, -1 if there is none */
+    int jumps;      /* Pending jumps to the default label, or past the switch without one */
+};
+
+/* Run of sorted cases tested together, a jump table if it has more than one */
+struct cluster {
+    int first;
+    int last;
+};
+
+static struct switch_state *current_switch;
+static int *break_list;     /* Pending jumps of the innermost loop or switch */
+
+static void lower_stmt(struct ast_node *node);
+
+/* Case labels are constant expressions, folded here whether or not the fold pass ran */
+static int case_value(struct ast_node *node) {
+    int value;
+    if (!constant_value(node->left, &value)) {
+        printf("Case value must be a constant\n");
+        exit(-1);
+    }
+    return value;
+}
+
+static void add_case(struct switch_state *sw, struct ast_node *node) {
+    int value = case_value(node);
+    if (sw->count == sw->capacity) {
+        int capacity = sw->capacity ? sw->capacity * 2 : 16;
+        struct switch_case *cases = zmalloc(capacity * sizeof(struct switch_case));
+        if (!cases) {printf("Unable to malloc switch cases\n");exit(-1);}
+        if (sw->cases) {
+            memcpy(cases, sw->cases, sw->count * sizeof(struct switch_case));
+            free(sw->cases);
+        }
+        sw->cases = cases;
+        sw->capacity = capacity;
+    }
+    sw->cases[sw->count].value = value;
+    sw->cases[sw->count].block = -1;
+    sw->count++;
+}
+
+/* Case labels of the switch body, those of nested switches excluded */
+static void collect_cases(struct switch_state *sw, struct ast_node *node) {
+    for (; node; node = node->next) {
+        switch (node->type) {
+            case AST_CASE:
+                add_case(sw, node);
+                collect_cases(sw, node->right);
+                break;
+            case AST_DEFAULT:
+            case AST_BLOCK:
+                collect_cases(sw, node->left);
+                break;
+            case AST_IF:
+                collect_cases(sw, node->right->left);
+                collect_cases(sw, node->right->right);
+                break;
+            case AST_WHILE:
+                collect_cases(sw, node->right);
+                break;
+        }
+    }
+}
+
+static int by_value(const void *a, const void *b) {
+    int x = ((const struct switch_case *)a)->value, y = ((const struct switch_case *)b)->value;
+    return (x > y) - (x < y);
+}
+
+static struct switch_case *find_case(struct switch_state *sw, int value) {
+    int lo = 0, hi = sw->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sw->cases[mid].value < value) lo = mid + 1; else hi = mid;
+    }
+    return sw->cases + lo;
+}
+
+/* Group the sorted cases greedily into the longest runs dense enough for a table, or one case each without tables */
+static int find_clusters(struct switch_state *sw, struct cluster *clusters) {
+    int count = 0;
+    for (int i = 0; i < sw->count;) {
+        int last = i;
+        for (int k = i + MIN_TABLE_CASES - 1; k < sw->count && pass_enabled(PASS_JUMP_TABLES); k++) {
+            long long range = (long long)sw->cases[k].value - sw->cases[i].value + 1;
+            if ((k - i + 1) * 100LL >= range * MIN_TABLE_DENSITY) last = k;
+        }
+        clusters[count].first = i;
+        clusters[count].last = last;
+        count++;
+        i = last + 1;
+    }
+    return count;
+}
+
+/* Jump to the matching case of the cluster, fall through otherwise */
+static void lower_cluster(struct switch_state *sw, int value, struct cluster *c) {
+    struct switch_case *first = sw->cases + c->first;
+    if (c->first == c->last) {
+        int imm = emit_value(IR_IMM, first->value);
+        first->jumps = merge(first->jumps, emit_branch(value, imm, Eq));
+        return;
+    }
+
+    if (fn->table_count == fn->table_capacity) {
+        int capacity = fn->table_capacity ? fn->table_capacity * 2 : 4;
+        struct ir_table *tables = zmalloc(capacity * sizeof(struct ir_table));
+        if (!tables) {printf("Unable to malloc IR\n");exit(-1);}
+        if (fn->tables) {
+            memcpy(tables, fn->tables, fn->table_count * sizeof(struct ir_table));
+            free(fn->tables);
+        }
+        fn->tables = tables;
+        fn->table_capacity = capacity;
+    }
+    /* Entries hold case indices, -1 for gaps, until the case blocks are known */
+    struct ir_table *table = fn->tables + fn->table_count;
+    table->low = first->value;
+    table->count = sw->cases[c->last].value - first->value + 1;
+    table->blocks = zmalloc(table->count * sizeof(int));
+    if (!table->blocks) {printf("Unable to malloc IR\n");exit(-1);}
+    for (int e = 0; e < table->count; e++) table->blocks[e] = -1;
+    for (int k = c->first; k <= c->last; k++) table->blocks[sw->cases[k].value - table->low] = k;
+
+    struct ir_insn *insn = emit(IR_SWITCH);
+    insn->a = value;
+    insn->imm = fn->table_count++;
+    new_block();
+    ir_stats.tables++;
+}
+
+/**
+ * Test the clusters lo to hi with a balanced tree of comparisons, a few
+ * clusters are tested in a row. Values matching no case jump to the default.
+ */
+static void lower_dispatch(struct switch_state *sw, int value, struct cluster *clusters, int lo, int hi) {
+    if (hi - lo < 3) {
+        for (int k = lo; k <= hi; k++) lower_cluster(sw, value, clusters + k);
+        sw->jumps = merge(sw->jumps, emit_goto());
+        return;
+    }
+    int mid = (lo + hi + 1) / 2;
+    int imm = emit_value(IR_IMM, sw->cases[clusters[mid].first].value);
+    int upper = emit_branch(value, imm, Ge);
+    lower_dispatch(sw, value, clusters, lo, mid - 1);
+    patch(upper, fn->block_count - 1);
+    lower_dispatch(sw, value, clusters, mid, hi);
+}
+
+static void lower_switch(struct ast_node *node) {
+    struct switch_state sw = { 0 }, *outer_switch = current_switch;
+    int *outer_breaks = break_list, breaks = 0, first_table = fn->table_count;
+
+    sw.otherwise = -1;
+    collect_cases(&sw, node->right);
+    if (sw.count) qsort(sw.cases, sw.count, sizeof(struct switch_case), by_value);
+    for (int k = 1; k < sw.count; k++) {
+        if (sw.cases[k].value != sw.cases[k - 1].value) continue;
+        printf("Duplicate case value %d\n", sw.cases[k].value);
+        exit(-1);
+    }
+
+    struct cluster *clusters = zmalloc((sw.count + 1) * sizeof(struct cluster));
+    if (!clusters) {printf("Unable to malloc switch cases\n");exit(-1);}
+    int value = lower_expr(node->left);
+    lower_dispatch(&sw, value, clusters, 0, find_clusters(&sw, clusters) - 1);
+    free(clusters);
+    /* Switches in the body add tables of their own after these */
+    int end_table = fn->table_count;
+
+    current_switch = &sw;
+    break_list = &breaks;
+    lower_stmt(node->right);
+    int end = new_block();
+    current_switch = outer_switch;
+    break_list = outer_breaks;
+
+    if (sw.otherwise < 0) sw.otherwise = end;
+    patch(sw.jumps, sw.otherwise);
+    patch(breaks, end);
+    for (int t = first_table; t < end_table; t++) {
+        struct ir_table *table = fn->tables + t;
+        for (int e = 0; e < table->count; e++) {
+            table->blocks[e] = table->blocks[e] < 0 ? sw.otherwise : sw.cases[table->blocks[e]].block;
+        }
+    }
+    free(sw.cases);
+}
+
+/* Loops are added when their body is done, so inner loops come first */
+static void add_loop(int preheader, int header, int end) {
+    if (fn->loop_count == fn->loop_capacity) {
+        int capacity = fn->loop_capacity ? fn->loop_capacity * 2 : 4;
+        struct ir_loop *loops = zmalloc(capacity * sizeof(struct ir_loop));
+        if (!loops) {printf("Unable to malloc IR\n");exit(-1);}
+        if (fn->loops) {
+            memcpy(loops, fn->loops, fn->loop_count * sizeof(struct ir_loop));
+            free(fn->loops);
+        }
+        fn->loops = loops;
+        fn->loop_capacity = capacity;
+    }
+    fn->loops[fn->loop_count].preheader = preheader;
+    fn->loops[fn->loop_count].header = header;
+    fn->loops[fn->loop_count].exit = end;
+    fn->loop_count++;
+}
+
+static void lower_stmt(struct ast_node *node) {
+    int cond, lfalse, lend, lstart, lpre, breaks, *outer_breaks;
+    struct switch_case *sc;
+
+    for (; node && node->type != AST_ENTER; node = node->next) {
+        switch (node->type) {
+            case AST_EXPR_STMT:
+                if (!node->left) break;
+                if (node->left->type == AST_ASSIGN) lower_assign(node->left, 0);
+                else lower_expr(node->left);
+                break;
+            case AST_RETURN:
+            case AST_LEAVE:
+                cond = node->type == AST_RETURN && node->left ? lower_expr(node->left) : 0;
+                emit(IR_RET)->a = cond;
+                break;
+            case AST_IF:
+                lfalse = lower_cond(node->left, 0);
+                lower_stmt(node->right->left);
+                if (node->right->right) {
+                    emit_jump(IR_JMP, 0, 0);
+                    lend = fn->insn_count - 1;
+                    patch(lfalse, new_block());
+                    lower_stmt(node->right->right);
+                    fn->insns[lend].imm = new_block();
+                } else {
+                    patch(lfalse, new_block());
+                }
+                break;
+            case AST_WHILE:
+                /* Tested once before the loop and again at the bottom of the body, one jump per iteration */
+                outer_breaks = break_list;
+                breaks = 0;
+                break_list = &breaks;
+                lend = lower_cond(node->left, 0);
+                lpre = new_block();
+                lstart = new_block();
+                lower_stmt(node->right);
+                patch(lower_cond(node->left, 1), lstart);
+                lend = merge(lend, breaks);
+                patch(lend, new_block());
+                add_loop(lpre, lstart, fn->block_count - 1);
+                break_list = outer_breaks;
+                break;
+            case AST_SWITCH:
+                lower_switch(node);
+                break;
+            case AST_CASE:
+                if (!current_switch) {
+                    printf("Case label outside of a switch\n");
+                    exit(-1);
+                }
+                sc = find_case(current_switch, case_value(node));
+                sc->block = new_block();
+                patch(sc->jumps, sc->block);
+                lower_stmt(node->right);
+                break;
+            case AST_DEFAULT:
+                if (!current_switch || current_switch->otherwise >= 0) {
+                    printf("Default label outside of a switch or repeated\n");
+                    exit(-1);
+                }
+                current_switch->otherwise = new_block();
+                lower_stmt(node->left);
+                break;
+            case AST_BREAK:
+                if (!break_list) {
+                    printf("Break outside of a loop or switch\n");
+                    exit(-1);
+                }
+                *break_list = merge(*break_list, emit_goto());
+                break;
+            case AST_BLOCK:
+                lower_stmt(node->left);
+                break;
+            case AST_ASM:
+                printf("ASM: %s\n", node->asm_code);
+                break;
+            default:
+                printf("Unknown AST node type: %d\n", node->type);
+                exit(-1);
+        }
+    }
+}
+
+/**
+ * @brief Lower the function starting at the AST_ENTER node *node.
+ * Advances *node to the node following the function.
+ */
+struct ir_func *ir_lower_function(struct ast_node **node) {
+    struct ast_node *enter = *node;
+
+    fn = zmalloc(sizeof(struct ir_func));
+    if (!fn) {printf("Unable to malloc IR\n");exit(-1);}
+    fn->sym = enter->sym;
+    fn->frame_size = enter->value;
+    new_block();
+
+    lower_stmt(enter->next);
+
+    struct ast_node *end = enter->next;
+    while (end && end->type != AST_ENTER) end = end->next;
+    *node = end;
+
+    return fn;
+}
+
+void ir_free(struct ir_func *fn) {
+    for (int t = 0; t < fn->table_count; t++) free(fn->tables[t].blocks);
+    free(fn->tables);
+    free(fn->loops);
+    free(fn->reg);
+    free(fn->slot);
+    free(fn->insns);
+    free(fn->blocks);
+    free(fn);
+}
+
+static const char *ir_operator(int op) {
+    switch (op) {
+        case Add: return "add"; case Sub: return "sub"; case Mul: return "mul";
+        case Div: return "div"; case Mod: return "mod"; case And: return "and";
+        case Or: return "or"; case Xor: return "xor"; case Shl: return "shl";
+        case Shr: return "shr"; case Eq: return "eq"; case Ne: return "ne";
+        case Lt: return "lt"; case Gt: return "gt"; case Le: return "le";
+        case Ge: return "ge"; case Lan: return "land"; case Lor: return "lor";
+        case Inc: return "inc"; case Dec: return "dec";
+    }
+    return "?";
+}
+
+static void ir_print_address(struct ir_insn *insn) {
+    printf("[t%d", insn->a);
+    if (insn->index) printf("+t%d*%d", insn->index, insn->scale);
+    printf("%+d]", insn->imm);
+}
+
+void ir_print(struct ir_func *fn) {
+    printf("function %.*s (frame %d, %d vregs)\n", fn->sym->name_length, fn->sym->name, fn->frame_size, fn->vregs);
+    for (int b = 0; b < fn->block_count; b++) {
+        printf("L%d:\n", b);
+        for (int i = fn->blocks[b].start; i < fn->blocks[b].start + fn->blocks[b].count; i++) {
+            struct ir_insn *insn = fn->insns + i;
+            if (insn->op == IR_NOP) continue;
+            printf("    ");
+            if (insn->dst) printf("t%d = ", insn->dst);
+            switch (insn->op) {
+                case IR_IMM: printf("imm %d\n", insn->imm); break;
+                case IR_LOCAL: printf("local %d\n", insn->imm); break;
+                case IR_GLOBAL: printf("global %d\n", insn->imm); break;
+                case IR_FUNC: printf("func %d\n", insn->imm); break;
+                case IR_LOAD: printf("load.%d ", insn->size); ir_print_address(insn); printf("\n"); break;
+                case IR_STORE: printf("store.%d ", insn->size); ir_print_address(insn); printf(", t%d\n", insn->b); break;
+                case IR_LEA: printf("lea "); ir_print_address(insn); printf("\n"); break;
+                case IR_BIN: printf("%s t%d, t%d\n", ir_operator(insn->aux), insn->a, insn->b); break;
+                case IR_UN: printf("%s t%d\n", insn->aux == Ne ? "not" : insn->aux == Sub ? "neg" : "com", insn->a); break;
+                case IR_ARG: printf("arg t%d\n", insn->a); break;
+                case IR_CALL: printf("call %d, %d args\n", insn->imm, insn->aux); break;
+                case IR_BUILTIN: printf("builtin %d\n", insn->imm); break;
+                case IR_JMP: printf("jmp L%d\n", insn->imm); break;
+                case IR_JCC: printf("j%s t%d, t%d, L%d\n", ir_operator(insn->aux), insn->a, insn->b, insn->imm); break;
+                case IR_SWITCH:
+                    printf("switch t%d, %d:", insn->a, fn->tables[insn->imm].low);
+                    for (int e = 0; e < fn->tables[insn->imm].count; e++) printf(" L%d", fn->tables[insn->imm].blocks[e]);
+                    printf("\n");
+                    break;
+                case IR_RET: insn->a ? printf("ret t%d\n", insn->a) : printf("ret\n"); break;
+                case IR_MOV: printf("mov t%d\n", insn->a); break;
+            }
+        }
+    }
+    if (!fn->reg) return;
+
+    static const char *names[] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" };
+    printf("registers:");
+    for (int v = 1; v <= fn->vregs; v++) {
+        if (fn->reg[v] >= 0) printf(" t%d=%s", v, names[(int)fn->reg[v]]);
+        else if (fn->reg[v] == REG_SPILLED) printf(" t%d=%d(ebp)", v, fn->slot[v]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,277 @@
+/**
+ * @file licm.c
+ * @brief Loop invariant code motion.
+ *
+ * Runs on the loops recorded by ir_lower_function(), innermost first, after
+ * ir_promote_locals() has turned scalar variables into vregs. Arithmetic and
+ * loads whose operands are constants, values not assigned in the loop or
+ * results of other invariant instructions are moved to the end of the loop's
+ * preheader, where they run once each time the loop is entered.
+ *
+ * A load is only invariant if no store in the loop may write its memory.
+ * Addresses are traced back to a local or global base through additions,
+ * anything else is a pointer that may reach any global, and the locals too
+ * if the address of one of them escapes. Calls and builtins may write
+ * anything a pointer reaches. Since the preheader runs before the body,
+ * a load through a pointer or a division that may trap is only moved when
+ * it runs before the first branch of the body anyway.
+ */
+#include <ir.h>
+#include <cc.h>
+
+/* Hoisted values stay live across the loop, limit the registers they take */
+#define MAX_HOISTED 4
+
+/* What an address points into */
+enum { MEM_UNKNOWN, MEM_LOCAL, MEM_GLOBAL };
+
+struct access {
+    int kind;
+    int exact;      /* Address is the base itself plus the displacement, lo and hi are valid */
+    int lo;
+    int hi;
+};
+
+/* Function being optimized and its per vreg facts */
+static struct ir_func *fn;
+static int *defs;
+static int *def_at;
+static int *loop_defs;
+static unsigned char *kind;
+static unsigned char *exact;
+static unsigned char *hoisted;
+static int frame_escapes;
+
+static void *alloc_or_die(int size) {
+    void *ptr = zmalloc(size);
+    if (!ptr) {
+        printf("Unable to malloc loop optimizer state\n");
+        exit(-1);
+    }
+    return ptr;
+}
+
+static int is_constant(int op) {
+    return op == IR_IMM || op == IR_LOCAL || op == IR_GLOBAL || op == IR_FUNC;
+}
+
+/* A use of a local address that neither dereferences it nor offsets it lets it escape */
+static void check_escape(struct ir_insn *insn, int v, int is_address) {
+    if (!v || kind[v] != MEM_LOCAL) return;
+    if ((insn->op == IR_LOAD || insn->op == IR_STORE) && is_address) return;
+    if (insn->op == IR_BIN && (insn->aux == Add || insn->aux == Sub)) return;
+    frame_escapes = 1;
+}
+
+static void analyze() {
+    int size = fn->vregs + 1;
+    defs = alloc_or_die(size * sizeof(int));
+    def_at = alloc_or_die(size * sizeof(int));
+    loop_defs = alloc_or_die(size * sizeof(int));
+    kind = alloc_or_die(size);
+    exact = alloc_or_die(size);
+    hoisted = alloc_or_die(size);
+    frame_escapes = 0;
+
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (!insn->dst) continue;
+        defs[insn->dst]++;
+        def_at[insn->dst] = i;
+    }
+    /* Temporaries are defined before their uses, one pass follows the additions */
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        int v = insn->dst;
+        check_escape(insn, insn->a, 1);
+        check_escape(insn, insn->b, 0);
+        if (!v || defs[v] != 1) continue;
+        if (insn->op == IR_LOCAL || insn->op == IR_GLOBAL) {
+            kind[v] = insn->op == IR_LOCAL ? MEM_LOCAL : MEM_GLOBAL;
+            exact[v] = 1;
+        } else if (insn->op == IR_BIN && insn->aux == Add && (!kind[insn->a] || !kind[insn->b])) {
+            kind[v] = kind[insn->a] ? kind[insn->a] : kind[insn->b];
+        } else if (insn->op == IR_BIN && insn->aux == Sub && !kind[insn->b]) {
+            kind[v] = kind[insn->a];
+        }
+    }
+}
+
+static void release() {
+    free(defs);
+    free(def_at);
+    free(loop_defs);
+    free(kind);
+    free(exact);
+    free(hoisted);
+}
+
+/* Memory a load or store touches, calls and builtins may touch anything a pointer reaches */
+static struct access access_of(struct ir_insn *insn) {
+    struct access acc = { MEM_UNKNOWN, 0, 0, 0 };
+    if (insn->op != IR_LOAD && insn->op != IR_STORE) return acc;
+    acc.kind = kind[insn->a];
+    acc.exact = exact[insn->a];
+    if (acc.exact) {
+        acc.lo = fn->insns[def_at[insn->a]].imm + insn->imm;
+        acc.hi = acc.lo + insn->size;
+    }
+    return acc;
+}
+
+static int may_alias(struct access *x, struct access *y) {
+    if (x->kind != y->kind) {
+        /* Locals and globals never overlap, a pointer reaches globals and escaped locals */
+        if (x->kind != MEM_UNKNOWN && y->kind != MEM_UNKNOWN) return 0;
+        return x->kind == MEM_GLOBAL || y->kind == MEM_GLOBAL || frame_escapes;
+    }
+    if (x->kind == MEM_UNKNOWN || !x->exact || !y->exact) return 1;
+    return x->lo < y->hi && y->lo < x->hi;
+}
+
+static int writes_memory(struct ir_insn *insn) {
+    return insn->op == IR_STORE || insn->op == IR_CALL || insn->op == IR_BUILTIN;
+}
+
+/* Value v does not change while the loop runs */
+static int invariant(int v) {
+    if (!v || !loop_defs[v] || hoisted[v]) return 1;
+    return defs[v] == 1 && is_constant(fn->insns[def_at[v]].op);
+}
+
+/* The instruction cannot trap wherever it is placed */
+static int safe_anywhere(struct ir_insn *insn) {
+    if (insn->op == IR_LOAD) return exact[insn->a];
+    if (insn->op == IR_BIN && (insn->aux == Div || insn->aux == Mod)) {
+        struct ir_insn *divisor = fn->insns + def_at[insn->b];
+        return defs[insn->b] == 1 && divisor->op == IR_IMM && divisor->imm != 0 && divisor->imm != -1;
+    }
+    return 1;
+}
+
+static int is_candidate(struct ir_insn *insn, int start, int end, int first_branch) {
+    int i = insn - fn->insns;
+    if (insn->op != IR_BIN && insn->op != IR_UN && insn->op != IR_LOAD) return 0;
+    if (defs[insn->dst] != 1 || !invariant(insn->a) || !invariant(insn->b)) return 0;
+    if (i >= first_branch && !safe_anywhere(insn)) return 0;
+    if (insn->op == IR_LOAD) {
+        struct access load = access_of(insn);
+        for (int k = start; k < end; k++) {
+            if (!writes_memory(fn->insns + k)) continue;
+            struct access store = access_of(fn->insns + k);
+            if (may_alias(&load, &store)) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Operands are the same value, constants defined in the loop compare by value */
+static int same_operand(int x, int y) {
+    if (x == y) return 1;
+    if (!x || !y || !loop_defs[x] || !loop_defs[y] || defs[x] != 1 || defs[y] != 1) return 0;
+    struct ir_insn *dx = fn->insns + def_at[x], *dy = fn->insns + def_at[y];
+    return is_constant(dx->op) && dx->op == dy->op && dx->imm == dy->imm;
+}
+
+static int same_value(struct ir_insn *x, struct ir_insn *y) {
+    return x->op == y->op && x->aux == y->aux && x->imm == y->imm && x->size == y->size &&
+        same_operand(x->a, y->a) && same_operand(x->b, y->b);
+}
+
+static void replace_uses(int v, int by) {
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->a == v) insn->a = by;
+        if (insn->b == v) insn->b = by;
+    }
+}
+
+/* Constant operands defined in the loop are copied to the preheader, the originals may have other users */
+static void put_operand(struct ir_insn *insns, int *count, int *v) {
+    if (!*v || !loop_defs[*v] || hoisted[*v]) return;
+    struct ir_insn copy = fn->insns[def_at[*v]];
+    copy.dst = ++fn->vregs;
+    insns[(*count)++] = copy;
+    *v = copy.dst;
+}
+
+static void hoist_loop(struct ir_loop *loop) {
+    int start = fn->blocks[loop->header].start, end = fn->blocks[loop->exit].start;
+    int first_branch = end, count = 0, removed = 0;
+    int *moved = alloc_or_die((end - start + 1) * sizeof(int));
+
+    for (int i = start; i < end; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->dst) loop_defs[insn->dst]++;
+        if (first_branch == end && (insn->op == IR_JMP || insn->op == IR_JCC || insn->op == IR_SWITCH ||
+            insn->op == IR_RET || insn->op == IR_CALL || insn->op == IR_BUILTIN)) first_branch = i;
+    }
+
+    for (int i = start; i < end && count < MAX_HOISTED; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (!is_candidate(insn, start, end, first_branch)) continue;
+
+        int k = 0;
+        while (k < count && !same_value(fn->insns + moved[k], insn)) k++;
+        if (k < count) {
+            /* Computed by an instruction hoisted before */
+            replace_uses(insn->dst, fn->insns[moved[k]].dst);
+            memset(insn, 0, sizeof(struct ir_insn));
+            insn->op = IR_NOP;
+            removed++;
+            continue;
+        }
+        hoisted[insn->dst] = 1;
+        moved[count++] = i;
+    }
+
+    if (count) {
+        /* Hoisted instructions and copies of their constant operands go to the end of the preheader */
+        struct ir_insn *insns = alloc_or_die((fn->insn_count + 2 * count) * sizeof(struct ir_insn));
+        int n = start, added = 0;
+        memcpy(insns, fn->insns, start * sizeof(struct ir_insn));
+        for (int k = 0; k < count; k++) {
+            struct ir_insn insn = fn->insns[moved[k]];
+            put_operand(insns, &n, &insn.a);
+            put_operand(insns, &n, &insn.b);
+            insns[n++] = insn;
+        }
+        added = n - start;
+        for (int i = start, k = 0; i < fn->insn_count; i++) {
+            if (k < count && moved[k] == i) { k++; continue; }
+            insns[n++] = fn->insns[i];
+        }
+
+        /* Blocks after the preheader lose the instructions moved out of them */
+        int k = 0, before = 0;
+        fn->blocks[loop->preheader].count += added;
+        for (int b = loop->header; b < fn->block_count; b++) {
+            int block_end = fn->blocks[b].start + fn->blocks[b].count, in_block = 0;
+            for (; k < count && moved[k] < block_end; k++) in_block++;
+            fn->blocks[b].start += added - before;
+            fn->blocks[b].count -= in_block;
+            before += in_block;
+        }
+
+        free(fn->insns);
+        fn->insns = insns;
+        fn->insn_count = fn->insn_capacity = n;
+    }
+    ir_stats.hoisted += count + removed;
+    free(moved);
+}
+
+/**
+ * @brief Move loop invariant instructions of fn to the preheaders of its loops.
+ * Must run after ir_promote_locals(), before instruction selection.
+ */
+void ir_hoist_invariants(struct ir_func *target) {
+    fn = target;
+    for (int l = 0; l < fn->loop_count; l++) {
+        /* Moving instructions changes the positions, start over on the new layout */
+        analyze();
+        hoist_loop(fn->loops + l);
+        release();
+    }
+    fn = NULL;
+}
@@ -0,0 +1,352 @@
+/**
+ * @file optimize.c
+ * @brief Optimization passes over the AST, run between parse() and write_x86()
+ */
+#include <ast.h>
+#include <cc.h>
+#include <func.h>
+
+static int folded = 0;
+
+static int is_const(struct ast_node *node) {
+    return node && node->type == AST_NUM && !node->left && !node->right;
+}
+
+static int is_value(struct ast_node *node, int value) {
+    return is_const(node) && node->value == value;
+}
+
+/* Assignments and calls must still be evaluated even if their value is not needed */
+static int has_side_effects(struct ast_node *node) {
+    if (!node) return 0;
+    if (node->type == AST_ASSIGN || node->type == AST_FUNCALL) return 1;
+    return has_side_effects(node->left) || has_side_effects(node->right);
+}
+
+/* Turn node into a constant in place, so parents and ->next chains stay valid */
+static void make_const(struct ast_node *node, int value) {
+    node->type = AST_NUM;
+    node->value = value;
+    node->left = NULL;
+    node->right = NULL;
+    folded++;
+}
+
+/* Replace node by one of its operands, keeping its position in ->next chains */
+static void replace(struct ast_node *node, struct ast_node *with) {
+    struct ast_node *next = node->next;
+    *node = *with;
+    node->next = next;
+    folded++;
+}
+
+/* Evaluate a binary operator with the semantics of the generated code. Returns 0 if it cannot be folded. */
+static int eval_binop(int op, int a, int b, int *result) {
+    unsigned int ua = a, ub = b;
+    switch (op) {
+        case Add: *result = (int)(ua + ub); return 1;
+        case Sub: *result = (int)(ua - ub); return 1;
+        case Mul: *result = (int)(ua * ub); return 1;
+        case Div:
+            if (b == 0 || (a == (int)0x80000000 && b == -1)) return 0;
+            *result = a / b; return 1;
+        case Mod:
+            if (b == 0 || (a == (int)0x80000000 && b == -1)) return 0;
+            *result = a % b; return 1;
+        case Shl: *result = (int)(ua << (b & 31)); return 1;
+        case Shr: *result = a >> (b & 31); return 1;
+        case And: *result = a & b; return 1;
+        case Or:  *result = a | b; return 1;
+        case Xor: *result = a ^ b; return 1;
+        case Eq:  *result = a == b; return 1;
+        case Ne:  *result = a != b; return 1;
+        case Lt:  *result = a < b; return 1;
+        case Gt:  *result = a > b; return 1;
+        case Le:  *result = a <= b; return 1;
+        case Ge:  *result = a >= b; return 1;
+        case Lan: *result = a && b; return 1;
+        case Lor: *result = a || b; return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Value of an expression made of constants only, computed whether or
+ * not the fold pass runs. Used where the language requires a constant.
+ * @return 1 and the value in *result, 0 if node is not constant
+ */
+int constant_value(struct ast_node *node, int *result) {
+    int l, r;
+    switch (node->type) {
+        case AST_NUM:
+            if (node->left || node->right) return 0;
+            *result = node->value;
+            return 1;
+        case AST_UNOP:
+            if (!constant_value(node->left, &l)) return 0;
+            switch (node->value) {
+                case Sub: *result = (int)(0u - (unsigned int)l); return 1;
+                case Ne:  *result = !l; return 1;
+                case Xor: *result = ~l; return 1;
+            }
+            return 0;
+        case AST_BINOP:
+            if (!constant_value(node->left, &l)) return 0;
+            if (node->value == Cond) return constant_value(l ? node->right->left : node->right->right, result);
+            if (!constant_value(node->right, &r)) return 0;
+            return eval_binop(node->value, l, r, result);
+    }
+    return 0;
+}
+
+static void fold_binop(struct ast_node *node, int under_addr) {
+    struct ast_node *l = node->left, *r = node->right;
+    int value;
+
+    if (node->value == Cond) {
+        if (is_const(l)) replace(node, l->value ? r->left : r->right);
+        return;
+    }
+
+    if (is_const(l) && is_const(r)) {
+        if (eval_binop(node->value, l->value, r->value, &value)) make_const(node, value);
+        return;
+    }
+
+    /* Short circuit on a constant left operand, the right one is never evaluated */
+    if (is_const(l) && (node->value == Lan || node->value == Lor)) {
+        if (node->value == Lan && l->value == 0) make_const(node, 0);
+        else if (node->value == Lor && l->value != 0) make_const(node, 1);
+        return;
+    }
+
+    /* Array access expects the Add under AST_ADDR to stay in place */
+    if (under_addr) return;
+
+    switch (node->value) {
+        case Add:
+            if (is_value(r, 0)) replace(node, l);
+            else if (is_value(l, 0)) replace(node, r);
+            break;
+        case Sub:
+        case Shl:
+        case Shr:
+            if (is_value(r, 0)) replace(node, l);
+            break;
+        case Or:
+        case Xor:
+            if (is_value(r, 0)) replace(node, l);
+            else if (is_value(l, 0)) replace(node, r);
+            break;
+        case Div:
+            if (is_value(r, 1)) replace(node, l);
+            break;
+        case Mul:
+            if (is_value(r, 1)) replace(node, l);
+            else if (is_value(l, 1)) replace(node, r);
+            else if ((is_value(r, 0) && !has_side_effects(l)) || (is_value(l, 0) && !has_side_effects(r))) make_const(node, 0);
+            break;
+        case And:
+            if ((is_value(r, 0) && !has_side_effects(l)) || (is_value(l, 0) && !has_side_effects(r))) make_const(node, 0);
+            break;
+    }
+}
+
+static void fold_unop(struct ast_node *node) {
+    if (!is_const(node->left)) return;
+
+    switch (node->value) {
+        case Sub: make_const(node, (int)(0u - (unsigned int)node->left->value)); break;
+        case Ne:  make_const(node, !node->left->value); break;
+        case Xor: make_const(node, ~node->left->value); break;
+    }
+}
+
+static void fold(struct ast_node *node, int under_addr) {
+    /* Statement lists and call arguments are chained through ->next */
+    for (; node; node = node->next, under_addr = 0) {
+        fold(node->left, node->type == AST_ADDR);
+        fold(node->right, 0);
+
+        if (node->type == AST_BINOP) {
+            fold_binop(node, under_addr);
+        } else if (node->type == AST_UNOP) {
+            fold_unop(node);
+        }
+    }
+}
+
+/**
+ * @brief Fold constant subtrees and simplify x+0, x*1, x*0 and similar identities.
+ * Nodes are rewritten in place, so shared subtrees and ->next chains stay intact.
+ * @return Number of nodes folded
+ */
+int fold_constants(struct ast_node *root) {
+    folded = 0;
+    fold(root, 0);
+    return folded;
+}
+
+/**
+ * Dead function elimination. Functions are reachable from main through
+ * calls and through taking their address, everything else is unlinked from
+ * the AST together with the string literals it uses. The data pool keeps its
+ * layout until data_compact() squeezes the strings out right before codegen,
+ * and data_relocate() maps the offsets of what is left.
+ */
+struct data_hole {
+    int offset;
+    int length;
+    int removed;    /* Bytes removed up to and including this hole */
+};
+
+static struct identifier **live;
+static int live_count;
+static unsigned char live_ids[MAX_FUNCTIONS];       /* Indexed by function id */
+static struct ast_node *enters[MAX_FUNCTIONS];      /* AST_ENTER of each function id */
+static struct identifier **dead;
+static int dead_count;
+static struct data_hole *holes;
+static int hole_count;
+static int hole_size;
+static int hole_bytes;
+
+static int is_live(struct identifier *sym) {
+    return live_ids[sym->val];
+}
+
+static void mark_live(struct identifier *sym, int max) {
+    if (is_live(sym) || live_count >= max) return;
+    live_ids[sym->val] = 1;
+    live[live_count++] = sym;
+}
+
+static void mark_references(struct ast_node *node, int max) {
+    for (; node && node->type != AST_ENTER; node = node->next) {
+        if (node->type == AST_ASM) continue;
+        if (node->type == AST_FUNCALL && node->sym_class == Fun) mark_live(node->sym, max);
+        if (node->type == AST_ADDR && node->left->type == AST_IDENT && node->left->sym_class == Fun) mark_live(node->left->sym, max);
+        mark_references(node->left, max);
+        mark_references(node->right, max);
+    }
+}
+
+/* Strings are referenced by their address truncated to int, like globals */
+static void add_hole(int offset) {
+    for (int i = 0; i < hole_count; i++) {
+        if (holes[i].offset == offset) return;
+    }
+    if (hole_count == hole_size) {
+        struct data_hole *grown = zmalloc((hole_size * 2 + 16) * sizeof(struct data_hole));
+        if (!grown) {
+            printf("Unable to malloc data holes\n");
+            exit(-1);
+        }
+        if (holes) memcpy(grown, holes, hole_count * sizeof(struct data_hole));
+        free(holes);
+        holes = grown;
+        hole_size = hole_size * 2 + 16;
+    }
+    /* Literals are lexed in source order, keep the holes sorted */
+    int i = hole_count++;
+    while (i > 0 && holes[i - 1].offset > offset) {
+        holes[i] = holes[i - 1];
+        i--;
+    }
+    holes[i].offset = offset;
+    holes[i].length = strlen(org_data + offset) + 1;
+}
+
+static void collect_strings(struct ast_node *node) {
+    for (; node && node->type != AST_ENTER; node = node->next) {
+        if (node->type == AST_ASM) continue;
+        if (node->type == AST_STR) add_hole(node->value - (long)org_data);
+        collect_strings(node->left);
+        collect_strings(node->right);
+    }
+}
+
+/**
+ * @brief Unlink functions that cannot be reached from main.
+ * @return Number of functions removed
+ */
+int shake_functions(struct ast_node **root) {
+    int functions = 0;
+    struct ast_node *main_enter = NULL;
+    for (struct ast_node *node = *root; node; node = node->next) {
+        if (node->type != AST_ENTER) continue;
+        functions++;
+        enters[node->sym->val] = node;
+        if (node->sym->name_length == 4 && !memcmp(node->sym->name, "main", 4)) main_enter = node;
+    }
+    if (!main_enter) return 0;
+
+    live = zmalloc(functions * sizeof(struct identifier *));
+    dead = zmalloc(functions * sizeof(struct identifier *));
+    if (!live || !dead) {
+        printf("Unable to malloc function lists\n");
+        exit(-1);
+    }
+
+    /* live doubles as the worklist, each function is scanned once */
+    mark_live(main_enter->sym, functions);
+    for (int i = 0; i < live_count; i++) {
+        struct ast_node *enter = enters[live[i]->val];
+        if (enter) mark_references(enter->next, functions);
+    }
+
+    /* Each function runs from its AST_ENTER up to the next one */
+    struct ast_node *prev = NULL, *node = *root;
+    while (node) {
+        struct ast_node *last = node;
+        while (last->next && last->next->type != AST_ENTER) last = last->next;
+
+        if (node->type == AST_ENTER && !is_live(node->sym)) {
+            dead[dead_count++] = node->sym;
+            collect_strings(node->next);
+            if (prev) prev->next = last->next; else *root = last->next;
+        } else {
+            prev = last;
+        }
+        node = last->next;
+    }
+
+    for (int i = 0; i < hole_count; i++) {
+        hole_bytes += holes[i].length;
+        holes[i].removed = hole_bytes;
+    }
+    free(live);
+    live = NULL;
+    return dead_count;
+}
+
+/**
+ * @brief Remove the strings of dead functions from the data pool in place.
+ * @return New size of the pool
+ */
+int data_compact(char *data, int size) {
+    int to = 0, from = 0;
+    for (int i = 0; i <= hole_count; i++) {
+        int end = i < hole_count ? holes[i].offset : size;
+        while (from < end) data[to++] = data[from++];
+        if (i < hole_count) from += holes[i].length;
+    }
+    return to;
+}
+
+/* Offset in the compacted data pool of a byte that was at offset */
+int data_relocate(int offset) {
+    int lo = 0, hi = hole_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (holes[mid].offset < offset) lo = mid + 1; else hi = mid;
+    }
+    return lo ? offset - holes[lo - 1].removed : offset;
+}
+
+void shake_print_stats() {
+    printf("  removed:   %8d functions, %d bytes of strings\n", dead_count, hole_bytes);
+    for (int i = 0; i < dead_count; i++) {
+        printf("    %.*s\n", dead[i]->name_length, dead[i]->name);
+    }
+}
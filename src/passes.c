@@ -0,0 +1,110 @@
+/**
+ * @file passes.c
+ * @brief Pass manager, runs the optimization passes enabled by the -O level.
+ *
+ * AST passes run once over the whole program after parsing, IR passes run
+ * in table order on each function before code generation. Entries without
+ * a run function are decisions of the lowering and the code generator,
+ * which ask pass_enabled() and time their work with pass_begin() and
+ * pass_end() themselves. -fno-<name> turns a pass off at any level.
+ */
+#include <passes.h>
+#include <cc.h>
+#include <io.h>
+
+static int fold_pass(struct ast_node **root) {
+    return fold_constants(*root);
+}
+
+/* Inlined calls are only ever made to functions recorded before */
+static void inline_pass(struct ir_func *fn) {
+    ir_inline_calls(fn);
+    ir_inline_record(fn);
+}
+
+struct pass passes[PASS_COUNT] = {
+    [PASS_FOLD]         = { .name = "fold",         .level = 0, .unit = "nodes", .run_ast = fold_pass },
+    [PASS_EVAL]         = { .name = "eval",         .level = 2, .unit = "nodes", .run_ast = evaluate_calls },
+    [PASS_SHAKE]        = { .name = "shake",        .level = 1, .unit = "nodes", .run_ast = shake_functions },
+    [PASS_INLINE]       = { .name = "inline",       .level = 2, .unit = "insns", .run_ir = inline_pass },
+    [PASS_PROMOTE]      = { .name = "promote",      .level = 1, .unit = "insns", .run_ir = ir_promote_locals },
+    [PASS_LICM]         = { .name = "licm",         .level = 2, .unit = "insns", .run_ir = ir_hoist_invariants },
+    [PASS_JUMP_TABLES]  = { .name = "jump-tables",  .level = 1 },
+    [PASS_ADDRESSING]   = { .name = "addressing",   .level = 1, .unit = "insns" },
+    [PASS_STRENGTH]     = { .name = "strength",     .level = 1 },
+    [PASS_TAIL_CALLS]   = { .name = "tail-calls",   .level = 1 },
+    [PASS_PEEPHOLE]     = { .name = "peephole",     .level = 1, .unit = "bytes" },
+};
+
+int pass_enabled(int id) {
+    return config.opt_level >= passes[id].level && !passes[id].disabled;
+}
+
+/* Returns 0 if there is no pass called name */
+int pass_disable(const char *name) {
+    for (int id = 0; id < PASS_COUNT; id++) {
+        if (strcmp(passes[id].name, name) == 0) {
+            passes[id].disabled = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+long pass_begin() {
+    return cc_clock_us();
+}
+
+void pass_end(int id, long start, int delta) {
+    passes[id].time += cc_clock_us() - start;
+    passes[id].delta += delta;
+    passes[id].runs++;
+}
+
+/* Statements are chained through next, expressions through left and right */
+static int count_nodes(struct ast_node *node) {
+    int count = 0;
+    for (; node; node = node->next) {
+        count += 1 + count_nodes(node->left) + count_nodes(node->right);
+    }
+    return count;
+}
+
+int ir_count_insns(struct ir_func *fn) {
+    int count = 0;
+    for (int i = 0; i < fn->insn_count; i++) count += fn->insns[i].op != IR_NOP;
+    return count;
+}
+
+void passes_run_ast(struct ast_node **root) {
+    for (int id = 0; id < PASS_COUNT; id++) {
+        if (!passes[id].run_ast || !pass_enabled(id)) continue;
+        int before = config.time_passes ? count_nodes(*root) : 0;
+        long start = pass_begin();
+        passes[id].changes += passes[id].run_ast(root);
+        pass_end(id, start, config.time_passes ? count_nodes(*root) - before : 0);
+    }
+}
+
+void passes_run_ir(struct ir_func *fn) {
+    for (int id = 0; id < PASS_COUNT; id++) {
+        if (!passes[id].run_ir || !pass_enabled(id)) continue;
+        int before = config.time_passes ? ir_count_insns(fn) : 0;
+        long start = pass_begin();
+        passes[id].run_ir(fn);
+        pass_end(id, start, config.time_passes ? ir_count_insns(fn) - before : 0);
+    }
+}
+
+void passes_print_times() {
+    printf("Pass times (-O%d):\n", config.opt_level);
+    for (int id = 0; id < PASS_COUNT; id++) {
+        struct pass *p = passes + id;
+        int pad = 12 - (int)strlen(p->name);
+        if (!pass_enabled(id) || !p->unit) {
+            printf("  %s:%*s%11s\n", p->name, pad, "", pass_enabled(id) ? "enabled" : "disabled");
+        } else {
+            printf("  %s:%*s%8ld us  %d %s\n", p->name, pad, "", p->time, p->delta, p->unit);
+        }
+    }
+}
@@ -0,0 +1,467 @@
+/**
+ * @file peephole.c
+ * @brief Peephole optimizer over the machine code of one function.
+ *
+ * The bytes emitted for a function are decoded into an instruction list,
+ * rewritten with the patterns in peephole_patterns[] until none applies,
+ * and laid out again with jumps shortened to rel8 where the target is close.
+ * Only encodings produced by genx86.c are decoded, a function containing
+ * anything else is left untouched.
+ */
+#include <peephole.h>
+#include <cc.h>
+
+#define JMP -1          /* x86_insn.cc of an unconditional jump */
+#define NOT_JUMP -2
+#define MAX_PASSES 8
+
+struct x86_insn {
+    unsigned char bytes[16];
+    unsigned char len;
+    unsigned char deleted;
+    unsigned char label;    /* Target of a jump, patterns must not span it */
+    unsigned char is_short; /* Jump with a rel8 displacement */
+    signed char cc;         /* Condition code of a jump, JMP or NOT_JUMP */
+    int target;             /* Jumps: instruction index, calls and tail calls: code offset */
+    int offset;             /* Code offset, updated by layout() */
+};
+
+struct peephole_stats peephole_stats;
+
+static struct x86_insn *insns;
+static int count;
+
+/* Length of a ModRM operand with its SIB byte and displacement */
+static int modrm_length(unsigned char *p) {
+    int mod = p[0] >> 6, rm = p[0] & 7, len = 1;
+    if (mod != 3 && rm == 4) {
+        len++;
+        if (mod == 0 && (p[1] & 7) == 5) len += 4;
+    }
+    if (mod == 0 && rm == 5) len += 4;
+    if (mod == 1) len += 1;
+    if (mod == 2) len += 4;
+    return len;
+}
+
+/* Length of the instruction at p, 0 if genx86.c does not emit it */
+static int x86_length(unsigned char *p) {
+    if (p[0] >= 0x50 && p[0] <= 0x5f) return 1;
+    if (p[0] >= 0x70 && p[0] <= 0x7f) return 2;
+    if (p[0] >= 0xb8 && p[0] <= 0xbf) return 5;
+    switch (p[0]) {
+        case 0x4f: case 0x99: case 0xc3: case 0xc9: case 0xec: case 0xee:
+            return 1;
+        case 0x6a: case 0xcd: case 0xeb:
+            return 2;
+        case 0x68: case 0xe8: case 0xe9:
+            return 5;
+        case 0x01: case 0x03: case 0x09: case 0x0b: case 0x21: case 0x23: case 0x29: case 0x2b:
+        case 0x31: case 0x33: case 0x39: case 0x3b: case 0x85: case 0x88: case 0x89: case 0x8b:
+        case 0x8d: case 0x8f: case 0xd3: case 0xf7: case 0xff:
+            return 1 + modrm_length(p + 1);
+        case 0x6b: case 0x83: case 0xc1: case 0xc6:
+            return 2 + modrm_length(p + 1);
+        case 0x69: case 0x81: case 0xc7:
+            return 5 + modrm_length(p + 1);
+        case 0x0f:
+            if (p[1] >= 0x80 && p[1] <= 0x8f) return 6;
+            if ((p[1] >= 0x90 && p[1] <= 0x9f) || p[1] == 0xaf || p[1] == 0xb6) return 2 + modrm_length(p + 2);
+            break;
+    }
+    return 0;
+}
+
+static int rel32(unsigned char *p) {
+    return *((int*)p);
+}
+
+/* Index of the instruction at code offset pos, count for the end, -1 if none starts there */
+static int find_insn(int pos, int end) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (insns[mid].offset < pos) lo = mid + 1; else hi = mid;
+    }
+    if (lo == count ? pos != end : insns[lo].offset != pos) return -1;
+    return lo;
+}
+
+/* Decode code[start, end) into insns, returns 0 if something is not understood */
+static int decode(unsigned char *code, int start, int end) {
+    count = 0;
+    for (int pos = start; pos < end; count++) {
+        struct x86_insn *insn = insns + count;
+        unsigned char *p = code + pos;
+        int len = x86_length(p);
+        if (!len) return 0;
+
+        memcpy(insn->bytes, p, len);
+        insn->len = len;
+        insn->offset = pos;
+        insn->cc = NOT_JUMP;
+        insn->target = -1;
+        if (p[0] == 0xe9) {
+            insn->cc = JMP;
+            insn->target = pos + 5 + rel32(p + 1);
+        } else if (p[0] == 0xeb) {
+            insn->cc = JMP;
+            insn->target = pos + 2 + (signed char)p[1];
+        } else if (p[0] >= 0x70 && p[0] <= 0x7f) {
+            insn->cc = p[0] & 15;
+            insn->target = pos + 2 + (signed char)p[1];
+        } else if (p[0] == 0x0f && p[1] >= 0x80 && p[1] <= 0x8f) {
+            insn->cc = p[1] & 15;
+            insn->target = pos + 6 + rel32(p + 2);
+        } else if (p[0] == 0xe8) {
+            insn->target = pos + 5 + rel32(p + 1);
+        }
+        /* Tail calls jump out of the function, keep their target like a call's */
+        if (insn->cc == JMP && p[0] == 0xe9 && (insn->target < start || insn->target >= end)) insn->cc = NOT_JUMP;
+        pos += len;
+    }
+
+    /* Jump targets become instruction indices, count meaning the end of the function */
+    for (int i = 0; i < count; i++) {
+        if (insns[i].cc == NOT_JUMP) continue;
+        int target = find_insn(insns[i].target, end);
+        if (target < 0) return 0;
+        insns[i].target = target;
+        if (target < count) insns[target].label = 1;
+    }
+    return 1;
+}
+
+static int next(int i) {
+    do i++; while (i < count && insns[i].deleted);
+    return i;
+}
+
+/* First instruction left at or after i */
+static int resolve(int i) {
+    while (i < count && insns[i].deleted) i++;
+    return i;
+}
+
+/* Instruction j exists and is only reached from the one before it */
+static int follows(int j) {
+    return j < count && !insns[j].label;
+}
+
+static void delete(int i) {
+    int n = next(i);
+    if (insns[i].label && n < count) insns[n].label = 1;
+    insns[i].deleted = 1;
+}
+
+static int is_reg_mov(struct x86_insn *insn, int *src, int *dst) {
+    if (insn->len != 2 || insn->bytes[1] >> 6 != 3) return 0;
+    if (insn->bytes[0] == 0x89) {
+        *src = insn->bytes[1] >> 3 & 7;
+        *dst = insn->bytes[1] & 7;
+        return 1;
+    }
+    if (insn->bytes[0] == 0x8b) {
+        *dst = insn->bytes[1] >> 3 & 7;
+        *src = insn->bytes[1] & 7;
+        return 1;
+    }
+    return 0;
+}
+
+static void set_reg_mov(struct x86_insn *insn, int src, int dst) {
+    insn->bytes[0] = 0x89;
+    insn->bytes[1] = 0xc0 | src << 3 | dst;
+    insn->len = 2;
+}
+
+enum { FLAGS_NONE, FLAGS_READ, FLAGS_WRITE };
+
+static int flags_effect(struct x86_insn *insn) {
+    unsigned char *b = insn->bytes;
+    /* Flags at the target of a jump are unknown, treat them as read */
+    if (insn->cc != NOT_JUMP) return FLAGS_READ;
+    switch (b[0]) {
+        case 0x0f:
+            if ((b[1] & 0xf0) == 0x90) return FLAGS_READ;
+            return b[1] == 0xaf ? FLAGS_WRITE : FLAGS_NONE;
+        case 0x01: case 0x03: case 0x09: case 0x0b: case 0x21: case 0x23: case 0x29: case 0x2b:
+        case 0x31: case 0x33: case 0x39: case 0x3b: case 0x4f: case 0x69: case 0x6b: case 0x81:
+        case 0x83: case 0x85: case 0xc1: case 0xd3: case 0xf7:
+        /* Flags are not preserved across calls and returns */
+        case 0xc3: case 0xcd: case 0xe8: case 0xe9:
+            return FLAGS_WRITE;
+    }
+    return FLAGS_NONE;
+}
+
+/* pushl %r1; popl %r2  ->  movl %r1, %r2 */
+static int push_pop(int i) {
+    int j = next(i);
+    if (!follows(j) || insns[i].len != 1 || insns[j].len != 1) return 0;
+    int push = insns[i].bytes[0], pop = insns[j].bytes[0];
+    if (push < 0x50 || push > 0x57 || pop < 0x58 || pop > 0x5f) return 0;
+
+    if ((push & 7) == (pop & 7)) {
+        delete(i);
+    } else {
+        set_reg_mov(insns + i, push & 7, pop & 7);
+    }
+    delete(j);
+    return 1;
+}
+
+/* pushl %r; popl M  ->  movl %r, M, for M not addressed through %esp */
+static int push_pop_mem(int i) {
+    int j = next(i);
+    struct x86_insn *pop = insns + j;
+    if (!follows(j) || insns[i].len != 1 || insns[i].bytes[0] < 0x50 || insns[i].bytes[0] > 0x57) return 0;
+    if (pop->bytes[0] != 0x8f || pop->bytes[1] >> 6 == 3 || (pop->bytes[1] & 7) == 4) return 0;
+    pop->bytes[0] = 0x89;
+    pop->bytes[1] |= (insns[i].bytes[0] & 7) << 3;
+    delete(i);
+    return 1;
+}
+
+/* movl %r1, %r2; movl %r2, %r1  ->  movl %r1, %r2 */
+static int mov_back(int i) {
+    int j = next(i), src1, dst1, src2, dst2;
+    if (!follows(j) || !is_reg_mov(insns + i, &src1, &dst1) || !is_reg_mov(insns + j, &src2, &dst2)) return 0;
+    if (src1 != dst2 || dst1 != src2) return 0;
+    delete(j);
+    return 1;
+}
+
+/* movl %r, %r  ->  nothing */
+static int self_mov(int i) {
+    int src, dst;
+    if (!is_reg_mov(insns + i, &src, &dst) || src != dst) return 0;
+    delete(i);
+    return 1;
+}
+
+/* movl %r1, M; movl M, %r2  ->  movl %r1, M; movl %r1, %r2 */
+static int store_reload(int i) {
+    int j = next(i);
+    struct x86_insn *store = insns + i, *load = insns + j;
+    if (!follows(j) || store->bytes[0] != 0x89 || load->bytes[0] != 0x8b) return 0;
+    if (store->bytes[1] >> 6 == 3 || store->len != load->len) return 0;
+    if ((store->bytes[1] & 0xc7) != (load->bytes[1] & 0xc7) || memcmp(store->bytes + 2, load->bytes + 2, store->len - 2)) return 0;
+
+    int src = store->bytes[1] >> 3 & 7, dst = load->bytes[1] >> 3 & 7;
+    if (src == dst) {
+        delete(j);
+    } else {
+        set_reg_mov(load, src, dst);
+    }
+    return 1;
+}
+
+/* setcc %al; movzb %al, %r; [movl %r, %r2;] cmpl $0, %r; je L  ->  the same with j<!cc> L and no cmpl */
+static int setcc_branch(int i) {
+    struct x86_insn *set = insns + i;
+    if (set->len != 3 || set->bytes[0] != 0x0f || (set->bytes[1] & 0xf0) != 0x90 || set->bytes[2] != 0xc0) return 0;
+
+    int j = next(i);
+    struct x86_insn *movzb = insns + j;
+    if (!follows(j) || movzb->len != 3 || movzb->bytes[0] != 0x0f || movzb->bytes[1] != 0xb6 || (movzb->bytes[2] & 0xc7) != 0xc0) return 0;
+    int reg = movzb->bytes[2] >> 3 & 7, copy = reg, src, dst;
+
+    int k = next(j);
+    if (follows(k) && is_reg_mov(insns + k, &src, &dst) && src == reg) {
+        copy = dst;
+        k = next(k);
+    }
+    struct x86_insn *cmp = insns + k;
+    if (!follows(k) || cmp->len != 3 || cmp->bytes[0] != 0x83 || (cmp->bytes[1] & 0xf8) != 0xf8 || cmp->bytes[2] != 0) return 0;
+    if ((cmp->bytes[1] & 7) != reg && (cmp->bytes[1] & 7) != copy) return 0;
+
+    int l = next(k);
+    if (!follows(l) || (insns[l].cc != 4 && insns[l].cc != 5)) return 0;
+    /* Condition codes come in pairs, the low bit negates */
+    insns[l].cc = insns[l].cc == 4 ? (set->bytes[1] & 15) ^ 1 : set->bytes[1] & 15;
+    delete(k);
+    return 1;
+}
+
+/* Jump to the next instruction  ->  nothing */
+static int jump_next(int i) {
+    if (insns[i].cc == NOT_JUMP || resolve(insns[i].target) != next(i)) return 0;
+    delete(i);
+    return 1;
+}
+
+/* Jump to a jmp  ->  jump to its target */
+static int jump_chain(int i) {
+    if (insns[i].cc == NOT_JUMP) return 0;
+    int t = resolve(insns[i].target);
+    if (t >= count || t == i || insns[t].cc != JMP || resolve(insns[t].target) == t) return 0;
+    insns[i].target = insns[t].target;
+    return 1;
+}
+
+/* movl $0, %r  ->  xorl %r, %r, unless the flags are read before they are set again */
+static int zero_reg(int i) {
+    struct x86_insn *insn = insns + i;
+    if (insn->len != 5 || insn->bytes[0] < 0xb8 || insn->bytes[0] > 0xbf || rel32(insn->bytes + 1) != 0) return 0;
+    for (int j = next(i); j < count; j = next(j)) {
+        int effect = flags_effect(insns + j);
+        if (effect == FLAGS_READ) return 0;
+        if (effect == FLAGS_WRITE) break;
+    }
+    int reg = insn->bytes[0] & 7;
+    insn->bytes[0] = 0x31;
+    insn->bytes[1] = 0xc0 | reg << 3 | reg;
+    insn->len = 2;
+    return 1;
+}
+
+/* addl $n, %esp; popl %ebp  ->  leave, %esp is %ebp - n when the frame is popped */
+static int leave(int i) {
+    struct x86_insn *add = insns + i;
+    int j = next(i);
+    if (!follows(j) || insns[j].len != 1 || insns[j].bytes[0] != 0x5d) return 0;
+    if (!(add->len == 6 && add->bytes[0] == 0x81 && add->bytes[1] == 0xc4) &&
+        !(add->len == 3 && add->bytes[0] == 0x83 && add->bytes[1] == 0xc4)) return 0;
+    add->bytes[0] = 0xc9;
+    add->len = 1;
+    delete(j);
+    return 1;
+}
+
+struct peephole_pattern {
+    const char *name;
+    int (*apply)(int i);
+    int hits;
+};
+
+/* Tried in order at every instruction, add new rewrites here */
+static struct peephole_pattern peephole_patterns[] = {
+    { "push-pop",     push_pop,     0 },
+    { "push-pop-mem", push_pop_mem, 0 },
+    { "mov-back",     mov_back,     0 },
+    { "self-mov",     self_mov,     0 },
+    { "store-reload", store_reload, 0 },
+    { "setcc-branch", setcc_branch, 0 },
+    { "jump-next",    jump_next,    0 },
+    { "jump-chain",   jump_chain,   0 },
+    { "zero-reg",     zero_reg,     0 },
+    { "leave",        leave,        0 },
+};
+#define PATTERN_COUNT (int)(sizeof(peephole_patterns) / sizeof(peephole_patterns[0]))
+
+static int jump_size(struct x86_insn *insn) {
+    if (insn->is_short) return 2;
+    return insn->cc == JMP ? 5 : 6;
+}
+
+/* Assign offsets from start, shortening jumps until nothing changes. Returns the end. */
+static int layout(int start) {
+    int end, changed = 1;
+    while (changed) {
+        changed = 0;
+        end = start;
+        for (int i = 0; i < count; i++) {
+            insns[i].offset = end;
+            if (insns[i].deleted) continue;
+            end += insns[i].cc == NOT_JUMP ? insns[i].len : jump_size(insns + i);
+        }
+        for (int i = 0; i < count; i++) {
+            struct x86_insn *insn = insns + i;
+            if (insn->deleted || insn->cc == NOT_JUMP || insn->is_short) continue;
+            int target = insn->target < count ? insns[insn->target].offset : end;
+            int disp = target - (insn->offset + 2);
+            if (disp >= -128 && disp <= 127) {
+                insn->is_short = 1;
+                peephole_stats.jumps++;
+                changed = 1;
+            }
+        }
+    }
+    return end;
+}
+
+static void encode(unsigned char *code, int end) {
+    for (int i = 0; i < count; i++) {
+        struct x86_insn *insn = insns + i;
+        unsigned char *p = code + insn->offset;
+        if (insn->deleted) continue;
+
+        if (insn->cc == NOT_JUMP) {
+            memcpy(p, insn->bytes, insn->len);
+            if (p[0] == 0xe8 || p[0] == 0xe9) *((int*)(p + 1)) = insn->target - (insn->offset + 5);
+            continue;
+        }
+        int target = insn->target < count ? insns[insn->target].offset : end;
+        if (insn->is_short) {
+            p[0] = insn->cc == JMP ? 0xeb : 0x70 + insn->cc;
+            p[1] = target - (insn->offset + 2);
+        } else if (insn->cc == JMP) {
+            p[0] = 0xe9;
+            *((int*)(p + 1)) = target - (insn->offset + 5);
+        } else {
+            p[0] = 0x0f;
+            p[1] = 0x80 + insn->cc;
+            *((int*)(p + 2)) = target - (insn->offset + 6);
+        }
+    }
+}
+
+/**
+ * @brief Optimize the function in code[start, end) in place.
+ * Calls keep their absolute targets, so the function must not move.
+ * labels are code offsets reached by other means than a direct jump, such as
+ * jump table entries, they are kept as jump targets and moved along.
+ * @return New end of the function
+ */
+int peephole(unsigned char *code, int start, int end, int *labels, int label_count) {
+    insns = zmalloc((end - start) * sizeof(struct x86_insn));
+    int *label_at = zmalloc((label_count + 1) * sizeof(int));
+    if (!insns || !label_at) {
+        printf("Unable to malloc peephole state\n");
+        exit(-1);
+    }
+    int ok = decode(code, start, end);
+    for (int k = 0; ok && k < label_count; k++) {
+        label_at[k] = find_insn(labels[k], end);
+        if (label_at[k] < 0) ok = 0;
+        else if (label_at[k] < count) insns[label_at[k]].label = 1;
+    }
+    if (!ok) {
+        free(insns);
+        free(label_at);
+        return end;
+    }
+
+    for (int pass = 0, changed = 1; changed && pass < MAX_PASSES; pass++) {
+        changed = 0;
+        for (int i = 0; i < count; i++) {
+            for (int p = 0; p < PATTERN_COUNT && !insns[i].deleted; p++) {
+                if (peephole_patterns[p].apply(i)) {
+                    peephole_patterns[p].hits++;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    int new_end = layout(start);
+    encode(code, new_end);
+    for (int k = 0; k < label_count; k++) {
+        labels[k] = label_at[k] < count ? insns[label_at[k]].offset : new_end;
+    }
+
+    for (int i = 0; i < count; i++) peephole_stats.insns += insns[i].deleted;
+    peephole_stats.bytes += end - new_end;
+    free(insns);
+    free(label_at);
+    return new_end;
+}
+
+void peephole_print_stats() {
+    printf("  peephole:  %8d insns, %d bytes removed, %d jumps shortened\n",
+        peephole_stats.insns, peephole_stats.bytes, peephole_stats.jumps);
+    for (int p = 0; p < PATTERN_COUNT; p++) {
+        printf("    %-14s %6d\n", peephole_patterns[p].name, peephole_patterns[p].hits);
+    }
+}
@@ -0,0 +1,406 @@
+/**
+ * @file regalloc.c
+ * @brief Promotion of scalar locals to vregs and linear scan register allocation.
+ *
+ * Register convention of the generated code:
+ *  %eax              scratch and return value, never allocated
+ *  %ebx, %esi, %edi  callee-saved, pushed by the prologue of functions using them
+ *  %ecx, %edx        caller-saved, only given to values not live across a call
+ *  %ebp, %esp        frame and stack pointer
+ * Values live across an instruction clobbering their register (calls,
+ * __interrupt, division and shifts) are given another register or spilled.
+ */
+#include <ir.h>
+#include <cc.h>
+
+static const int alloc_order[] = { ECX, EDX, EBX, ESI, EDI };
+#define ALLOC_REGS 5
+#define CALLEE_SAVED (1 << EBX | 1 << ESI | 1 << EDI)
+#define CALLER_SAVED (1 << ECX | 1 << EDX)
+
+struct ir_stats ir_stats;
+
+struct slot {
+    int offset;
+    int vreg;       /* Variable holding the local, 0 if it stays in memory */
+};
+
+static void *alloc_or_die(int size) {
+    void *ptr = zmalloc(size);
+    if (!ptr) {
+        printf("Unable to malloc register allocator state\n");
+        exit(-1);
+    }
+    return ptr;
+}
+
+/* The local is only read or written as a whole, its address never escapes */
+static int direct_access(struct ir_func *fn, int *uses, int *use_at, int v) {
+    if (uses[v] != 1) return 0;
+    struct ir_insn *use = fn->insns + use_at[v];
+    if (use->op == IR_LOAD) return use->a == v && use->imm == 0 && use->size == 4;
+    if (use->op == IR_STORE) return use->a == v && use->b != v && use->imm == 0 && use->size == 4;
+    return 0;
+}
+
+static void nop(struct ir_insn *insn) {
+    memset(insn, 0, sizeof(struct ir_insn));
+    insn->op = IR_NOP;
+}
+
+/* Parameters are loaded into their variable once, on function entry */
+static void load_params(struct ir_func *fn, struct slot *slots, int slot_count) {
+    int params = 0;
+    for (int s = 0; s < slot_count; s++) {
+        if (slots[s].vreg && slots[s].offset > 0) params++;
+    }
+    if (!params) return;
+
+    int count = fn->insn_count + params * 2;
+    struct ir_insn *insns = alloc_or_die(count * sizeof(struct ir_insn));
+    struct ir_insn *insn = insns;
+    for (int s = 0; s < slot_count; s++) {
+        if (!slots[s].vreg || slots[s].offset < 0) continue;
+        insn->op = IR_LOCAL;
+        insn->dst = ++fn->vregs;
+        insn->imm = slots[s].offset;
+        insn++;
+        insn->op = IR_LOAD;
+        insn->dst = slots[s].vreg;
+        insn->a = fn->vregs;
+        insn->size = 4;
+        insn++;
+    }
+    memcpy(insn, fn->insns, fn->insn_count * sizeof(struct ir_insn));
+    free(fn->insns);
+    fn->insns = insns;
+    fn->insn_count = fn->insn_capacity = count;
+
+    fn->blocks[0].count += params * 2;
+    for (int b = 1; b < fn->block_count; b++) fn->blocks[b].start += params * 2;
+}
+
+/**
+ * @brief Turn locals and parameters whose address is never taken into vregs.
+ * Loads become IR_MOV from the variable, stores become IR_MOV into it, and a
+ * copy used before the variable changes again is replaced by the variable.
+ */
+void ir_promote_locals(struct ir_func *fn) {
+    int *uses = alloc_or_die((fn->vregs + 1) * sizeof(int));
+    int *use_at = alloc_or_die((fn->vregs + 1) * sizeof(int));
+    struct slot *slots = alloc_or_die((fn->insn_count + 1) * sizeof(struct slot));
+    int slot_count = 0, temps = fn->vregs;
+
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->a) { uses[insn->a]++; use_at[insn->a] = i; }
+        if (insn->b) { uses[insn->b]++; use_at[insn->b] = i; }
+    }
+
+    /* A slot is promoted unless one of its accesses is not direct */
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->op != IR_LOCAL) continue;
+        int s = 0;
+        while (s < slot_count && slots[s].offset != insn->imm) s++;
+        if (s == slot_count) {
+            slots[s].offset = insn->imm;
+            slots[s].vreg = -1;
+            slot_count++;
+        }
+        if (!insn->aux || !direct_access(fn, uses, use_at, insn->dst)) slots[s].vreg = 0;
+    }
+    for (int s = 0; s < slot_count; s++) {
+        if (!slots[s].vreg) continue;
+        slots[s].vreg = ++fn->vregs;
+        ir_stats.promoted++;
+    }
+
+    for (int i = 0; i < fn->insn_count; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        if (insn->op != IR_LOCAL) continue;
+        int s = 0;
+        while (slots[s].offset != insn->imm) s++;
+        if (!slots[s].vreg) continue;
+
+        struct ir_insn *use = fn->insns + use_at[insn->dst];
+        if (use->op == IR_LOAD) {
+            use->a = slots[s].vreg;
+        } else {
+            use->dst = slots[s].vreg;
+            use->a = use->b;
+            use->b = 0;
+        }
+        use->op = IR_MOV;
+        use->imm = 0;
+        use->size = 0;
+        nop(insn);
+    }
+
+    /* Copy propagation: t = mov x; ... use t  becomes  use x, if x is not assigned in between */
+    for (int b = 0; b < fn->block_count; b++) {
+        int end = fn->blocks[b].start + fn->blocks[b].count;
+        for (int i = fn->blocks[b].start; i < end; i++) {
+            struct ir_insn *insn = fn->insns + i;
+            if (insn->op != IR_MOV || insn->dst > temps || uses[insn->dst] != 1) continue;
+            int var = insn->a, j = use_at[insn->dst];
+            if (j <= i || j >= end) continue;
+
+            int k = i + 1;
+            while (k < j && fn->insns[k].dst != var) k++;
+            if (k < j) continue;
+
+            if (fn->insns[j].a == insn->dst) fn->insns[j].a = var;
+            if (fn->insns[j].b == insn->dst) fn->insns[j].b = var;
+            nop(insn);
+        }
+    }
+
+    /* Coalescing: t = x + 1; x = mov t  becomes  x = x + 1, if x is not touched in between */
+    for (int b = 0; b < fn->block_count; b++) {
+        int start = fn->blocks[b].start, end = start + fn->blocks[b].count;
+        for (int k = start; k < end; k++) {
+            struct ir_insn *insn = fn->insns + k;
+            if (insn->op != IR_MOV || insn->a > temps || uses[insn->a] != 1) continue;
+            int var = insn->dst, j = k - 1;
+            while (j >= start && fn->insns[j].dst != insn->a) {
+                struct ir_insn *between = fn->insns + j;
+                if (between->a == var || between->b == var || between->dst == var) break;
+                j--;
+            }
+            if (j < start || fn->insns[j].dst != insn->a) continue;
+            fn->insns[j].dst = var;
+            nop(insn);
+        }
+    }
+
+    load_params(fn, slots, slot_count);
+
+    free(uses);
+    free(use_at);
+    free(slots);
+}
+
+struct interval {
+    int vreg;
+    int start;
+    int end;
+    int forbid;     /* Registers clobbered while the value is live, as 1 << reg */
+};
+
+static int by_start(const void *a, const void *b) {
+    const struct interval *x = a, *y = b;
+    return x->start != y->start ? x->start - y->start : x->vreg - y->vreg;
+}
+
+/* Registers an instruction overwrites besides its destination */
+static int clobbers(struct ir_insn *insn, unsigned char *fixed) {
+    switch (insn->op) {
+        case IR_CALL:
+            return CALLER_SAVED;
+        case IR_BUILTIN:
+            return insn->imm == INTERRUPT ? CALLER_SAVED | CALLEE_SAVED : 1 << EDX;
+        case IR_BIN:
+            if (insn->aux == Div || insn->aux == Mod) return 1 << EDX;
+            if ((insn->aux == Shl || insn->aux == Shr) && !fixed[insn->b]) return 1 << ECX;
+            break;
+    }
+    return 0;
+}
+
+#define BIT_SET(set, v) ((set)[(v) >> 5] |= 1u << ((v) & 31))
+#define BIT_TEST(set, v) ((set)[(v) >> 5] >> ((v) & 31) & 1)
+
+/* Add the values live into block b to live */
+static void live_into(unsigned int *live, unsigned int *in, int words, int b) {
+    for (int w = 0; w < words; w++) live[w] |= in[b * words + w];
+}
+
+/**
+ * Live ranges from block level liveness, every vreg gets a single range
+ * from its first to its last live instruction, loops included.
+ */
+static void live_ranges(struct ir_func *fn, struct interval *iv) {
+    int words = (fn->vregs + 32) / 32;
+    unsigned int *use = alloc_or_die(fn->block_count * words * sizeof(int));
+    unsigned int *def = alloc_or_die(fn->block_count * words * sizeof(int));
+    unsigned int *in = alloc_or_die(fn->block_count * words * sizeof(int));
+    unsigned int *out = alloc_or_die(fn->block_count * words * sizeof(int));
+
+    for (int b = 0; b < fn->block_count; b++) {
+        unsigned int *u = use + b * words, *d = def + b * words;
+        for (int i = fn->blocks[b].start; i < fn->blocks[b].start + fn->blocks[b].count; i++) {
+            struct ir_insn *insn = fn->insns + i;
+            if (insn->a && !BIT_TEST(d, insn->a)) BIT_SET(u, insn->a);
+            if (insn->b && !BIT_TEST(d, insn->b)) BIT_SET(u, insn->b);
+            if (insn->index && !BIT_TEST(d, insn->index)) BIT_SET(u, insn->index);
+            if (insn->dst) BIT_SET(d, insn->dst);
+        }
+    }
+
+    unsigned int *live = alloc_or_die(words * sizeof(int));
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int b = fn->block_count - 1; b >= 0; b--) {
+            struct ir_insn *last = fn->blocks[b].count ? fn->insns + fn->blocks[b].start + fn->blocks[b].count - 1 : NULL;
+            memset(live, 0, words * sizeof(int));
+            if (last && last->op == IR_JMP) {
+                live_into(live, in, words, last->imm);
+            } else if (!last || last->op != IR_RET) {
+                if (b + 1 < fn->block_count) live_into(live, in, words, b + 1);
+                if (last && last->op == IR_JCC) live_into(live, in, words, last->imm);
+                if (last && last->op == IR_SWITCH) {
+                    struct ir_table *table = fn->tables + last->imm;
+                    for (int e = 0; e < table->count; e++) live_into(live, in, words, table->blocks[e]);
+                }
+            }
+
+            unsigned int *o = out + b * words, *n = in + b * words;
+            for (int w = 0; w < words; w++) {
+                unsigned int live_in = use[b * words + w] | (live[w] & ~def[b * words + w]);
+                if (live[w] != o[w] || live_in != n[w]) changed = 1;
+                o[w] = live[w];
+                n[w] = live_in;
+            }
+        }
+    }
+    free(live);
+
+    for (int v = 0; v <= fn->vregs; v++) {
+        iv[v].vreg = v;
+        iv[v].start = fn->insn_count;
+        iv[v].end = -1;
+    }
+    for (int b = 0; b < fn->block_count; b++) {
+        int first = fn->blocks[b].start, last = first + fn->blocks[b].count - 1;
+        for (int v = 1; v <= fn->vregs; v++) {
+            if (BIT_TEST(in + b * words, v) && first < iv[v].start) iv[v].start = first;
+            if (BIT_TEST(out + b * words, v) && last > iv[v].end) iv[v].end = last;
+        }
+        for (int i = first; i <= last; i++) {
+            struct ir_insn *insn = fn->insns + i;
+            int vs[4] = { insn->dst, insn->a, insn->b, insn->index };
+            for (int k = 0; k < 4; k++) {
+                if (!vs[k]) continue;
+                if (i < iv[vs[k]].start) iv[vs[k]].start = i;
+                if (i > iv[vs[k]].end) iv[vs[k]].end = i;
+            }
+        }
+    }
+
+    free(use);
+    free(def);
+    free(in);
+    free(out);
+}
+
+static void spill(struct ir_func *fn, int v) {
+    fn->reg[v] = REG_SPILLED;
+    fn->frame_size += 4;
+    fn->slot[v] = -fn->frame_size;
+    fn->spills++;
+    ir_stats.spilled++;
+}
+
+/**
+ * @brief Assign a register or a frame slot to every vreg, see the convention above.
+ * Vregs marked in fixed are encoded directly by their user and get no location.
+ */
+void ir_allocate_registers(struct ir_func *fn, unsigned char *fixed) {
+    int n = fn->insn_count;
+    struct interval *iv = alloc_or_die((fn->vregs + 1) * sizeof(struct interval));
+    int *hint = alloc_or_die((fn->vregs + 1) * sizeof(int));
+    unsigned char *used = alloc_or_die(fn->vregs + 1);
+    int *clobbered = alloc_or_die(8 * (n + 1) * sizeof(int));
+    fn->reg = alloc_or_die(fn->vregs + 1);
+    fn->slot = alloc_or_die((fn->vregs + 1) * sizeof(int));
+    fn->saved_regs = 0;
+    fn->spills = 0;
+
+    live_ranges(fn, iv);
+
+    /* clobbered[r * (n + 1) + i] counts instructions before i overwriting register r */
+    for (int i = 0; i < n; i++) {
+        int mask = clobbers(fn->insns + i, fixed);
+        if (mask & CALLEE_SAVED) fn->saved_regs |= mask & CALLEE_SAVED;
+        for (int r = 0; r < 8; r++) {
+            clobbered[r * (n + 1) + i + 1] = clobbered[r * (n + 1) + i] + (mask >> r & 1);
+        }
+    }
+    fn->reg[0] = REG_NONE;
+    for (int v = 1; v <= fn->vregs; v++) {
+        fn->reg[v] = REG_NONE;
+        if (iv[v].end <= iv[v].start) continue;
+        for (int r = 0; r < 8; r++) {
+            int *count = clobbered + r * (n + 1);
+            if (count[iv[v].end] - count[iv[v].start + 1] > 0) iv[v].forbid |= 1 << r;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        struct ir_insn *insn = fn->insns + i;
+        used[insn->a] = used[insn->b] = used[insn->index] = 1;
+        /* cdq overwrites %edx before the divisor is read, division by a constant reads the dividend after it */
+        if (insn->op == IR_BIN && (insn->aux == Div || insn->aux == Mod)) {
+            iv[insn->a].forbid |= 1 << EDX;
+            iv[insn->b].forbid |= 1 << EDX;
+        }
+        if (insn->op == IR_MOV) {
+            if (!hint[insn->dst]) hint[insn->dst] = insn->a;
+            if (!hint[insn->a]) hint[insn->a] = insn->dst;
+        }
+    }
+
+    /* Only values that are used need a location */
+    int count = 0;
+    for (int v = 1; v <= fn->vregs; v++) {
+        if (used[v] && !fixed[v]) iv[count++] = iv[v];
+    }
+    qsort(iv, count, sizeof(struct interval), by_start);
+
+    int active[8];
+    for (int r = 0; r < 8; r++) active[r] = -1;
+
+    for (int c = 0; c < count; c++) {
+        struct interval *cur = iv + c;
+        int reg = -1;
+
+        /* A register is free again after the last use of its value, which may be cur's definition */
+        for (int r = 0; r < 8; r++) {
+            if (active[r] >= 0 && iv[active[r]].end <= cur->start) active[r] = -1;
+        }
+
+        int h = hint[cur->vreg];
+        if (h && fn->reg[h] >= 0 && active[(int)fn->reg[h]] < 0 && !(cur->forbid >> fn->reg[h] & 1)) {
+            reg = fn->reg[h];
+        }
+        for (int k = 0; reg < 0 && k < ALLOC_REGS; k++) {
+            int r = alloc_order[k];
+            if (active[r] < 0 && !(cur->forbid >> r & 1)) reg = r;
+        }
+
+        if (reg < 0) {
+            /* Out of registers, spill whichever value is live the longest */
+            int victim = -1;
+            for (int k = 0; k < ALLOC_REGS; k++) {
+                int r = alloc_order[k];
+                if (active[r] < 0 || (cur->forbid >> r & 1)) continue;
+                if (victim < 0 || iv[active[r]].end > iv[active[victim]].end) victim = r;
+            }
+            if (victim < 0 || iv[active[victim]].end <= cur->end) {
+                spill(fn, cur->vreg);
+                continue;
+            }
+            spill(fn, iv[active[victim]].vreg);
+            reg = victim;
+        }
+
+        fn->reg[cur->vreg] = reg;
+        active[reg] = c;
+        if ((1 << reg) & CALLEE_SAVED) fn->saved_regs |= 1 << reg;
+    }
+
+    free(iv);
+    free(hint);
+    free(used);
+    free(clobbered);
+}
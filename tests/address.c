@@ -0,0 +1,100 @@
+#include "./lib/test.c"
+
+// File that tests array and pointer accesses folded into scaled index addressing
+int table[16];
+
+struct pair {
+    int a;
+    int* items;
+};
+
+int shifted(int* p, int i){
+    return p[i + 1] + p[i - 1];
+}
+
+int pressure(int* p, char* s, int i, int j){
+    int a;
+    int b;
+    int c;
+    int d;
+    int e;
+    int f;
+
+    // Enough live values that some addresses and indexes end up in the frame
+    a = p[i];
+    b = p[j];
+    c = s[i];
+    d = s[j];
+    e = a + b;
+    f = c + d;
+    p[i + j] = e + f;
+    p[j] = p[i] + a + b + c + d + e + f;
+    return a + b + c + d + e + f + p[i + j];
+}
+
+int crowded(int* p, int* q, int* r, int i, int j, int k){
+    // More bases and indexes live at once than there are registers
+    p[i] = q[j] + r[k];
+    q[k] = p[j] + r[i];
+    r[j] = p[k] + q[i];
+    return p[i] + p[j] + p[k] + q[i] + q[j] + q[k] + r[i] + r[j] + r[k];
+}
+
+int main(){
+    int local[8];
+    char bytes[8];
+    int i;
+    int* p;
+    struct pair pr;
+
+    i = 0;
+    while (i < 16) {
+        table[i] = i * 3;
+        i = i + 1;
+    }
+    test(table[5] == 15);
+    test(table[15] == 45);
+
+    i = 0;
+    while (i < 8) {
+        local[i] = 100 + i;
+        bytes[i] = i + 65;
+        i = i + 1;
+    }
+    i = 3;
+    test(local[i] == 103);
+    test(local[i + 2] == 105);
+    test(local[i - 3] == 100);
+    test(bytes[i] == 68);
+    test(shifted(local, 4) == 103 + 105);
+    test(shifted(table, 1) == 6);
+
+    p = local;
+    test(p[i + 1] == 104);
+
+    pr.items = table;
+    i = 7;
+    pr.items[i] = 70;
+    test(pr.items[i] == 70);
+    test(table[7] == 70);
+
+    local[1] = 2;
+    local[2] = 3;
+    bytes[1] = 5;
+    bytes[2] = 7;
+    test(pressure(local, bytes, 1, 2) == 2 + 3 + 5 + 7 + 5 + 12 + 17);
+    test(local[3] == 17);
+    test(local[2] == 2 + 2 + 3 + 5 + 7 + 5 + 12);
+
+    i = 0;
+    while (i < 8) {
+        local[i] = i;
+        table[i] = 10 * i;
+        i = i + 1;
+    }
+    // p and r alias: p[1] = 20 + 3, q[3] = 2 + 23, r[2] = 3 + 10
+    test(crowded(local, table, local, 1, 2, 3) == 23 + 13 + 3 + 10 + 20 + 25 + 23 + 13 + 3);
+    test(table[3] == 25);
+
+    return 0;
+}
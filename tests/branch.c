@@ -0,0 +1,73 @@
+#include "./lib/test.c"
+
+// File that tests conditions lowered to compare and branch
+int calls;
+
+int touch(int value){
+    calls = calls + 1;
+    return value;
+}
+
+int main(){
+    int a;
+    int b;
+    int c;
+    int count;
+
+    a = 3;
+    b = 5;
+
+    // Short-circuit skips the right operand
+    calls = 0;
+    if (a > b && touch(1)) {
+        c = 1;
+    }
+    test(calls == 0);
+    if (a < b || touch(1)) {
+        c = 2;
+    }
+    test(calls == 0);
+    test(c == 2);
+
+    calls = 0;
+    if (a < b && touch(0)) {
+        c = 3;
+    }
+    test(calls == 1);
+    test(c == 2);
+
+    // Logical operators as values
+    c = a < b && b < 10;
+    test(c == 1);
+    c = a > b || b > 10;
+    test(c == 0);
+    c = (a == 3) + (b != 5) + (a >= 3) + (b <= 4);
+    test(c == 2);
+
+    // Negation in branches and as a value
+    if (!(a == b)) {
+        c = 4;
+    }
+    test(c == 4);
+    c = !a;
+    test(c == 0);
+    c = !0;
+    test(c == 1);
+    c = ~a;
+    test(c == 0 - 4);
+
+    // Constant on the left of a loop condition
+    count = 0;
+    while (10 > count) {
+        count = count + 1;
+    }
+    test(count == 10);
+
+    count = 0;
+    while (count < 20 && !(count == 7)) {
+        count = count + 1;
+    }
+    test(count == 7);
+
+    return 0;
+}
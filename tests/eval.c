@@ -0,0 +1,134 @@
+#include "./lib/test.c"
+
+// File that tests calls with constant arguments evaluated at compile time
+int calls;
+
+struct point {
+    int x;
+    int y;
+};
+
+int fib(int n){
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
+
+int sum_to(int n){
+    int i;
+    int sum;
+
+    sum = 0;
+    i = 1;
+    while (i <= n) {
+        sum = sum + i;
+        i = i + 1;
+    }
+    return sum;
+}
+
+int power(int base, int exp){
+    int result;
+
+    result = 1;
+    while (exp > 0) {
+        result = result * base;
+        exp = exp - 1;
+    }
+    return result;
+}
+
+int squares(int n){
+    int table[8];
+    int i;
+
+    // Local arrays live in the evaluator's own memory
+    i = 0;
+    while (i < 8) {
+        table[i] = i * i;
+        i = i + 1;
+    }
+    return table[n];
+}
+
+int letter(int n){
+    char text[4];
+
+    text[0] = 'a';
+    text[1] = 'b';
+    text[2] = 'c';
+    text[3] = 0;
+    return text[n];
+}
+
+void move(struct point* p, int dx){
+    p->x = p->x + dx;
+}
+
+int moved(int x, int dx){
+    struct point p;
+
+    // The address of p is passed to another call
+    p.x = x;
+    p.y = 0;
+    move(&p, dx);
+    return p.x;
+}
+
+int grade(int score){
+    switch (score / 10) {
+        case 10:
+        case 9: return 'A';
+        case 8: return 'B';
+        case 7: return 'C';
+        case 6: return 'D';
+    }
+    return 'F';
+}
+
+int counted(int n){
+    // Writes a global, must run each time it is called
+    calls = calls + 1;
+    return n * 2;
+}
+
+int count_twice(){
+    // Neither call can be evaluated, each must still run exactly once
+    return counted(1) + counted(2);
+}
+
+int spin(int n){
+    int i;
+
+    // Runs longer than the step budget
+    i = 0;
+    while (i < n) {
+        i = i + 1;
+    }
+    return i;
+}
+
+int main(){
+    test(fib(10) == 55);
+    test(sum_to(100) == 5050);
+    test(power(2, 10) == 1024);
+    test(squares(5) == 25);
+    test(letter(1) == 'b');
+    test(moved(3, 4) == 7);
+    test(grade(95) == 'A');
+    test(grade(71) == 'C');
+    test(grade(12) == 'F');
+    test(fib(sum_to(3)) * 2 == 16);
+
+    calls = 0;
+    test(counted(4) == 8);
+    test(counted(5) == 10);
+    test(calls == 2);
+    test(count_twice() == 6);
+    test(calls == 4);
+
+    test(spin(200000) == 200000);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "./lib/test.c"
+
+// File that tests expressions folded at compile time
+int calls;
+
+int count(){
+    calls = calls + 1;
+    return 3;
+}
+
+int main(){
+    int a;
+    int c;
+
+    a = 7;
+    calls = 0;
+
+    c = 2 * 3 + 4;
+    test(c == 10);
+
+    c = (1 << 4) - 6 / 2;
+    test(c == 13);
+
+    c = 17 % 5;
+    test(c == 2);
+
+    c = -(2 + 3);
+    test(c == -5);
+
+    c = a + 0;
+    test(c == 7);
+
+    c = 1 * a;
+    test(c == 7);
+
+    c = a * 0;
+    test(c == 0);
+
+    c = count() * 0;
+    test(c == 0);
+    test(calls == 1);
+
+    c = 0 && count();
+    test(c == 0);
+    test(calls == 1);
+
+    return 0;
+}
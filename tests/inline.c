@@ -0,0 +1,61 @@
+#include "./lib/test.c"
+
+// File that tests calls to small functions replaced by their bodies
+int counter;
+
+int max(int a, int b){
+    if (a > b) {
+        return a;
+    }
+    return b;
+}
+
+int bump(){
+    counter = counter + 1;
+}
+
+int clamp(int x){
+    return max(x, 0);
+}
+
+int first(int a, int b){
+    int buf[2];
+    buf[0] = a;
+    buf[1] = b;
+    return buf[0];
+}
+
+int through(int value){
+    int *p;
+    p = &value;
+    *p = *p + 1;
+    return value;
+}
+
+int main(){
+    int i;
+    int sum;
+
+    test(max(3, 7) == 7);
+    test(max(9, 2) == 9);
+    test(clamp(0 - 5) == 0);
+    test(clamp(4) == 4);
+
+    counter = 0;
+    bump();
+    bump();
+    test(counter == 2);
+
+    test(first(5, 6) == 5);
+    test(through(41) == 42);
+
+    sum = 0;
+    i = 0;
+    while (i < 10) {
+        sum = sum + max(i, 5);
+        i = i + 1;
+    }
+    test(sum == 60);
+
+    return 0;
+}
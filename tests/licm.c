@@ -0,0 +1,184 @@
+#include "./lib/test.c"
+
+// File that tests loop invariant code motion and the alias rules keeping loads in the loop
+int counter;
+
+struct data {
+    int a;
+    int b;
+};
+
+void bump(){
+    counter = counter + 1;
+}
+
+int rows(int w, int h){
+    int x;
+    int y;
+    int sum;
+
+    // y * w and the member loads below do not change in the inner loop
+    sum = 0;
+    y = 0;
+    while (y < h) {
+        x = 0;
+        while (x < w) {
+            sum = sum + y * w + x;
+            x = x + 1;
+        }
+        y = y + 1;
+    }
+    return sum;
+}
+
+int members(struct data* d, int n){
+    int i;
+    int sum;
+
+    sum = 0;
+    i = 0;
+    while (i < d->a) {
+        sum = sum + d->b * n;
+        i = i + 1;
+    }
+    return sum;
+}
+
+int stored(struct data* d){
+    int i;
+    int sum;
+
+    // d->a is written in the loop
+    sum = 0;
+    i = 0;
+    while (i < 4) {
+        sum = sum + d->a;
+        d->a = d->a + 1;
+        i = i + 1;
+    }
+    return sum;
+}
+
+int through_pointer(int* p){
+    int i;
+    int sum;
+
+    // p points to counter
+    sum = 0;
+    i = 0;
+    while (i < 3) {
+        sum = sum + counter;
+        *p = *p + 1;
+        i = i + 1;
+    }
+    return sum;
+}
+
+int calls(){
+    int i;
+    int sum;
+
+    // bump() changes counter
+    sum = 0;
+    i = 0;
+    while (i < 3) {
+        sum = sum + counter;
+        bump();
+        i = i + 1;
+    }
+    return sum;
+}
+
+int never_entered(struct data* d, int n){
+    int i;
+    int sum;
+
+    // d is 0 and n is 0, the body must not run
+    sum = 0;
+    i = 0;
+    while (i < n) {
+        sum = sum + d->a;
+        i = i + 1;
+    }
+    return sum;
+}
+
+int guarded(int d, int n){
+    int i;
+    int sum;
+
+    // The division only runs when d is not 0
+    sum = 0;
+    i = 0;
+    while (i < n) {
+        if (d != 0) {
+            sum = sum + 100 / d;
+        }
+        i = i + 1;
+    }
+    return sum;
+}
+
+int locals(){
+    struct data d;
+    int i;
+    int sum;
+
+    // d.b is not written in the loop, d.a is
+    d.a = 1;
+    d.b = 10;
+    sum = 0;
+    i = 0;
+    while (i < 3) {
+        sum = sum + d.b + d.a;
+        d.a = d.a + 1;
+        i = i + 1;
+    }
+    return sum;
+}
+
+int escaped(){
+    int values[4];
+    int* p;
+    int i;
+    int sum;
+
+    // values[1] is written through p
+    values[1] = 1;
+    p = values;
+    sum = 0;
+    i = 0;
+    while (i < 3) {
+        sum = sum + values[1];
+        p[1] = p[1] + 1;
+        i = i + 1;
+    }
+    return sum;
+}
+
+int main(){
+    struct data d;
+
+    test(rows(4, 3) == 0 + 1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10 + 11);
+
+    d.a = 5;
+    d.b = 3;
+    test(members(&d, 2) == 30);
+
+    d.a = 1;
+    test(stored(&d) == 1 + 2 + 3 + 4);
+    test(d.a == 5);
+
+    counter = 1;
+    test(through_pointer(&counter) == 1 + 2 + 3);
+    test(calls() == 4 + 5 + 6);
+    test(counter == 7);
+
+    test(never_entered(0, 0) == 0);
+    test(guarded(0, 3) == 0);
+    test(guarded(5, 3) == 60);
+    test(locals() == 11 + 12 + 13);
+    test(escaped() == 1 + 2 + 3);
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "./lib/test.c"
+
+// File that tests locals kept in registers
+int twice(int x){
+    return x + x;
+}
+
+int shift(int value, int count){
+    return (value << count) >> 1;
+}
+
+int pressure(int a, int b){
+    int c;
+    int d;
+    int e;
+    int f;
+    int g;
+    int h;
+
+    c = a + 1;
+    d = b + 2;
+    e = a * b;
+    f = c - d;
+    g = e + f;
+    h = twice(g);
+
+    // More values than registers are live across the call
+    return a + b + c + d + e + f + g + h;
+}
+
+int deep(int a, int b, int c, int d){
+    // Needs more registers than there are, the heavier operands are evaluated first
+    return ((a * b + c * d) * (a - d) + (b * c - a * d) * (c + d)) - (a + b) * ((c - a) * (d - b) + (a + c) * (b + d));
+}
+
+int main(){
+    int i;
+    int sum;
+    int q;
+    int r;
+    int *p;
+
+    sum = 0;
+    i = 0;
+    while (i < 10) {
+        sum = sum + twice(i);
+        i = i + 1;
+    }
+    test(sum == 90);
+    test(i == 10);
+
+    q = 47 / 5;
+    r = 47 % 5;
+    test(q == 9);
+    test(r == 2);
+    i = 0 - 47;
+    test(i / 5 == 0 - 9);
+
+    test(shift(3, 4) == 24);
+    test(pressure(3, 4) == 57);
+    test(deep(1, 2, 3, 4) == 0 - 112);
+
+    // An address-taken local stays in memory
+    p = &r;
+    *p = 5;
+    test(r == 5);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "./lib/test.c"
+
+// File that tests multiply, divide and modulo by constants
+int div8(int x){
+    return x / 8;
+}
+
+int mod8(int x){
+    return x % 8;
+}
+
+int div7(int x){
+    return x / 7;
+}
+
+int mod10(int x){
+    return x % 10;
+}
+
+int div_neg(int x){
+    return x / (0 - 4);
+}
+
+int main(){
+    int a;
+
+    a = 0 - 13;
+
+    test(div8(100) == 12);
+    test(div8(a) == 0 - 1);
+    test(mod8(100) == 4);
+    test(mod8(a) == 0 - 5);
+
+    test(div7(100) == 14);
+    test(div7(a) == 0 - 1);
+    test(div7(2147483647) == 306783378);
+    test(mod10(12345) == 5);
+    test(mod10(a) == 0 - 3);
+
+    test(div_neg(13) == 0 - 3);
+    test(div_neg(a) == 3);
+
+    test(a * 4 == 0 - 52);
+    test(a * 5 == 0 - 65);
+    test(a * 9 == 0 - 117);
+
+    return 0;
+}
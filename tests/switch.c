@@ -0,0 +1,183 @@
+#include "./lib/test.c"
+
+// File that tests switch statements, dispatched through jump tables and compare trees
+int dense(int x){
+    int r;
+    r = 0;
+    switch (x) {
+        case 0: r = 10; break;
+        case 1: r = 11; break;
+        case 2: r = 12; break;
+        case 3: r = 13; break;
+        case 5: r = 15; break;
+        case 6: r = 16; break;
+        default: r = 0 - 1;
+    }
+    return r;
+}
+
+int sparse(int x){
+    switch (x) {
+        case 0 - 1000: return 1;
+        case 7: return 2;
+        case 100: return 3;
+        case 1000: return 4;
+        case 5000: return 5;
+        case 10000: return 6;
+        case 123456: return 7;
+    }
+    return 0;
+}
+
+int mixed(int x){
+    // Two dense runs far apart and single cases around them
+    switch (x) {
+        case 0 - 50: return 1;
+        case 10: case 11: case 12: case 13: return 2;
+        case 14: return 3;
+        case 300: return 4;
+        case 1000: return 5;
+        case 1001: return 6;
+        case 1002: return 7;
+        case 1004: return 8;
+        case 9999: return 9;
+    }
+    return 0;
+}
+
+int fall(int x){
+    int r;
+    r = 0;
+    switch (x) {
+        case 1: r = r + 1;
+        case 2: r = r + 10;
+        default: r = r + 100;
+        case 3: r = r + 1000;
+            break;
+        case 4: r = 5;
+    }
+    return r;
+}
+
+int loops(int n){
+    int i;
+    int total;
+    i = 0;
+    total = 0;
+    while (i < n) {
+        // Break leaves the switch, not the loop
+        switch (i & 3) {
+            case 0: total = total + 1; break;
+            case 1: total = total + 2; break;
+            case 2:
+                if (i > 8) {
+                    break;
+                }
+                total = total + 4;
+                break;
+            case 3: total = total + 8;
+        }
+        i = i + 1;
+    }
+    return total;
+}
+
+int nested(int a, int b){
+    switch (a) {
+        case 1:
+            switch (b) {
+                case 1: return 11;
+                case 2: return 12;
+            }
+            return 10;
+        case 2: return 20;
+    }
+    return 0;
+}
+
+int nested_dense(int a, int b){
+    // Both switches go through jump tables
+    switch (a) {
+        case 0: return 100;
+        case 1: return 101;
+        case 2:
+            switch (b) {
+                case 0: return 20;
+                case 1: return 21;
+                case 2: return 22;
+                case 3: return 23;
+                case 4: return 24;
+                case 5: return 25;
+            }
+            return 29;
+        case 3: return 103;
+        case 4: return 104;
+    }
+    return 0 - 1;
+}
+
+int main(){
+    int i;
+    int sum;
+
+    test(dense(0) == 10);
+    test(dense(3) == 13);
+    test(dense(4) == 0 - 1);
+    test(dense(6) == 16);
+    test(dense(7) == 0 - 1);
+    test(dense(0 - 1) == 0 - 1);
+    test(dense(0 - 2147483647) == 0 - 1);
+
+    test(sparse(0 - 1000) == 1);
+    test(sparse(100) == 3);
+    test(sparse(5000) == 5);
+    test(sparse(123456) == 7);
+    test(sparse(101) == 0);
+    test(sparse(0) == 0);
+
+    sum = 0;
+    i = 0 - 60;
+    while (i < 10010) {
+        sum = sum + mixed(i);
+        i = i + 1;
+    }
+    test(sum == 1 + 8 + 3 + 4 + 5 + 6 + 7 + 8 + 9);
+    test(mixed(12) == 2);
+    test(mixed(1003) == 0);
+
+    test(fall(1) == 1111);
+    test(fall(2) == 1110);
+    test(fall(3) == 1000);
+    test(fall(4) == 5);
+    test(fall(9) == 1100);
+
+    test(loops(16) == 4 * 1 + 4 * 2 + 2 * 4 + 4 * 8);
+
+    test(nested(1, 2) == 12);
+    test(nested(1, 3) == 10);
+    test(nested(2, 1) == 20);
+    test(nested(3, 1) == 0);
+
+    test(nested_dense(2, 3) == 23);
+    test(nested_dense(2, 9) == 29);
+    test(nested_dense(4, 2) == 104);
+    sum = 0;
+    i = 0;
+    while (i < 6) {
+        sum = sum + nested_dense(2, i) + nested_dense(i, 0);
+        i = i + 1;
+    }
+    test(sum == 20 + 21 + 22 + 23 + 24 + 25 + 100 + 101 + 20 + 103 + 104 - 1);
+
+    // Break in a loop
+    i = 0;
+    while (1) {
+        i = i + 1;
+        if (i == 5) {
+            break;
+        }
+    }
+    test(i == 5);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "./lib/test.c"
+
+// File that tests calls in tail position turned into jumps
+int sum_to(int n, int acc){
+    if (n == 0) {
+        return acc;
+    }
+    return sum_to(n - 1, acc + (n & 3));
+}
+
+int count_down(int n){
+    if (n == 0) {
+        return 7;
+    }
+    return count_down(n - 1);
+}
+
+int scale(int x, int y){
+    // Not a tail call, the addition follows it
+    if (y == 0) {
+        return 0;
+    }
+    return x + scale(x, y - 1);
+}
+
+int forward(int a, int b){
+    return scale(b, a + 1);
+}
+
+int through(int n, int value){
+    int *p;
+    // The address of a parameter escapes, the call must keep its frame
+    p = &value;
+    if (n == 0) {
+        return *p;
+    }
+    return through(n - 1, *p + 1);
+}
+
+int main(){
+    // Deep enough to overflow the stack without tail calls
+    test(sum_to(3000000, 0) == 4500000);
+    test(count_down(5000000) == 7);
+    test(forward(3, 4) == 16);
+    test(through(100, 0) == 100);
+
+    return 0;
+}